@@ -37,6 +37,11 @@
 //#include <linux/videodev2.h>
 #include <linux/sched.h>
 #include <linux/module.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/time.h>
 
 #ifdef CONFIG_VIDEO_V4L1_COMPAT
 /* Include V4L1 specific functions. Should be removed soon */
@@ -46,17 +51,27 @@
 //#include <media/v4l2-common.h>
 
 #define SMARTCAM_MAJOR_VERSION 0
-#define SMARTCAM_MINOR_VERSION 1
-#define SMARTCAM_RELEASE 0
+#define SMARTCAM_MINOR_VERSION 5
+#define SMARTCAM_RELEASE 1
 #define SMARTCAM_VERSION KERNEL_VERSION(SMARTCAM_MAJOR_VERSION, SMARTCAM_MINOR_VERSION, SMARTCAM_RELEASE)
 
+/* default frame size, the consumer can pick any of frame_sizes[] (since 0.3.0) */
 #define SMARTCAM_FRAME_WIDTH	320
 #define SMARTCAM_FRAME_HEIGHT	240
-#define SMARTCAM_YUYV_FRAME_SIZE	SMARTCAM_FRAME_WIDTH * SMARTCAM_FRAME_HEIGHT * 2
-#define SMARTCAM_RGB_FRAME_SIZE	SMARTCAM_FRAME_WIDTH * SMARTCAM_FRAME_HEIGHT * 3
-#define SMARTCAM_BUFFER_SIZE	((SMARTCAM_RGB_FRAME_SIZE + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+#define SMARTCAM_MAX_FRAME_WIDTH	1920
+#define SMARTCAM_MAX_FRAME_HEIGHT	1080
+/* frames are written as RGB24 or in the capture format, RGB24 is the largest */
+#define SMARTCAM_MAX_FRAME_SIZE	(SMARTCAM_MAX_FRAME_WIDTH * SMARTCAM_MAX_FRAME_HEIGHT * 3)
+#define SMARTCAM_MAX_BUFFER_SIZE	PAGE_ALIGN(SMARTCAM_MAX_FRAME_SIZE)
+/* MJPEG frames are the phone jpegs, their size does not follow the capture size */
+#define SMARTCAM_MAX_JPEG_SIZE	(SMARTCAM_MAX_FRAME_WIDTH * SMARTCAM_MAX_FRAME_HEIGHT * 3 / 2)
 #define MAX_STREAMING_BUFFERS	7
-#define SMARTCAM_NFORMATS 2
+#define SMARTCAM_NFORMATS 5
+#define SMARTCAM_NFRAMESIZES 4
+/* private control, tells which matrix the writer converts YCbCr frames with */
+#define SMARTCAM_CID_COLOR_MATRIX	(V4L2_CID_PRIVATE_BASE + 0)
+#define SMARTCAM_COLOR_MATRIX_BT601	0
+#define SMARTCAM_COLOR_MATRIX_BT709	1
 
 //#define SMARTCAM_DEBUG
 #define SMARTCAM_DEBUG
@@ -74,38 +89,257 @@
 struct smartcam_private_data {
 };
 
+/* Streaming buffer states: IDLE buffers belong to the application,
+   QUEUED ones wait for a frame, ACTIVE is being filled by the writer
+   and DONE ones hold a complete frame until the application dequeues it. */
+enum smartcam_buffer_state {
+    SMARTCAM_BUF_IDLE = 0,
+    SMARTCAM_BUF_QUEUED,
+    SMARTCAM_BUF_ACTIVE,
+    SMARTCAM_BUF_DONE
+};
+
+struct smartcam_buffer {
+    struct list_head list;          /* queued_list or done_list */
+    char* data;                     /* buffer_size bytes in buffer_data */
+    enum smartcam_buffer_state state;
+    __u32 bytesused;
+    __u32 sequence;
+    struct timeval timestamp;       /* monotonic */
+};
+
+
+struct smartcam_format {
+    __u32 pixelformat;
+    char description[8];
+    int depth;                      /* bits per pixel, 0 for compressed formats */
+    int planar;                     /* bytesperline is the line of the Y plane */
+    int ycbcr;                      /* converted by the writer with color_matrix */
+    enum v4l2_colorspace colorspace;
+};
+
+static const struct smartcam_format formats[SMARTCAM_NFORMATS] = {
+    { V4L2_PIX_FMT_YUYV, "YUYV", 16, 0, 1, V4L2_COLORSPACE_JPEG },
+    { V4L2_PIX_FMT_NV12, "NV12", 12, 1, 1, V4L2_COLORSPACE_JPEG },
+    { V4L2_PIX_FMT_YUV420, "YU12", 12, 1, 1, V4L2_COLORSPACE_JPEG },
+    { V4L2_PIX_FMT_RGB24, "RGB3", 24, 0, 0, V4L2_COLORSPACE_SRGB },
+    { V4L2_PIX_FMT_MJPEG, "MJPG", 0, 0, 0, V4L2_COLORSPACE_JPEG },
+};
 
-static struct v4l2_pix_format formats[] = {
-{
-    .width = SMARTCAM_FRAME_WIDTH,
-    .height = SMARTCAM_FRAME_HEIGHT,
-    .pixelformat = V4L2_PIX_FMT_YUYV,
-    .field = V4L2_FIELD_NONE,
-    .bytesperline = SMARTCAM_YUYV_FRAME_SIZE / SMARTCAM_FRAME_HEIGHT,
-    .sizeimage = SMARTCAM_YUYV_FRAME_SIZE,
-    .colorspace = V4L2_COLORSPACE_SMPTE170M,
-    .priv = 0,
-}, {
-    .width = SMARTCAM_FRAME_WIDTH,
-    .height = SMARTCAM_FRAME_HEIGHT,
-    .pixelformat = V4L2_PIX_FMT_RGB24,
-    .field = V4L2_FIELD_NONE,
-    .bytesperline = SMARTCAM_RGB_FRAME_SIZE / SMARTCAM_FRAME_HEIGHT,
-    .sizeimage = SMARTCAM_RGB_FRAME_SIZE,
-    .colorspace = V4L2_COLORSPACE_SRGB,
-    .priv = 0,
-} };
-
-static const char fmtdesc[2][5] = { "YUYV", "RGB3" };
+static const struct v4l2_frmsize_discrete frame_sizes[SMARTCAM_NFRAMESIZES] = {
+    { 320, 240 },
+    { 640, 480 },
+    { 1280, 720 },
+    { SMARTCAM_MAX_FRAME_WIDTH, SMARTCAM_MAX_FRAME_HEIGHT },
+};
 
 static DECLARE_WAIT_QUEUE_HEAD(wq);
 
-static char* frame_data = NULL;
+/* Double buffered frame: frame N is in frame_buffers[N & 1]. The writer fills
+   the buffer of frame_sequence + 1 and publishes it by bumping frame_sequence,
+   readers copy the frame of frame_sequence and retry if frames_started shows
+   the writer began to overwrite it meanwhile. Neither side waits for the other. */
+static char* frame_buffers[2] = { NULL, NULL };
+static __u32 frame_bytes[2] = { 0, 0 };    /* length of the frame, varies for MJPEG */
 static __u32 frame_sequence = 0;
+static __u32 frames_started = 0;
 static __u32 last_read_frame = 0;
-static __u32 format = 0;
 static struct timeval frame_timestamp;
 
+/* Capture format, changed under both write_lock and queue_lock
+   so that holding either one gives a stable copy */
+static struct v4l2_pix_format cur_format;
+
+/* Matrix of the YCbCr formats, set by the writer through SMARTCAM_CID_COLOR_MATRIX
+   (since 0.5.1): full range BT.601 or limited range BT.709, the ranges the
+   colorspaces imply; changed under both locks too */
+static int color_matrix = SMARTCAM_COLOR_MATRIX_BT601;
+
+/* Streaming I/O: one buffer per mmap offset, owned by the file that requested them.
+   queue_lock protects the lists, the buffer states and the streaming state;
+   write_lock serializes the writers. */
+static char* buffer_data = NULL;
+static unsigned long buffer_size = 0;       /* page aligned cur_format.sizeimage */
+static int buffer_mappings = 0;             /* buffer_data is not freed while mapped */
+static char* orphan_data = NULL;            /* released while mapped, freed by the last unmap */
+static struct smartcam_buffer buffers[MAX_STREAMING_BUFFERS];
+static unsigned int buffer_count = 0;
+static LIST_HEAD(queued_list);
+static LIST_HEAD(done_list);
+static int streaming = 0;
+static struct file* stream_owner = NULL;
+static DEFINE_SPINLOCK(queue_lock);
+static DEFINE_MUTEX(write_lock);
+
+/* Caller holds write_lock or queue_lock */
+static void smartcam_fill_colorspace(const struct smartcam_format* fmt, struct v4l2_pix_format* pix)
+{
+    pix->colorspace = fmt->colorspace;
+    if (fmt->ycbcr && color_matrix == SMARTCAM_COLOR_MATRIX_BT709)
+        pix->colorspace = V4L2_COLORSPACE_REC709;
+}
+
+static const struct smartcam_format* smartcam_find_format(__u32 pixelformat)
+{
+    int i;
+
+    for (i = 0; i < SMARTCAM_NFORMATS; i++)
+    {
+        if (pixelformat == formats[i].pixelformat)
+            return &formats[i];
+    }
+    return NULL;
+}
+
+static void smartcam_fill_pix_format(const struct smartcam_format* fmt, __u32 width, __u32 height,
+                                     struct v4l2_pix_format* pix)
+{
+    memset(pix, 0, sizeof(*pix));
+    pix->width = width;
+    pix->height = height;
+    pix->pixelformat = fmt->pixelformat;
+    pix->field = V4L2_FIELD_NONE;
+    if (fmt->depth == 0)
+    {
+        pix->bytesperline = 0;
+        pix->sizeimage = SMARTCAM_MAX_JPEG_SIZE;
+    }
+    else
+    {
+        pix->bytesperline = fmt->planar ? width : width * fmt->depth / 8;
+        pix->sizeimage = width * height * fmt->depth / 8;
+    }
+    smartcam_fill_colorspace(fmt, pix);
+    pix->priv = 0;
+}
+
+/* Adjusts pix to the closest supported format, as VIDIOC_TRY_FMT does */
+static void smartcam_try_format(struct v4l2_pix_format* pix)
+{
+    const struct smartcam_format* fmt = smartcam_find_format(pix->pixelformat);
+    int i, best = 0;
+    long dist, best_dist = -1;
+
+    if (fmt == NULL)
+        fmt = &formats[0];
+    for (i = 0; i < SMARTCAM_NFRAMESIZES; i++)
+    {
+        dist = abs((long) pix->width - (long) frame_sizes[i].width) +
+               abs((long) pix->height - (long) frame_sizes[i].height);
+        if (best_dist < 0 || dist < best_dist)
+        {
+            best = i;
+            best_dist = dist;
+        }
+    }
+    smartcam_fill_pix_format(fmt, frame_sizes[best].width, frame_sizes[best].height, pix);
+}
+
+/* Frame timestamps are monotonic, wall clock jumps would confuse A/V sync */
+static void smartcam_get_timestamp(struct timeval* tv)
+{
+    struct timespec ts;
+    ktime_get_ts(&ts);
+    tv->tv_sec = ts.tv_sec;
+    tv->tv_usec = ts.tv_nsec / NSEC_PER_USEC;
+}
+
+/* Caller holds queue_lock */
+static void smartcam_reset_queue(void)
+{
+    int i;
+    INIT_LIST_HEAD(&queued_list);
+    INIT_LIST_HEAD(&done_list);
+    for (i = 0; i < MAX_STREAMING_BUFFERS; i++)
+        buffers[i].state = SMARTCAM_BUF_IDLE;
+}
+
+/* Caller holds write_lock; buffers that are still mapped are left to the last unmap */
+static void smartcam_free_buffers(void)
+{
+    char* old_data;
+
+    spin_lock(&queue_lock);
+    old_data = buffer_data;
+    buffer_data = NULL;
+    buffer_count = 0;
+    if (buffer_mappings > 0 && old_data != NULL)
+    {
+        orphan_data = old_data;
+        old_data = NULL;
+    }
+    spin_unlock(&queue_lock);
+    vfree(old_data);
+}
+
+/* Caller holds queue_lock */
+static void smartcam_fill_v4l2_buffer(struct smartcam_buffer* buf, struct v4l2_buffer* vidbuf)
+{
+    vidbuf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    vidbuf->memory = V4L2_MEMORY_MMAP;
+    vidbuf->field = V4L2_FIELD_NONE;
+    vidbuf->length = buffer_size;
+    vidbuf->m.offset = vidbuf->index * buffer_size;
+    vidbuf->flags = V4L2_BUF_FLAG_MAPPED;
+#ifdef V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC
+    vidbuf->flags |= V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+#endif
+    if (buf->state == SMARTCAM_BUF_QUEUED || buf->state == SMARTCAM_BUF_ACTIVE)
+        vidbuf->flags |= V4L2_BUF_FLAG_QUEUED;
+    else if (buf->state == SMARTCAM_BUF_DONE)
+        vidbuf->flags |= V4L2_BUF_FLAG_DONE;
+    vidbuf->bytesused = buf->bytesused;
+    vidbuf->sequence = buf->sequence;
+    vidbuf->timestamp = buf->timestamp;
+    vidbuf->reserved = 0;
+}
+
+/* Hands the last published frame to the streaming reader, writer only. When the reader is slow
+   and has no buffer queued, its oldest undequeued frame is dropped and reused;
+   the gap shows in the sequence numbers. */
+static void smartcam_publish_frame(void)
+{
+    struct smartcam_buffer* buf = NULL;
+
+    spin_lock(&queue_lock);
+    if (streaming)
+    {
+        if (!list_empty(&queued_list))
+            buf = list_first_entry(&queued_list, struct smartcam_buffer, list);
+        else if (!list_empty(&done_list))
+            buf = list_first_entry(&done_list, struct smartcam_buffer, list);
+        if (buf)
+        {
+            list_del(&buf->list);
+            buf->state = SMARTCAM_BUF_ACTIVE;
+        }
+    }
+    spin_unlock(&queue_lock);
+    if (!buf)
+        return;
+
+    /* the buffer is off the lists, nobody else touches it while it is filled */
+    buf->bytesused = frame_bytes[frame_sequence & 1];
+    memcpy(buf->data, frame_buffers[frame_sequence & 1], buf->bytesused);
+    buf->sequence = frame_sequence;
+    buf->timestamp = frame_timestamp;
+
+    spin_lock(&queue_lock);
+    /* STREAMOFF gave the buffer back to the application meanwhile */
+    if (buf->state == SMARTCAM_BUF_ACTIVE)
+    {
+        buf->state = SMARTCAM_BUF_DONE;
+        list_add_tail(&buf->list, &done_list);
+    }
+    spin_unlock(&queue_lock);
+}
+
+/* Checked without queue_lock, only to end a wait */
+static int smartcam_dqbuf_ready(void)
+{
+    return !list_empty(&done_list) || !streaming;
+}
+
 /* ------------------------------------------------------------------
     IOCTL vidioc handling
    ------------------------------------------------------------------*/
@@ -126,15 +360,37 @@ static int vidioc_enum_fmt_cap(struct file *file, void  *priv, struct v4l2_fmtde
     SCAM_MSG("(%s) %s called, index=%d\n", current->comm, __FUNCTION__, f->index);
     if(f->index >= SMARTCAM_NFORMATS)
         return -EINVAL;
-    strlcpy(f->description, fmtdesc[f->index], sizeof(f->description));
+    strlcpy(f->description, formats[f->index].description, sizeof(f->description));
     f->pixelformat = formats[f->index].pixelformat;
+    f->flags = (formats[f->index].depth == 0) ? V4L2_FMT_FLAG_COMPRESSED : 0;
 
     return 0;
 }
 
+static int vidioc_enum_framesizes(struct file *file, void *priv, struct v4l2_frmsizeenum *fsize)
+{
+    int i;
+
+    SCAM_MSG("(%s) %s called, index=%d\n", current->comm, __FUNCTION__, fsize->index);
+    if (fsize->index >= SMARTCAM_NFRAMESIZES)
+        return -EINVAL;
+    for (i = 0; i < SMARTCAM_NFORMATS; i++)
+    {
+        if (fsize->pixel_format == formats[i].pixelformat)
+        {
+            fsize->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+            fsize->discrete = frame_sizes[fsize->index];
+            return 0;
+        }
+    }
+    return -EINVAL;
+}
+
 static int vidioc_g_fmt_cap(struct file *file, void *priv, struct v4l2_format *f)
 {
-    f->fmt.pix = formats[format];
+    spin_lock(&queue_lock);
+    f->fmt.pix = cur_format;
+    spin_unlock(&queue_lock);
 
     SCAM_MSG("(%s) %s called\n", current->comm, __FUNCTION__);
     return 0;
@@ -142,58 +398,102 @@ static int vidioc_g_fmt_cap(struct file *file, void *priv, struct v4l2_format *f
 
 static int vidioc_try_fmt_cap(struct file *file, void *priv, struct v4l2_format *f)
 {
-    int i;
-
     SCAM_MSG("(%s) %s called\n", current->comm, __FUNCTION__);
 
-    for (i = 0; i < SMARTCAM_NFORMATS; i++) {
-        if (f->fmt.pix.pixelformat == formats[i].pixelformat) {
-            f->fmt.pix = formats[format];
-            return 0;
-        }
-    }
-
-    return -EINVAL;
+    smartcam_try_format(&f->fmt.pix);
+    return 0;
 }
 
 static int vidioc_s_fmt_cap(struct file *file, void *priv, struct v4l2_format *f)
 {
-    int i;
+    SCAM_MSG("%s called, width=%d height=%d\n", __FUNCTION__, f->fmt.pix.width, f->fmt.pix.height);
 
-    SCAM_MSG("%s called\n", __FUNCTION__);
+    smartcam_try_format(&f->fmt.pix);
 
-    for (i = 0; i < SMARTCAM_NFORMATS; i++) {
-        if ((f->fmt.pix.width == formats[i].width) &&
-            (f->fmt.pix.height == formats[i].height) &&
-            (f->fmt.pix.pixelformat == formats[i].pixelformat)) {
-            format = i;
-            f->fmt.pix = formats[format];
-            return 0;
-        }
+    /* no frame is being written while the size changes */
+    mutex_lock(&write_lock);
+    spin_lock(&queue_lock);
+    if (buffer_count > 0 && memcmp(&cur_format, &f->fmt.pix, sizeof(cur_format)) != 0)
+    {
+        /* the buffers were sized for the current format */
+        spin_unlock(&queue_lock);
+        mutex_unlock(&write_lock);
+        return -EBUSY;
     }
+    if (cur_format.pixelformat != f->fmt.pix.pixelformat || cur_format.sizeimage != f->fmt.pix.sizeimage)
+    {
+        /* the last frame is in the old format, an MJPEG reader gets nothing until the next write */
+        frame_bytes[0] = frame_bytes[1] = (f->fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG) ? 0 : f->fmt.pix.sizeimage;
+    }
+    cur_format = f->fmt.pix;
+    spin_unlock(&queue_lock);
+    mutex_unlock(&write_lock);
+    return 0;
+}
 
-        printk(KERN_ALERT "smartcam : vidioc_s_fmt_cap called\n\t\twidth=%d; \
-height=%d; pixelformat=%s\n\t\tfield=%d; bytesperline=%d; sizeimage=%d; colspace = %d; return EINVAL\n",
-        /*current->comm,*/ f->fmt.pix.width, f->fmt.pix.height, (char*)&f->fmt.pix.pixelformat,
-    f->fmt.pix.field, f->fmt.pix.bytesperline, f->fmt.pix.sizeimage, f->fmt.pix.colorspace);
+/************************ STREAMING IO / MMAP ***************************/
 
-    return -EINVAL;
+static void smartcam_vm_open(struct vm_area_struct *vma)
+{
+    spin_lock(&queue_lock);
+    buffer_mappings++;
+    spin_unlock(&queue_lock);
 }
 
-/************************ STREAMING IO / MMAP ***************************/
+static void smartcam_vm_close(struct vm_area_struct *vma)
+{
+    char* old_data = NULL;
+
+    /* no write_lock here: the writer may fault in copy_from_user under it */
+    spin_lock(&queue_lock);
+    buffer_mappings--;
+    if (buffer_mappings == 0)
+    {
+        old_data = orphan_data;
+        orphan_data = NULL;
+    }
+    spin_unlock(&queue_lock);
+    vfree(old_data);
+}
+
+static struct vm_operations_struct smartcam_vm_ops = {
+    .open = smartcam_vm_open,
+    .close = smartcam_vm_close,
+};
 
 static int smartcam_mmap(struct file *file, struct vm_area_struct *vma)
 {
         int ret;
         long length = vma->vm_end - vma->vm_start;
         unsigned long start = vma->vm_start;
-        char *vmalloc_area_ptr = frame_data;
+        unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+        char *vmalloc_area_ptr;
         unsigned long pfn;
 
-    SCAM_MSG("(%s) %s called\n", current->comm, __FUNCTION__);
+    SCAM_MSG("(%s) %s called (offset=%lu)\n", current->comm, __FUNCTION__, offset);
 
-        if (length > SMARTCAM_BUFFER_SIZE)
+        /* one buffer per mapping, at the offset given by VIDIOC_QUERYBUF;
+           REQBUFS does not reallocate while buffer_mappings > 0 */
+        spin_lock(&queue_lock);
+        if (file != stream_owner)
+        {
+                /* the buffers belong to the streaming reader */
+                spin_unlock(&queue_lock);
+                return -EBUSY;
+        }
+        if (buffer_data == NULL || offset % buffer_size != 0 || offset / buffer_size >= buffer_count)
+        {
+                spin_unlock(&queue_lock);
+                return -EINVAL;
+        }
+        if (length > buffer_size)
+        {
+                spin_unlock(&queue_lock);
                 return -EIO;
+        }
+        buffer_mappings++;
+        spin_unlock(&queue_lock);
+        vmalloc_area_ptr = buffer_data + offset;
 
         /* loop over all pages, map each page individually */
         while (length > 0)
@@ -202,19 +502,25 @@ static int smartcam_mmap(struct file *file, struct vm_area_struct *vma)
                 ret = remap_pfn_range(vma, start, pfn, PAGE_SIZE, PAGE_SHARED);
         if(ret < 0)
         {
+                        smartcam_vm_close(vma);
                         return ret;
                 }
                 start += PAGE_SIZE;
                 vmalloc_area_ptr += PAGE_SIZE;
                 length -= PAGE_SIZE;
         }
+        vma->vm_ops = &smartcam_vm_ops;
 
         return 0;
 }
 
 static int vidioc_reqbufs(struct file *file, void *priv, struct v4l2_requestbuffers *reqbuf)
 {
-    SCAM_MSG("(%s) %s called\n", current->comm, __FUNCTION__);
+    char* new_data = NULL;
+    unsigned long new_size;
+    int i;
+
+    SCAM_MSG("(%s) %s called, count=%d\n", current->comm, __FUNCTION__, reqbuf->count);
 
     if(reqbuf->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
     {
@@ -225,10 +531,52 @@ static int vidioc_reqbufs(struct file *file, void *priv, struct v4l2_requestbuff
     {
         return -EINVAL;
     }
-    if(reqbuf->count < 1)
-        reqbuf->count = 1;
     if(reqbuf->count > MAX_STREAMING_BUFFERS)
         reqbuf->count = MAX_STREAMING_BUFFERS;
+
+    /* the writer does not touch the buffers while they are replaced */
+    mutex_lock(&write_lock);
+    spin_lock(&queue_lock);
+    if((stream_owner != NULL && stream_owner != file) || streaming || buffer_mappings > 0)
+    {
+        spin_unlock(&queue_lock);
+        mutex_unlock(&write_lock);
+        return -EBUSY;
+    }
+    smartcam_reset_queue();
+    /* a count of 0 releases the buffers */
+    stream_owner = reqbuf->count > 0 ? file : NULL;
+    new_size = PAGE_ALIGN(cur_format.sizeimage);
+    spin_unlock(&queue_lock);
+
+    smartcam_free_buffers();
+    if(reqbuf->count > 0)
+    {
+        new_data = (char*) vmalloc(reqbuf->count * new_size);
+        if(!new_data)
+        {
+            spin_lock(&queue_lock);
+            stream_owner = NULL;
+            spin_unlock(&queue_lock);
+            mutex_unlock(&write_lock);
+            return -ENOMEM;
+        }
+        /* mapped to user space, do not leak old kernel memory */
+        memset(new_data, 0, reqbuf->count * new_size);
+    }
+
+    spin_lock(&queue_lock);
+    buffer_data = new_data;
+    buffer_size = new_size;
+    buffer_count = reqbuf->count;
+    for (i = 0; i < buffer_count; i++)
+    {
+        buffers[i].data = buffer_data + i * buffer_size;
+        buffers[i].bytesused = 0;
+        buffers[i].sequence = 0;
+    }
+    spin_unlock(&queue_lock);
+    mutex_unlock(&write_lock);
     return 0;
 }
 
@@ -236,7 +584,7 @@ static int vidioc_querybuf(struct file *file, void *priv, struct v4l2_buffer *vi
 {
     SCAM_MSG("(%s) %s called\n", current->comm, __FUNCTION__);
 
-    if(vidbuf->index < 0 || vidbuf->index >= MAX_STREAMING_BUFFERS)
+    if(vidbuf->index >= buffer_count)
     {
         SCAM_MSG("vidioc_querybuf called - invalid buf index\n");
         return -EINVAL;
@@ -246,18 +594,9 @@ static int vidioc_querybuf(struct file *file, void *priv, struct v4l2_buffer *vi
         SCAM_MSG("vidioc_querybuf called - invalid buf type\n");
         return -EINVAL;
     }
-        vidbuf->memory = V4L2_MEMORY_MMAP;
-
-    if(vidbuf->memory != V4L2_MEMORY_MMAP)
-    {
-        SCAM_MSG("vidioc_querybuf called - invalid memory type(%d!=%d)\n", V4L2_MEMORY_MMAP, vidbuf->memory);
-        return -EINVAL;
-    }
-    vidbuf->length = SMARTCAM_BUFFER_SIZE;
-    vidbuf->bytesused = formats[format].sizeimage;
-    vidbuf->flags = V4L2_BUF_FLAG_MAPPED;
-    vidbuf->m.offset = 2 * vidbuf->index * vidbuf->length;
-    vidbuf->reserved = 0;
+    spin_lock(&queue_lock);
+    smartcam_fill_v4l2_buffer(&buffers[vidbuf->index], vidbuf);
+    spin_unlock(&queue_lock);
     return 0;
 }
 
@@ -265,7 +604,7 @@ static int vidioc_qbuf(struct file *file, void *priv, struct v4l2_buffer *vidbuf
 {
     SCAM_MSG("(%s) %s called\n", current->comm, __FUNCTION__);
 
-    if(vidbuf->index < 0 || vidbuf->index >= MAX_STREAMING_BUFFERS)
+    if(vidbuf->index >= buffer_count)
     {
         return -EINVAL;
     }
@@ -277,23 +616,35 @@ static int vidioc_qbuf(struct file *file, void *priv, struct v4l2_buffer *vidbuf
     {
         return -EINVAL;
     }
-    vidbuf->length = SMARTCAM_BUFFER_SIZE;
-    vidbuf->bytesused = formats[format].sizeimage;
-    vidbuf->flags = V4L2_BUF_FLAG_MAPPED;
+    spin_lock(&queue_lock);
+    if(file != stream_owner)
+    {
+        spin_unlock(&queue_lock);
+        return -EBUSY;
+    }
+    if(buffers[vidbuf->index].state != SMARTCAM_BUF_IDLE)
+    {
+        /* queued twice */
+        spin_unlock(&queue_lock);
+        return -EINVAL;
+    }
+    buffers[vidbuf->index].state = SMARTCAM_BUF_QUEUED;
+    list_add_tail(&buffers[vidbuf->index].list, &queued_list);
+    smartcam_fill_v4l2_buffer(&buffers[vidbuf->index], vidbuf);
+    spin_unlock(&queue_lock);
     return 0;
 }
 
 static int vidioc_dqbuf(struct file *file, void *priv, struct v4l2_buffer *vidbuf)
 {
+    struct smartcam_buffer* buf;
+    int ret;
+
     if(file->f_flags & O_NONBLOCK)
         SCAM_MSG("(%s) %s called (non-blocking)\n", current->comm, __FUNCTION__);
     else
         SCAM_MSG("(%s) %s called (blocking)\n", current->comm, __FUNCTION__);
 
-    if(vidbuf->index < 0 || vidbuf->index >= MAX_STREAMING_BUFFERS)
-    {
-        return -EINVAL;
-    }
     if(vidbuf->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
     {
         return -EINVAL;
@@ -303,15 +654,34 @@ static int vidioc_dqbuf(struct file *file, void *priv, struct v4l2_buffer *vidbu
         return -EINVAL;
     }
 
-    if(!(file->f_flags & O_NONBLOCK))
-        interruptible_sleep_on_timeout(&wq, HZ); /* wait max 1 second */
-
-    vidbuf->length = SMARTCAM_BUFFER_SIZE;
-    vidbuf->bytesused = formats[format].sizeimage;
-    vidbuf->flags = V4L2_BUF_FLAG_MAPPED;
-    vidbuf->timestamp = frame_timestamp;
-    vidbuf->sequence = frame_sequence;
-    last_read_frame = frame_sequence;
+    spin_lock(&queue_lock);
+    if(file != stream_owner)
+    {
+        spin_unlock(&queue_lock);
+        return -EBUSY;
+    }
+    while(list_empty(&done_list))
+    {
+        if(!streaming)
+        {
+            spin_unlock(&queue_lock);
+            return -EINVAL;
+        }
+        spin_unlock(&queue_lock);
+        if(file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        ret = wait_event_interruptible(wq, smartcam_dqbuf_ready());
+        if(ret)
+            return ret;
+        spin_lock(&queue_lock);
+    }
+    buf = list_first_entry(&done_list, struct smartcam_buffer, list);
+    list_del(&buf->list);
+    buf->state = SMARTCAM_BUF_IDLE;
+    vidbuf->index = buf - buffers;
+    smartcam_fill_v4l2_buffer(buf, vidbuf);
+    last_read_frame = buf->sequence;
+    spin_unlock(&queue_lock);
     return 0;
 }
 
@@ -326,12 +696,39 @@ static int vidiocgmbuf (struct file *file, void *priv, struct video_mbuf *mbuf)
 static int vidioc_streamon(struct file *file, void *priv, enum v4l2_buf_type i)
 {
     SCAM_MSG("(%s) %s called\n", current->comm, __FUNCTION__);
+
+    if(i != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+        return -EINVAL;
+    spin_lock(&queue_lock);
+    if(file != stream_owner)
+    {
+        spin_unlock(&queue_lock);
+        return -EBUSY;
+    }
+    streaming = 1;
+    spin_unlock(&queue_lock);
     return 0;
 }
 
+/* Gives all buffers back to the application, frames not dequeued are lost */
+static void smartcam_stop_streaming(void)
+{
+    spin_lock(&queue_lock);
+    streaming = 0;
+    smartcam_reset_queue();
+    spin_unlock(&queue_lock);
+    wake_up_interruptible_all(&wq);
+}
+
 static int vidioc_streamoff(struct file *file, void *priv, enum v4l2_buf_type i)
 {
     SCAM_MSG("(%s) %s called\n", current->comm, __FUNCTION__);
+
+    if(i != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+        return -EINVAL;
+    if(file != stream_owner)
+        return -EBUSY;
+    smartcam_stop_streaming();
     return 0;
 }
 
@@ -379,20 +776,51 @@ static int vidioc_s_input(struct file *file, void *priv, unsigned int i)
 /* --- controls ---------------------------------------------- */
 static int vidioc_queryctrl(struct file *file, void *priv, struct v4l2_queryctrl *qc)
 {
-    SCAM_MSG("(%s) %s called\n", current->comm, __FUNCTION__);
-    return -EINVAL;
+    SCAM_MSG("(%s) %s called, id=%d\n", current->comm, __FUNCTION__, qc->id);
+    if (qc->id != SMARTCAM_CID_COLOR_MATRIX)
+        return -EINVAL;
+    memset(qc->reserved, 0, sizeof(qc->reserved));
+    qc->type = V4L2_CTRL_TYPE_INTEGER;
+    strlcpy(qc->name, "Color Matrix", sizeof(qc->name));
+    qc->minimum = SMARTCAM_COLOR_MATRIX_BT601;
+    qc->maximum = SMARTCAM_COLOR_MATRIX_BT709;
+    qc->step = 1;
+    qc->default_value = SMARTCAM_COLOR_MATRIX_BT601;
+    qc->flags = 0;
+    return 0;
 }
 
 static int vidioc_g_ctrl(struct file *file, void *priv, struct v4l2_control *ctrl)
 {
-    SCAM_MSG("(%s) %s called - return EINVAL\n", current->comm, __FUNCTION__);
-    return -EINVAL;
+    SCAM_MSG("(%s) %s called, id=%d\n", current->comm, __FUNCTION__, ctrl->id);
+    if (ctrl->id != SMARTCAM_CID_COLOR_MATRIX)
+        return -EINVAL;
+    spin_lock(&queue_lock);
+    ctrl->value = color_matrix;
+    spin_unlock(&queue_lock);
+    return 0;
 }
 
 static int vidioc_s_ctrl(struct file *file, void *priv,	struct v4l2_control *ctrl)
 {
-    SCAM_MSG("(%s) %s called - return EINVAL\n", current->comm, __FUNCTION__);
-    return -EINVAL;
+    const struct smartcam_format* fmt;
+
+    SCAM_MSG("(%s) %s called, id=%d value=%d\n", current->comm, __FUNCTION__, ctrl->id, ctrl->value);
+    if (ctrl->id != SMARTCAM_CID_COLOR_MATRIX)
+        return -EINVAL;
+    if (ctrl->value != SMARTCAM_COLOR_MATRIX_BT601 && ctrl->value != SMARTCAM_COLOR_MATRIX_BT709)
+        return -ERANGE;
+
+    /* frames written from now on use the new matrix */
+    mutex_lock(&write_lock);
+    spin_lock(&queue_lock);
+    color_matrix = ctrl->value;
+    fmt = smartcam_find_format(cur_format.pixelformat);
+    if (fmt != NULL)
+        smartcam_fill_colorspace(fmt, &cur_format);
+    spin_unlock(&queue_lock);
+    mutex_unlock(&write_lock);
+    return 0;
 }
 
 static int vidioc_cropcap(struct file *file, void *priv, struct v4l2_cropcap *cropcap)
@@ -402,8 +830,10 @@ static int vidioc_cropcap(struct file *file, void *priv, struct v4l2_cropcap *cr
     SCAM_MSG("(%s) %s called - return 0\n", current->comm, __FUNCTION__);
 
     defrect.left = defrect.top = 0;
-    defrect.width = SMARTCAM_FRAME_WIDTH;
-    defrect.height = SMARTCAM_FRAME_HEIGHT;
+    spin_lock(&queue_lock);
+    defrect.width = cur_format.width;
+    defrect.height = cur_format.height;
+    spin_unlock(&queue_lock);
 
     cropcap->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     cropcap->bounds = cropcap->defrect = defrect;
@@ -471,22 +901,37 @@ static int smartcam_open(/*struct inode *inode,*/ struct file *file)
 
 static ssize_t smartcam_read(struct file *file, char __user *data, size_t count, loff_t *f_pos)
 {
-        SCAM_MSG("(%s) %s called (count=%d, f_pos = %d)\n", current->comm, __FUNCTION__, (int) count, (int) *f_pos);
+    __u32 sequence;
+    __u32 sizeimage;
+    size_t length;
+
+    SCAM_MSG("(%s) %s called (count=%d, f_pos = %d)\n", current->comm, __FUNCTION__, (int) count, (int) *f_pos);
 
-    if(*f_pos >= formats[format].sizeimage)
+    spin_lock(&queue_lock);
+    sizeimage = cur_format.sizeimage;
+    spin_unlock(&queue_lock);
+    if(*f_pos >= sizeimage)
         return 0;
 
     if (!(file->f_flags & O_NONBLOCK))
-        interruptible_sleep_on_timeout(&wq, HZ/10); /* wait max 1 second */
-    last_read_frame = frame_sequence;
+        wait_event_interruptible_timeout(wq, last_read_frame != ACCESS_ONCE(frame_sequence), HZ/10); /* wait max 100 ms */
 
-    if(*f_pos + count > formats[format].sizeimage)
-        count = formats[format].sizeimage - *f_pos;
-    if(copy_to_user(data, frame_data + *f_pos, count))
+    do
     {
-        return -EFAULT;
-    }
-    return 0;
+        sequence = ACCESS_ONCE(frame_sequence);
+        smp_rmb();
+        /* MJPEG frames are shorter than sizeimage */
+        length = frame_bytes[sequence & 1];
+        length = (*f_pos < length) ? min(count, (size_t) (length - *f_pos)) : 0;
+        if(copy_to_user(data, frame_buffers[sequence & 1] + *f_pos, length))
+        {
+            return -EFAULT;
+        }
+        smp_rmb();
+        /* frame sequence + 2 goes to the same buffer, copy the newer frame if it started */
+    } while ((__s32)(ACCESS_ONCE(frames_started) - sequence) > 1);
+    last_read_frame = sequence;
+    return length;
 }
 
 static int Clamp (int x)
@@ -498,10 +943,10 @@ static int Clamp (int x)
         else               return r;
 }
 
-static void rgb_to_yuyv(void)
+static void rgb_to_yuyv(char* frame, size_t rgb_size)
 {
-    unsigned char *rp = frame_data, *wp = frame_data;
-    for (; rp < (unsigned char *)(frame_data + SMARTCAM_RGB_FRAME_SIZE);
+    unsigned char *rp = (unsigned char *)frame, *wp = (unsigned char *)frame;
+    for (; rp < (unsigned char *)(frame + rgb_size);
             rp += 6, wp += 4) {
         unsigned char r1 = rp[0], g1 = rp[1], b1 = rp[2];
         unsigned char r2 = rp[3], g2 = rp[4], b2 = rp[5];
@@ -522,21 +967,80 @@ static void rgb_to_yuyv(void)
 
 static ssize_t smartcam_write(struct file *file, const char __user *data, size_t count, loff_t *f_pos)
 {
-    SCAM_MSG("(%s) %s called (count=%d, f_pos = %d)\n", current->comm, __FUNCTION__, (int) count, (int) *f_pos);
+    __u32 next_sequence;
+    char* back_buffer;
+    size_t rgb_size;
 
-    if (count >= SMARTCAM_RGB_FRAME_SIZE)
-        count = SMARTCAM_RGB_FRAME_SIZE;
+    SCAM_MSG("(%s) %s called (count=%d, f_pos = %d)\n", current->comm, __FUNCTION__, (int) count, (int) *f_pos);
 
-    if(copy_from_user(frame_data, data, count))
+    if (mutex_lock_interruptible(&write_lock))
+        return -ERESTARTSYS;
+    /* cur_format does not change while write_lock is held */
+    rgb_size = cur_format.width * cur_format.height * 3;
+    if (cur_format.pixelformat == V4L2_PIX_FMT_MJPEG)
     {
+        /* a whole jpeg per write (since 0.4.0), it is not converted */
+        if (count < 2 || count > cur_format.sizeimage)
+        {
+            mutex_unlock(&write_lock);
+            return -EINVAL;
+        }
+    }
+    else if (cur_format.pixelformat == V4L2_PIX_FMT_NV12 || cur_format.pixelformat == V4L2_PIX_FMT_YUV420)
+    {
+        /* planar frames come in the capture format (since 0.5.0), RGB24 is not
+           converted: the 4:2:0 planes can not be built in place */
+        if (count != cur_format.sizeimage)
+        {
+            mutex_unlock(&write_lock);
+            return -EINVAL;
+        }
+    }
+    else if (count >= rgb_size)
+        count = rgb_size;
+    else if (count != cur_format.sizeimage)
+    {
+        /* written for another frame size */
+        mutex_unlock(&write_lock);
+        return -EINVAL;
+    }
+    next_sequence = frame_sequence + 1;
+    back_buffer = frame_buffers[next_sequence & 1];
+    /* readers still copying frame next_sequence - 2 from the back buffer retry */
+    frames_started = next_sequence;
+    smp_wmb();
+    if(copy_from_user(back_buffer, data, count))
+    {
+        mutex_unlock(&write_lock);
         return -EFAULT;
     }
-    ++ frame_sequence;
 
-    if (formats[format].pixelformat == V4L2_PIX_FMT_YUYV)
-        rgb_to_yuyv();
+    if (cur_format.pixelformat == V4L2_PIX_FMT_MJPEG)
+    {
+        /* SOI marker, anything else would only confuse the consumer's decoder */
+        if ((unsigned char) back_buffer[0] != 0xFF || (unsigned char) back_buffer[1] != 0xD8)
+        {
+            mutex_unlock(&write_lock);
+            return -EINVAL;
+        }
+        frame_bytes[next_sequence & 1] = count;
+    }
+    else
+    {
+        /* a frame of the capture format size is already in the capture format
+           (since 0.2.0), anything else is RGB24 */
+        if (cur_format.pixelformat == V4L2_PIX_FMT_YUYV && count != cur_format.sizeimage)
+            rgb_to_yuyv(back_buffer, rgb_size);
+        frame_bytes[next_sequence & 1] = cur_format.sizeimage;
+    }
+
+    /* publish: the frame is complete before the new sequence is visible */
+    smp_wmb();
+    frame_sequence = next_sequence;
 
-    do_gettimeofday(&frame_timestamp);
+    smartcam_get_timestamp(&frame_timestamp);
+    smartcam_publish_frame();
+    mutex_unlock(&write_lock);
     wake_up_interruptible_all(&wq);
     return count;
 }
@@ -544,19 +1048,41 @@ static ssize_t smartcam_write(struct file *file, const char __user *data, size_t
 static unsigned int smartcam_poll(struct file *file, struct poll_table_struct *wait)
 {
     int mask = (POLLOUT | POLLWRNORM);	/* writable */
-    if (last_read_frame != frame_sequence)
-        mask |= (POLLIN | POLLRDNORM);	/* readable */
 
     SCAM_MSG("(%s) %s called\n", current->comm, __FUNCTION__);
 
     poll_wait(file, &wq, wait);
 
+    spin_lock(&queue_lock);
+    if (file == stream_owner)
+    {
+        /* streaming: a buffer is ready to be dequeued */
+        if (streaming && !list_empty(&done_list))
+            mask |= (POLLIN | POLLRDNORM);
+    }
+    else if (last_read_frame != frame_sequence)
+        mask |= (POLLIN | POLLRDNORM);	/* readable */
+    spin_unlock(&queue_lock);
+
     return mask;
 }
 
 static int smartcam_release(/*struct inode *inode,*/ struct file *file)
 {
     SCAM_MSG("(%s) %s called\n", current->comm, __FUNCTION__);
+
+    /* the streaming reader went away, let the next one request buffers */
+    if (file == stream_owner)
+    {
+        smartcam_stop_streaming();
+        /* buffers that are still mapped are freed by the last unmap */
+        mutex_lock(&write_lock);
+        smartcam_free_buffers();
+        spin_lock(&queue_lock);
+        stream_owner = NULL;
+        spin_unlock(&queue_lock);
+        mutex_unlock(&write_lock);
+    }
     return 0;
 }
 
@@ -578,6 +1104,7 @@ static const struct v4l2_ioctl_ops smartcam_ioctl_ops = {
     .vidioc_g_fmt_vid_cap     = vidioc_g_fmt_cap,
     .vidioc_try_fmt_vid_cap   = vidioc_try_fmt_cap,
     .vidioc_s_fmt_vid_cap     = vidioc_s_fmt_cap,
+    .vidioc_enum_framesizes   = vidioc_enum_framesizes,
     .vidioc_reqbufs       = vidioc_reqbufs,
     .vidioc_querybuf      = vidioc_querybuf,
     .vidioc_qbuf          = vidioc_qbuf,
@@ -620,14 +1147,29 @@ static struct video_device smartcam_vid = {
 static int __init smartcam_init(void)
 {
     int ret = 0;
-    frame_data =  (char*) vmalloc(SMARTCAM_BUFFER_SIZE);
-    if(!frame_data)
+    int i;
+    /* the streaming buffers are allocated by VIDIOC_REQBUFS, for the chosen size */
+    frame_buffers[0] = (char*) vmalloc(2 * SMARTCAM_MAX_BUFFER_SIZE);
+    if(!frame_buffers[0])
     {
         return -ENOMEM;
     }
-    frame_sequence = last_read_frame = 0;
+    frame_buffers[1] = frame_buffers[0] + SMARTCAM_MAX_BUFFER_SIZE;
+    memset(frame_buffers[0], 0, 2 * SMARTCAM_MAX_BUFFER_SIZE);
+    for (i = 0; i < MAX_STREAMING_BUFFERS; i++)
+    {
+        memset(&buffers[i], 0, sizeof(buffers[i]));
+        buffers[i].state = SMARTCAM_BUF_IDLE;
+    }
+    smartcam_fill_pix_format(&formats[0], SMARTCAM_FRAME_WIDTH, SMARTCAM_FRAME_HEIGHT, &cur_format);
+    frame_bytes[0] = frame_bytes[1] = cur_format.sizeimage;
+    frame_sequence = frames_started = last_read_frame = 0;
     ret = video_register_device(&smartcam_vid, VFL_TYPE_GRABBER, -1);
     SCAM_MSG("(%s) load status: %d\n", current->comm, ret);
+    if(ret < 0)
+    {
+        vfree(frame_buffers[0]);
+    }
     return ret;
 }
 
@@ -635,8 +1177,9 @@ static void __exit smartcam_exit(void)
 {
     SCAM_MSG("(%s) %s called\n", current->comm, __FUNCTION__);
     frame_sequence = 0;
-    vfree(frame_data);
     video_unregister_device(&smartcam_vid);
+    vfree(buffer_data);
+    vfree(frame_buffers[0]);
 }
 
 module_init(smartcam_init);
@@ -0,0 +1,631 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// ColorConvert.cpp
+
+#include <cstdlib>
+#include <cstring>
+#include <linux/videodev2.h>
+
+#include "ColorConvert.h"
+#include "FramePool.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SMARTCAM_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// Rounding term of the Q15 results
+#define FIXED_ROUND (1 << 14)
+
+static inline unsigned char clamp255(int x)
+{
+    return (unsigned char) (x < 0 ? 0 : (x > 255 ? 255 : x));
+}
+
+// Kr/Kb of each matrix scaled by hand so that the Y factors add up to exactly
+// 1.0 (219/255 for limited range) and the chroma factors to exactly 0
+const ColorCoefficients CColorConvert::coefficients[2] =
+{
+    {   // COLOR_MATRIX_BT601: Kr 0.299, Kb 0.114, full range like the jpeg planes
+        { 9798, 19234, 3736, 0, 9798, 19234, 3736, 0 },
+        { -2765, -5427, 8192, 0, 8192, -6860, -1332, 0 },
+        { -1382, -2714, 4096, 0, 4096, -3430, -666, 0 },
+        0
+    },
+    {   // COLOR_MATRIX_BT709: Kr 0.2126, Kb 0.0722, limited range like V4L2 REC709
+        { 5983, 20127, 2032, 0, 5983, 20127, 2032, 0 },
+        { -1649, -5547, 7196, 0, 7196, -6536, -660, 0 },
+        { -824, -2774, 3598, 0, 3598, -3268, -330, 0 },
+        16
+    }
+};
+
+volatile gint CColorConvert::simdLevel = -1;
+
+// Reference implementation: Y from row, chroma from the pixel pair of row, or
+// from the 2x2 block of row and row2 when row2 is not NULL
+static void yuyvRowScalar(const unsigned char* row, const unsigned char* row2, unsigned char* out,
+                          int pairs, const ColorCoefficients* coeffs)
+{
+    const short* cy = coeffs->y;
+    const short* cuv = (row2 != NULL) ? coeffs->uv4 : coeffs->uv2;
+    for (int i = 0; i < pairs; i++, row += 6, out += 4)
+    {
+        int rs = row[0] + row[3];
+        int gs = row[1] + row[4];
+        int bs = row[2] + row[5];
+        if (row2 != NULL)
+        {
+            rs += row2[0] + row2[3];
+            gs += row2[1] + row2[4];
+            bs += row2[2] + row2[5];
+            row2 += 6;
+        }
+        out[0] = clamp255(((cy[0] * row[0] + cy[1] * row[1] + cy[2] * row[2] + FIXED_ROUND) >> 15) + coeffs->yOffset);
+        out[1] = clamp255(((cuv[0] * rs + cuv[1] * gs + cuv[2] * bs + FIXED_ROUND) >> 15) + 128);
+        out[2] = clamp255(((cy[0] * row[3] + cy[1] * row[4] + cy[2] * row[5] + FIXED_ROUND) >> 15) + coeffs->yOffset);
+        out[3] = clamp255(((cuv[4] * rs + cuv[5] * gs + cuv[6] * bs + FIXED_ROUND) >> 15) + 128);
+    }
+}
+
+// YUYV to the Y row and the interleaved CbCr row of NV12, uv may be NULL
+static void splitRowScalar(const unsigned char* yuyv, unsigned char* y, unsigned char* uv, int pairs)
+{
+    for (int i = 0; i < pairs; i++, yuyv += 4)
+    {
+        y[2 * i] = yuyv[0];
+        y[2 * i + 1] = yuyv[2];
+        if (uv != NULL)
+        {
+            uv[2 * i] = yuyv[1];
+            uv[2 * i + 1] = yuyv[3];
+        }
+    }
+}
+
+#ifdef SMARTCAM_X86_SIMD
+
+// One pixel pair as 16 bit r g b x r g b x. Reads one byte past the pair.
+__attribute__((target("sse2")))
+static inline __m128i loadPairSSE2(const unsigned char* p)
+{
+    int first, second;
+    memcpy(&first, p, 4);
+    memcpy(&second, p + 3, 4);
+    __m128i v = _mm_unpacklo_epi32(_mm_cvtsi32_si128(first), _mm_cvtsi32_si128(second));
+    return _mm_unpacklo_epi8(v, _mm_setzero_si128());
+}
+
+// Y0 Cb Y1 Cr of one pair as 32 bit lanes. pair holds the pixels, sum the
+// chroma source (pair or 2x2 block) added up in both halves.
+__attribute__((target("sse2")))
+static inline __m128i convertPairSSE2(__m128i pair, __m128i sum, __m128i cy, __m128i cuv, __m128i round, __m128i offset)
+{
+    // [y0a y0b y1a y1b] and [cba cbb cra crb], each value split in two partial sums
+    __m128i luma = _mm_shuffle_epi32(_mm_madd_epi16(pair, cy), _MM_SHUFFLE(3, 1, 2, 0));
+    __m128i chroma = _mm_shuffle_epi32(_mm_madd_epi16(sum, cuv), _MM_SHUFFLE(3, 1, 2, 0));
+    __m128i v = _mm_add_epi32(_mm_unpacklo_epi32(luma, chroma), _mm_unpackhi_epi32(luma, chroma));
+    return _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(v, round), 15), offset);
+}
+
+__attribute__((target("sse2")))
+static void yuyvRowSSE2(const unsigned char* row, const unsigned char* row2, unsigned char* out,
+                        int pairs, const ColorCoefficients* coeffs)
+{
+    const __m128i cy = _mm_loadu_si128((const __m128i*) coeffs->y);
+    const __m128i cuv = _mm_loadu_si128((const __m128i*) ((row2 != NULL) ? coeffs->uv4 : coeffs->uv2));
+    const __m128i round = _mm_set1_epi32(FIXED_ROUND);
+    const __m128i offset = _mm_setr_epi32(coeffs->yOffset, 128, coeffs->yOffset, 128);
+    int i = 0;
+    // 4 pairs per step, keep one pair back for the over-read of the loads
+    for (; i + 4 < pairs; i += 4, row += 24, out += 16)
+    {
+        __m128i result[4];
+        for (int k = 0; k < 4; k++)
+        {
+            __m128i pair = loadPairSSE2(row + 6 * k);
+            __m128i sum = pair;
+            if (row2 != NULL)
+            {
+                sum = _mm_add_epi16(sum, loadPairSSE2(row2 + 6 * k));
+            }
+            sum = _mm_add_epi16(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+            result[k] = convertPairSSE2(pair, sum, cy, cuv, round, offset);
+        }
+        __m128i lo = _mm_packs_epi32(result[0], result[1]);
+        __m128i hi = _mm_packs_epi32(result[2], result[3]);
+        _mm_storeu_si128((__m128i*) out, _mm_packus_epi16(lo, hi));
+        if (row2 != NULL)
+        {
+            row2 += 24;
+        }
+    }
+    yuyvRowScalar(row, row2, out, pairs - i, coeffs);
+}
+
+__attribute__((target("sse2")))
+static void splitRowSSE2(const unsigned char* yuyv, unsigned char* y, unsigned char* uv, int pairs)
+{
+    const __m128i lowBytes = _mm_set1_epi16(0x00FF);
+    int i = 0;
+    // 8 pairs per step
+    for (; i + 8 <= pairs; i += 8, yuyv += 32)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*) yuyv);
+        __m128i b = _mm_loadu_si128((const __m128i*) (yuyv + 16));
+        _mm_storeu_si128((__m128i*) (y + 2 * i),
+                         _mm_packus_epi16(_mm_and_si128(a, lowBytes), _mm_and_si128(b, lowBytes)));
+        if (uv != NULL)
+        {
+            _mm_storeu_si128((__m128i*) (uv + 2 * i),
+                             _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+        }
+    }
+    splitRowScalar(yuyv, y + 2 * i, (uv != NULL) ? uv + 2 * i : NULL, pairs - i);
+}
+
+// Two pixel pairs as 16 bit r g b x r g b x, one pair per 128 bit lane.
+// Reads 16 bytes for the 12 of the two pairs.
+__attribute__((target("avx2")))
+static inline __m256i loadTwoPairsAVX2(const unsigned char* p, __m128i expand)
+{
+    __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) p), expand);
+    return _mm256_cvtepu8_epi16(v);
+}
+
+// Same as convertPairSSE2, on two pairs at once
+__attribute__((target("avx2")))
+static inline __m256i convertTwoPairsAVX2(__m256i pairs, __m256i sum, __m256i cy, __m256i cuv, __m256i round, __m256i offset)
+{
+    __m256i luma = _mm256_shuffle_epi32(_mm256_madd_epi16(pairs, cy), _MM_SHUFFLE(3, 1, 2, 0));
+    __m256i chroma = _mm256_shuffle_epi32(_mm256_madd_epi16(sum, cuv), _MM_SHUFFLE(3, 1, 2, 0));
+    __m256i v = _mm256_add_epi32(_mm256_unpacklo_epi32(luma, chroma), _mm256_unpackhi_epi32(luma, chroma));
+    return _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(v, round), 15), offset);
+}
+
+__attribute__((target("avx2")))
+static void yuyvRowAVX2(const unsigned char* row, const unsigned char* row2, unsigned char* out,
+                        int pairs, const ColorCoefficients* coeffs)
+{
+    const __m128i expand = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m256i cy = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) coeffs->y));
+    const __m256i cuv = _mm256_broadcastsi128_si256(
+                            _mm_loadu_si128((const __m128i*) ((row2 != NULL) ? coeffs->uv4 : coeffs->uv2)));
+    const __m256i round = _mm256_set1_epi32(FIXED_ROUND);
+    const __m256i offset = _mm256_setr_epi32(coeffs->yOffset, 128, coeffs->yOffset, 128,
+                                             coeffs->yOffset, 128, coeffs->yOffset, 128);
+    // packs/packus interleave the 128 bit lanes, this puts the pairs back in order
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int i = 0;
+    // 8 pairs per step, keep one pair back for the over-read of the loads
+    for (; i + 8 < pairs; i += 8, row += 48, out += 32)
+    {
+        __m256i result[4];
+        for (int k = 0; k < 4; k++)
+        {
+            __m256i twoPairs = loadTwoPairsAVX2(row + 12 * k, expand);
+            __m256i sum = twoPairs;
+            if (row2 != NULL)
+            {
+                sum = _mm256_add_epi16(sum, loadTwoPairsAVX2(row2 + 12 * k, expand));
+            }
+            sum = _mm256_add_epi16(sum, _mm256_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+            result[k] = convertTwoPairsAVX2(twoPairs, sum, cy, cuv, round, offset);
+        }
+        __m256i lo = _mm256_packs_epi32(result[0], result[1]);
+        __m256i hi = _mm256_packs_epi32(result[2], result[3]);
+        __m256i packed = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(lo, hi), order);
+        _mm256_storeu_si256((__m256i*) out, packed);
+        if (row2 != NULL)
+        {
+            row2 += 48;
+        }
+    }
+    yuyvRowSSE2(row, row2, out, pairs - i, coeffs);
+}
+
+#endif//SMARTCAM_X86_SIMD
+
+SimdLevel CColorConvert::getSupportedSimdLevel()
+{
+#ifdef SMARTCAM_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return SIMD_SSE2;
+#endif
+    return SIMD_NONE;
+}
+
+SimdLevel CColorConvert::getSimdLevel()
+{
+    gint level = g_atomic_int_get(&simdLevel);
+    if (level < 0)
+    {
+        level = getSupportedSimdLevel();
+        g_atomic_int_set(&simdLevel, level);
+    }
+    return (SimdLevel) level;
+}
+
+void CColorConvert::setSimdLevel(SimdLevel level)
+{
+    SimdLevel supported = getSupportedSimdLevel();
+    g_atomic_int_set(&simdLevel, (level > supported) ? supported : level);
+}
+
+CColorConvert::YUYVRowFunc CColorConvert::yuyvRowFunc()
+{
+    switch (getSimdLevel())
+    {
+#ifdef SMARTCAM_X86_SIMD
+    case SIMD_AVX2:
+        return yuyvRowAVX2;
+    case SIMD_SSE2:
+        return yuyvRowSSE2;
+#endif
+    default:
+        return yuyvRowScalar;
+    }
+}
+
+CColorConvert::SplitRowFunc CColorConvert::splitRowFunc()
+{
+#ifdef SMARTCAM_X86_SIMD
+    if (getSimdLevel() >= SIMD_SSE2)
+        return splitRowSSE2;
+#endif
+    return splitRowScalar;
+}
+
+void CColorConvert::rgb24ToYUYV(const unsigned char* rgb, int rgbStride, unsigned char* yuyv,
+                                int width, int height, ColorMatrix matrix)
+{
+    YUYVRowFunc convertRow = yuyvRowFunc();
+    const ColorCoefficients* coeffs = &coefficients[matrix == COLOR_MATRIX_BT709 ? 1 : 0];
+    for (int y = 0; y < height; y++)
+    {
+        convertRow(rgb + y * rgbStride, NULL, yuyv + y * width * 2, width / 2, coeffs);
+    }
+}
+
+// Rows are converted to YUYV in chunks first, then split in the two planes
+#define NV12_CHUNK_PAIRS 128
+
+void CColorConvert::rgb24ToNV12(const unsigned char* rgb, int rgbStride, unsigned char* y, unsigned char* uv,
+                                int width, int height, ColorMatrix matrix)
+{
+    rgb24To420(rgb, rgbStride, y, uv, NULL, width, height, matrix);
+}
+
+void CColorConvert::rgb24ToI420(const unsigned char* rgb, int rgbStride, unsigned char* y, unsigned char* u,
+                                unsigned char* v, int width, int height, ColorMatrix matrix)
+{
+    rgb24To420(rgb, rgbStride, y, u, v, width, height, matrix);
+}
+
+void CColorConvert::rgb24To420(const unsigned char* rgb, int rgbStride, unsigned char* y, unsigned char* u,
+                               unsigned char* v, int width, int height, ColorMatrix matrix)
+{
+    unsigned char chunk[NV12_CHUNK_PAIRS * 4];
+    unsigned char uvChunk[NV12_CHUNK_PAIRS * 2];
+    YUYVRowFunc convertRow = yuyvRowFunc();
+    SplitRowFunc splitRow = splitRowFunc();
+    const ColorCoefficients* coeffs = &coefficients[matrix == COLOR_MATRIX_BT709 ? 1 : 0];
+    int pairs = width / 2;
+    for (int row = 0; row < height; row += 2)
+    {
+        const unsigned char* row0 = rgb + row * rgbStride;
+        // an odd last row makes a block with itself
+        const unsigned char* row1 = (row + 1 < height) ? row0 + rgbStride : row0;
+        unsigned char* yRow0 = y + row * width;
+        // NV12 chroma rows are width bytes, I420 ones pairs bytes per plane
+        unsigned char* uRow = u + (row / 2) * (v == NULL ? width : pairs);
+        unsigned char* vRow = (v == NULL) ? NULL : v + (row / 2) * pairs;
+        for (int pair = 0; pair < pairs; pair += NV12_CHUNK_PAIRS)
+        {
+            int count = (pairs - pair < NV12_CHUNK_PAIRS) ? pairs - pair : NV12_CHUNK_PAIRS;
+            // first row and the chroma of the block
+            convertRow(row0 + pair * 6, row1 + pair * 6, chunk, count, coeffs);
+            if (vRow == NULL)
+            {
+                splitRow(chunk, yRow0 + pair * 2, uRow + pair * 2, count);
+            }
+            else
+            {
+                splitRow(chunk, yRow0 + pair * 2, uvChunk, count);
+                for (int i = 0; i < count; i++)
+                {
+                    uRow[pair + i] = uvChunk[2 * i];
+                    vRow[pair + i] = uvChunk[2 * i + 1];
+                }
+            }
+            if (row + 1 < height)
+            {
+                // second row, its chroma is not used
+                convertRow(row1 + pair * 6, NULL, chunk, count, coeffs);
+                splitRow(chunk, yRow0 + width + pair * 2, NULL, count);
+            }
+        }
+    }
+}
+
+int CColorConvert::yuvFrameSize(guint32 format, int width, int height)
+{
+    switch (format)
+    {
+    case V4L2_PIX_FMT_YUYV:
+        return width * height * 2;
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_YUV420:
+        return width * height + width * ((height + 1) / 2);
+    default:
+        return 0;
+    }
+}
+
+void CColorConvert::rgb24ToYUV(const unsigned char* rgb, int rgbStride, guint32 format, unsigned char* dst,
+                               int width, int height, ColorMatrix matrix)
+{
+    int chromaSize = (width / 2) * ((height + 1) / 2);
+    if (format == V4L2_PIX_FMT_NV12)
+        rgb24ToNV12(rgb, rgbStride, dst, dst + width * height, width, height, matrix);
+    else if (format == V4L2_PIX_FMT_YUV420)
+        rgb24ToI420(rgb, rgbStride, dst, dst + width * height, dst + width * height + chromaSize,
+                    width, height, matrix);
+    else
+        rgb24ToYUYV(rgb, rgbStride, dst, width, height, matrix);
+}
+
+void CColorConvert::packYUV(const YUVImage& image, guint32 format, unsigned char* dst, int width, int height)
+{
+    if (format == V4L2_PIX_FMT_NV12 || format == V4L2_PIX_FMT_YUV420)
+        packYUV420(image, dst, width, height, format == V4L2_PIX_FMT_NV12);
+    else
+        packYUYV(image, dst, width, height);
+}
+
+void CColorConvert::yuvToRGB24(const unsigned char* yuv, guint32 format, unsigned char* rgb, int width, int height)
+{
+    const unsigned char* chroma = yuv + width * height;
+    if (format == V4L2_PIX_FMT_NV12)
+        yuv420ToRGB24(yuv, chroma, chroma + 1, 2, rgb, width, height);
+    else if (format == V4L2_PIX_FMT_YUV420)
+        yuv420ToRGB24(yuv, chroma, chroma + (width / 2) * ((height + 1) / 2), 1, rgb, width, height);
+    else
+        yuyvToRGB24(yuv, rgb, width, height);
+}
+
+CColorConvert::CColorConvert():
+    scratch(NULL),
+    scratchSize(0)
+{
+}
+
+CColorConvert::~CColorConvert()
+{
+    free(scratch);
+}
+
+void CColorConvert::scalePlane(const unsigned char* src, int srcStride, int srcWidth, int srcHeight,
+                               unsigned char* dst, int dstStride, int dstWidth, int dstHeight)
+{
+    // 16.16 fixed point source position, 8 bit interpolation weights
+    int stepX = (srcWidth << 16) / dstWidth;
+    int stepY = (srcHeight << 16) / dstHeight;
+    int fy = 0;
+    for (int y = 0; y < dstHeight; y++, fy += stepY)
+    {
+        int y0 = fy >> 16;
+        int y1 = (y0 + 1 < srcHeight) ? y0 + 1 : srcHeight - 1;
+        int wy = (fy >> 8) & 0xFF;
+        const unsigned char* row0 = src + y0 * srcStride;
+        const unsigned char* row1 = src + y1 * srcStride;
+        unsigned char* out = dst + y * dstStride;
+        int fx = 0;
+        for (int x = 0; x < dstWidth; x++, fx += stepX)
+        {
+            int x0 = fx >> 16;
+            int x1 = (x0 + 1 < srcWidth) ? x0 + 1 : srcWidth - 1;
+            int wx = (fx >> 8) & 0xFF;
+            int top = row0[x0] * (256 - wx) + row0[x1] * wx;
+            int bottom = row1[x0] * (256 - wx) + row1[x1] * wx;
+            out[x] = (unsigned char) ((top * (256 - wy) + bottom * wy + (1 << 15)) >> 16);
+        }
+    }
+}
+
+void CColorConvert::scaleRGB24(const unsigned char* src, int srcStride, int srcWidth, int srcHeight,
+                               unsigned char* dst, int dstStride, int dstWidth, int dstHeight)
+{
+    // same stepping as scalePlane, on 3 channels
+    int stepX = (srcWidth << 16) / dstWidth;
+    int stepY = (srcHeight << 16) / dstHeight;
+    int fy = 0;
+    for (int y = 0; y < dstHeight; y++, fy += stepY)
+    {
+        int y0 = fy >> 16;
+        int y1 = (y0 + 1 < srcHeight) ? y0 + 1 : srcHeight - 1;
+        int wy = (fy >> 8) & 0xFF;
+        const unsigned char* row0 = src + y0 * srcStride;
+        const unsigned char* row1 = src + y1 * srcStride;
+        unsigned char* out = dst + y * dstStride;
+        int fx = 0;
+        for (int x = 0; x < dstWidth; x++, fx += stepX, out += 3)
+        {
+            int x0 = 3 * (fx >> 16);
+            int x1 = ((fx >> 16) + 1 < srcWidth) ? x0 + 3 : x0;
+            int wx = (fx >> 8) & 0xFF;
+            for (int c = 0; c < 3; c++)
+            {
+                int top = row0[x0 + c] * (256 - wx) + row0[x1 + c] * wx;
+                int bottom = row1[x0 + c] * (256 - wx) + row1[x1 + c] * wx;
+                out[c] = (unsigned char) ((top * (256 - wy) + bottom * wy + (1 << 15)) >> 16);
+            }
+        }
+    }
+}
+
+// Returns the plane at width x height, resampled into scratchPlane if needed
+const unsigned char* CColorConvert::planeAt(const YUVImage& image, int plane, int width, int height, int& stride,
+                                            unsigned char* scratchPlane)
+{
+    if (image.widths[plane] == width && image.heights[plane] == height)
+    {
+        stride = image.strides[plane];
+        return image.planes[plane];
+    }
+    scalePlane(image.planes[plane], image.strides[plane], image.widths[plane], image.heights[plane],
+               scratchPlane, width, width, height);
+    stride = width;
+    return scratchPlane;
+}
+
+// Room for the resampled planes, kept for the next frames
+unsigned char* CColorConvert::reserveScratch(int size)
+{
+    if (scratch == NULL || scratchSize < size)
+    {
+        CFramePool::CountAllocation();
+        free(scratch);
+        scratchSize = size;
+        scratch = (unsigned char*) malloc(scratchSize);
+    }
+    return scratch;
+}
+
+void CColorConvert::packYUYV(const YUVImage& image, unsigned char* dst, int width, int height)
+{
+    int chromaWidth = width / 2;
+    reserveScratch(width * height + 2 * chromaWidth * height);
+
+    int yStride = 0, uStride = 0, vStride = 0;
+    const unsigned char* yPlane = planeAt(image, 0, width, height, yStride, scratch);
+    const unsigned char* uPlane = planeAt(image, 1, chromaWidth, height, uStride, scratch + width * height);
+    const unsigned char* vPlane = planeAt(image, 2, chromaWidth, height, vStride,
+                                          scratch + width * height + chromaWidth * height);
+
+    for (int y = 0; y < height; y++)
+    {
+        const unsigned char* yRow = yPlane + y * yStride;
+        const unsigned char* uRow = uPlane + y * uStride;
+        const unsigned char* vRow = vPlane + y * vStride;
+        unsigned char* out = dst + y * width * 2;
+        for (int x = 0; x < chromaWidth; x++)
+        {
+            out[0] = yRow[2 * x];
+            out[1] = uRow[x];
+            out[2] = yRow[2 * x + 1];
+            out[3] = vRow[x];
+            out += 4;
+        }
+    }
+}
+
+void CColorConvert::packYUV420(const YUVImage& image, unsigned char* dst, int width, int height, bool interleaveChroma)
+{
+    int chromaWidth = width / 2;
+    int chromaHeight = (height + 1) / 2;
+    reserveScratch(width * height + 2 * chromaWidth * chromaHeight);
+
+    // a 4:2:0 jpeg decoded at the output size needs no resampling, only copies
+    int yStride = 0, uStride = 0, vStride = 0;
+    const unsigned char* yPlane = planeAt(image, 0, width, height, yStride, scratch);
+    const unsigned char* uPlane = planeAt(image, 1, chromaWidth, chromaHeight, uStride, scratch + width * height);
+    const unsigned char* vPlane = planeAt(image, 2, chromaWidth, chromaHeight, vStride,
+                                          scratch + width * height + chromaWidth * chromaHeight);
+
+    for (int y = 0; y < height; y++)
+    {
+        memcpy(dst + y * width, yPlane + y * yStride, width);
+    }
+    unsigned char* chroma = dst + width * height;
+    for (int y = 0; y < chromaHeight; y++)
+    {
+        const unsigned char* uRow = uPlane + y * uStride;
+        const unsigned char* vRow = vPlane + y * vStride;
+        if (interleaveChroma)
+        {
+            unsigned char* out = chroma + y * chromaWidth * 2;
+            for (int x = 0; x < chromaWidth; x++)
+            {
+                out[2 * x] = uRow[x];
+                out[2 * x + 1] = vRow[x];
+            }
+        }
+        else
+        {
+            memcpy(chroma + y * chromaWidth, uRow, chromaWidth);
+            memcpy(chroma + (chromaHeight + y) * chromaWidth, vRow, chromaWidth);
+        }
+    }
+}
+
+void CColorConvert::yuyvToRGB24(const unsigned char* yuyv, unsigned char* rgb, int width, int height)
+{
+    // 16.16 fixed point full range BT.601
+    const unsigned char* end = yuyv + width * height * 2;
+    for (; yuyv < end; yuyv += 4, rgb += 6)
+    {
+        int u = yuyv[1] - 128;
+        int v = yuyv[3] - 128;
+        int dr = (91881 * v + (1 << 15)) >> 16;
+        int dg = (-22554 * u - 46802 * v + (1 << 15)) >> 16;
+        int db = (116130 * u + (1 << 15)) >> 16;
+        int y0 = yuyv[0];
+        int y1 = yuyv[2];
+        rgb[0] = clamp255(y0 + dr);
+        rgb[1] = clamp255(y0 + dg);
+        rgb[2] = clamp255(y0 + db);
+        rgb[3] = clamp255(y1 + dr);
+        rgb[4] = clamp255(y1 + dg);
+        rgb[5] = clamp255(y1 + db);
+    }
+}
+
+void CColorConvert::yuv420ToRGB24(const unsigned char* y, const unsigned char* u, const unsigned char* v, int chromaStep,
+                                  unsigned char* rgb, int width, int height)
+{
+    // same conversion as yuyvToRGB24, each chroma sample covers a 2x2 block
+    int chromaStride = (width / 2) * chromaStep;
+    for (int row = 0; row < height; row++)
+    {
+        const unsigned char* yRow = y + row * width;
+        const unsigned char* uRow = u + (row / 2) * chromaStride;
+        const unsigned char* vRow = v + (row / 2) * chromaStride;
+        for (int x = 0; x < width; x += 2, rgb += 6)
+        {
+            int cu = uRow[(x / 2) * chromaStep] - 128;
+            int cv = vRow[(x / 2) * chromaStep] - 128;
+            int dr = (91881 * cv + (1 << 15)) >> 16;
+            int dg = (-22554 * cu - 46802 * cv + (1 << 15)) >> 16;
+            int db = (116130 * cu + (1 << 15)) >> 16;
+            int y0 = yRow[x];
+            int y1 = yRow[x + 1];
+            rgb[0] = clamp255(y0 + dr);
+            rgb[1] = clamp255(y0 + dg);
+            rgb[2] = clamp255(y0 + db);
+            rgb[3] = clamp255(y1 + dr);
+            rgb[4] = clamp255(y1 + dg);
+            rgb[5] = clamp255(y1 + db);
+        }
+    }
+}
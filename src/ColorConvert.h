@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// ColorConvert.h
+
+#ifndef __COLOR_CONVERT_H__
+#define __COLOR_CONVERT_H__
+
+#include <glib.h>
+
+#include "UserSettings.h"
+
+// Planar YCbCr image as it comes out of the jpeg decoder, the chroma planes
+// may be subsampled. Plane 0 is Y, 1 is Cb, 2 is Cr.
+typedef struct YUVImage
+{
+    unsigned char* planes[3];
+    int strides[3];
+    int widths[3];
+    int heights[3];
+} YUVImage;
+
+// Instruction set used by the RGB converters
+typedef enum SimdLevel {
+    SIMD_NONE = 0,
+    SIMD_SSE2 = 1,
+    SIMD_AVX2 = 2
+} SimdLevel;
+
+// Fixed point conversion factors, Q15 for Y from one pixel, Q14 and Q13 for
+// the chroma of the sum of 2 and 4 pixels. Rows are r g b 0 (twice for Y,
+// once for Cb and once for Cr) so they can be fed to pmaddwd directly.
+// yOffset is 0 for full range and 16 for limited range.
+typedef struct ColorCoefficients
+{
+    short y[8];
+    short uv2[8];
+    short uv4[8];
+    int yOffset;
+} ColorCoefficients;
+
+// Pixel format helpers for the frames written in the driver. Jpeg YCbCr is
+// full range BT.601, the same the driver uses for its own RGB conversion;
+// BT.709 is written limited range, as V4L2 consumers expect for REC709.
+// The SIMD and the scalar RGB converters give bit exact results, "make check"
+// runs test-colorconvert to compare them.
+class CColorConvert
+{
+public:
+    CColorConvert();
+    ~CColorConvert();
+
+    // RGB24 to packed 4:2:2, chroma is the average of each pixel pair.
+    // width must be even, yuyv must hold width * height * 2 bytes
+    static void rgb24ToYUYV(const unsigned char* rgb, int rgbStride, unsigned char* yuyv,
+                            int width, int height, ColorMatrix matrix);
+
+    // RGB24 to semi planar 4:2:0, chroma is the average of each 2x2 block.
+    // width must be even, uv holds width * ((height + 1) / 2) bytes
+    static void rgb24ToNV12(const unsigned char* rgb, int rgbStride, unsigned char* y, unsigned char* uv,
+                            int width, int height, ColorMatrix matrix);
+
+    // Same as rgb24ToNV12 with separate chroma planes (I420), u and v hold
+    // (width / 2) * ((height + 1) / 2) bytes each
+    static void rgb24ToI420(const unsigned char* rgb, int rgbStride, unsigned char* y, unsigned char* u,
+                            unsigned char* v, int width, int height, ColorMatrix matrix);
+
+    // Frames in the YUV layouts the driver takes, by V4L2 fourcc: YUYV, NV12 or
+    // YUV420 (I420). yuvFrameSize() is 0 for other formats; dst holds it.
+    static int yuvFrameSize(guint32 format, int width, int height);
+    static void rgb24ToYUV(const unsigned char* rgb, int rgbStride, guint32 format, unsigned char* dst,
+                           int width, int height, ColorMatrix matrix);
+    void packYUV(const YUVImage& image, guint32 format, unsigned char* dst, int width, int height);
+    static void yuvToRGB24(const unsigned char* yuv, guint32 format, unsigned char* rgb, int width, int height);
+
+    // Instruction set of the RGB converters, the best one the CPU supports
+    // unless forced (benchmarks, comparisons against the scalar code)
+    static SimdLevel getSimdLevel();
+    static SimdLevel getSupportedSimdLevel();
+    static void setSimdLevel(SimdLevel level);
+
+    // Scale the planes to width x height (chroma to width/2 x height) and
+    // interleave them into dst, which must hold width * height * 2 bytes
+    void packYUYV(const YUVImage& image, unsigned char* dst, int width, int height);
+
+    // Scale the planes to width x height (chroma to width/2 x (height+1)/2) and
+    // write them as NV12 (interleaved chroma) or I420 into dst, which must hold
+    // width * height + width * ((height + 1) / 2) bytes
+    void packYUV420(const YUVImage& image, unsigned char* dst, int width, int height, bool interleaveChroma);
+
+    // Preview of a YUYV frame, rgb must hold width * height * 3 bytes
+    static void yuyvToRGB24(const unsigned char* yuyv, unsigned char* rgb, int width, int height);
+
+    // Preview of a 4:2:0 frame, the chroma samples of a row are chromaStep bytes
+    // apart: 2 for NV12 (v = u + 1), 1 for I420
+    static void yuv420ToRGB24(const unsigned char* y, const unsigned char* u, const unsigned char* v, int chromaStep,
+                              unsigned char* rgb, int width, int height);
+
+    // Bilinear resample of one 8 bit plane
+    static void scalePlane(const unsigned char* src, int srcStride, int srcWidth, int srcHeight,
+                           unsigned char* dst, int dstStride, int dstWidth, int dstHeight);
+
+    // Bilinear resample of an RGB24 image, into a caller provided buffer
+    static void scaleRGB24(const unsigned char* src, int srcStride, int srcWidth, int srcHeight,
+                           unsigned char* dst, int dstStride, int dstWidth, int dstHeight);
+
+private:
+    typedef void (*YUYVRowFunc)(const unsigned char* row, const unsigned char* row2, unsigned char* out,
+                                int pairs, const ColorCoefficients* coeffs);
+    typedef void (*SplitRowFunc)(const unsigned char* yuyv, unsigned char* y, unsigned char* uv, int pairs);
+
+    static volatile gint simdLevel;
+    static const ColorCoefficients coefficients[2];
+
+    static YUYVRowFunc yuyvRowFunc();
+    static SplitRowFunc splitRowFunc();
+    // v is NULL for NV12, u then is the interleaved plane
+    static void rgb24To420(const unsigned char* rgb, int rgbStride, unsigned char* y, unsigned char* u,
+                           unsigned char* v, int width, int height, ColorMatrix matrix);
+
+    // Planes that had to be resampled before packing
+    unsigned char* scratch;
+    int scratchSize;
+
+    unsigned char* reserveScratch(int size);
+    const unsigned char* planeAt(const YUVImage& image, int plane, int width, int height, int& stride,
+                                 unsigned char* scratchPlane);
+};
+
+#endif//__COLOR_CONVERT_H__
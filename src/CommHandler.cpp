@@ -23,7 +23,12 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <stddef.h>
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <bluetooth/bluetooth.h>
@@ -31,33 +36,88 @@
 
 #include "CommHandler.h"
 #include "SmartEngine.h"
+#include "Session.h"
+#include "StreamRecorder.h"
+#ifdef SMARTCAM_HEADLESS
+#include <stdio.h>
+// smartcamd has no UI, errors only go to the log
+#define COMM_ERROR_MSG printf
+#else
 #include "UIHandler.h"
+#define COMM_ERROR_MSG CUIHandler::Msg
+#endif
 
 // Constructor
 CCommHandler::CCommHandler(CSmartEngine* pEngine):
     pSmartEngine(pEngine),
-    isConnected(false),
     serverSocket(INVALID_SOCKET),
-    clientSocket(INVALID_SOCKET),
+    epollFd(-1),
+    wakeFd(-1),
+    spareFd(-1),
     sdpRecord(NULL),
     sdpSession(NULL),
-    rcvPacket(NULL),
-    rcvPacketLen(0),
-    rcvPacketMaxLen(0)
+    pRecorder(NULL)
 {
+    unixSocketPath[0] = '\0';
 }
 
 // Destructor
 CCommHandler::~CCommHandler()
 {
+    StopRecording();
 }
 
 int CCommHandler::Initialize()
 {
-    rcvPacket = new unsigned char[DEFAULT_PAKET_MAX_LEN];
-    if(rcvPacket == NULL)
+    struct epoll_event event = { 0 };
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if(epollFd == -1)
+    {
+        COMM_ERROR_MSG("Could not create epoll set: %d\n(%s)", errno, strerror(errno));
+        return -1;
+    }
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(wakeFd == -1)
+    {
+        COMM_ERROR_MSG("Could not create eventfd: %d\n(%s)", errno, strerror(errno));
         return -1;
-    rcvPacketMaxLen = DEFAULT_PAKET_MAX_LEN;
+    }
+    event.events = EPOLLIN;
+    event.data.ptr = &wakeFd;
+    if(epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event) < 0)
+    {
+        COMM_ERROR_MSG("Could not watch eventfd: %d\n(%s)", errno, strerror(errno));
+        return -1;
+    }
+    spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return 0;
+}
+
+int CCommHandler::SetNonBlocking(int sock)
+{
+    int flags = fcntl(sock, F_GETFL, NULL);
+    if(flags < 0)
+    {
+        COMM_ERROR_MSG("Could not retrieve socket flags: %d\n(%s)", errno, strerror(errno));
+        return -1;
+    }
+    flags |= O_NONBLOCK;
+    return fcntl(sock, F_SETFL, flags);
+}
+
+int CCommHandler::WatchServerSocket()
+{
+    struct epoll_event event = { 0 };
+    event.events = EPOLLIN;
+    event.data.ptr = &serverSocket;
+    if(epoll_ctl(epollFd, EPOLL_CTL_ADD, serverSocket, &event) < 0)
+    {
+        COMM_ERROR_MSG("Could not watch server socket: %d\n(%s)", errno, strerror(errno));
+        close(serverSocket);
+        serverSocket = INVALID_SOCKET;
+        return -1;
+    }
     return 0;
 }
 
@@ -73,33 +133,103 @@ int CCommHandler::StartInetServer(int port)
     serverSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if(serverSocket == INVALID_SOCKET)
     {
-        CUIHandler::Msg("Could not create inet socket: %d\n(%s)", errno, strerror(errno));
+        COMM_ERROR_MSG("Could not create inet socket: %d\n(%s)", errno, strerror(errno));
         return -1;
     }
 
     // Bind the socket to the address returned
     if(bind(serverSocket, (struct sockaddr*)&sin, sizeof(sin)) < 0)
     {
-        CUIHandler::Msg("Could not bind inet socket: %d\n(%s)", errno, strerror(errno));
+        COMM_ERROR_MSG("Could not bind inet socket: %d\n(%s)", errno, strerror(errno));
         close(serverSocket);
+        serverSocket = INVALID_SOCKET;
         return -1;
     }
-    if(listen(serverSocket, 1) < 0)
+    if(listen(serverSocket, SERVER_LISTEN_BACKLOG) < 0)
     {
-        CUIHandler::Msg("Could not listen on inet socket: %d\n(%s)", errno, strerror(errno));
+        COMM_ERROR_MSG("Could not listen on inet socket: %d\n(%s)", errno, strerror(errno));
         close(serverSocket);
+        serverSocket = INVALID_SOCKET;
         return -1;
     }
     flags = fcntl(serverSocket, F_GETFL, NULL);
     if(flags < 0)
     {
-        CUIHandler::Msg("Could not retrieve socket flags: %d\n(%s)", errno, strerror(errno));
+        COMM_ERROR_MSG("Could not retrieve socket flags: %d\n(%s)", errno, strerror(errno));
         return -1;
     }
     flags |= O_NONBLOCK;
     fcntl(serverSocket, F_SETFL, flags);
 
-    return 0;
+    return WatchServerSocket();
+}
+
+int CCommHandler::StartUnixServer(const char* path)
+{
+    struct sockaddr_un sun;
+    socklen_t sunLen = 0;
+    int pathLen = strlen(path);
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if(pathLen == 0 || pathLen >= (int) sizeof(sun.sun_path))
+    {
+        COMM_ERROR_MSG("Invalid unix socket path: \"%s\"", path);
+        return -1;
+    }
+    // the abstract name is not nul terminated, it has the exact address length
+    memcpy(sun.sun_path, path, pathLen);
+    if(path[0] == '@')
+    {
+        sun.sun_path[0] = '\0';
+    }
+    sunLen = offsetof(struct sockaddr_un, sun_path) + pathLen;
+
+    // a socket left behind by a server that did not stop cleanly is replaced,
+    // anything else at the path is the user's file and stays
+    struct stat st;
+    bool stale = false;
+    if(path[0] != '@' && lstat(path, &st) == 0)
+    {
+        if(!S_ISSOCK(st.st_mode))
+        {
+            COMM_ERROR_MSG("Could not bind unix socket %s:\nthe path exists and is not a socket", path);
+            return -1;
+        }
+        stale = true;
+    }
+    serverSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(serverSocket == INVALID_SOCKET)
+    {
+        COMM_ERROR_MSG("Could not create unix socket: %d\n(%s)", errno, strerror(errno));
+        return -1;
+    }
+    if(stale)
+    {
+        unlink(path);
+    }
+    if(bind(serverSocket, (struct sockaddr*)&sun, sunLen) < 0)
+    {
+        COMM_ERROR_MSG("Could not bind unix socket %s: %d\n(%s)", path, errno, strerror(errno));
+        close(serverSocket);
+        serverSocket = INVALID_SOCKET;
+        return -1;
+    }
+    if(path[0] != '@')
+    {
+        snprintf(unixSocketPath, sizeof(unixSocketPath), "%s", path);
+    }
+    if(listen(serverSocket, SERVER_LISTEN_BACKLOG) < 0)
+    {
+        COMM_ERROR_MSG("Could not listen on unix socket: %d\n(%s)", errno, strerror(errno));
+        StopServer();
+        return -1;
+    }
+    if(SetNonBlocking(serverSocket) < 0)
+    {
+        StopServer();
+        return -1;
+    }
+    return WatchServerSocket();
 }
 
 void CCommHandler::RegisterBtService(uint8_t rfcommChannel)
@@ -199,137 +329,152 @@ int CCommHandler::StartBtServer()
     {
         perror("smartcam: dynamic_bind_rc");
         close(serverSocket);
+        serverSocket = INVALID_SOCKET;
         return -1;
     }
     printf("smartcam: port = %d\n", port);
     // advertise bt service
     RegisterBtService(port);
-    if(listen(serverSocket, 1) < 0)
+    if(listen(serverSocket, SERVER_LISTEN_BACKLOG) < 0)
     {
-        CUIHandler::Msg("Could not listen on bt socket: %d\n(%s)", errno, strerror(errno));
+        COMM_ERROR_MSG("Could not listen on bt socket: %d\n(%s)", errno, strerror(errno));
         close(serverSocket);
+        serverSocket = INVALID_SOCKET;
         return -1;
     }
     flags = fcntl(serverSocket, F_GETFL, NULL);
     if(flags < 0)
     {
-        CUIHandler::Msg("Could not retrieve socket flags: %d\n(%s)", errno, strerror(errno));
+        COMM_ERROR_MSG("Could not retrieve socket flags: %d\n(%s)", errno, strerror(errno));
         return -1;
     }
     flags |= O_NONBLOCK;
     fcntl(serverSocket, F_SETFL, flags);
-    return 0;
+    return WatchServerSocket();
 }
 
-AcceptResultCode CCommHandler::AcceptBtClient()
+// Errors of one connection keep the server running; anything else stops it
+AcceptResultCode CCommHandler::OnAcceptError(const char* kind)
+{
+    int error = errno;
+    if(error == EAGAIN || error == EWOULDBLOCK || error == EINTR)
+    {
+        return ACCEPT_RETRY;
+    }
+    if(error == ECONNABORTED || error == EPROTO)
+    {
+        // the phone reset the connection before it was accepted
+        printf("smartcam: %s connection aborted before accept\n", kind);
+        return ACCEPT_RETRY;
+    }
+    if(error == EMFILE || error == ENFILE || error == ENOBUFS)
+    {
+        // the pending connection would wake the comm thread again right away:
+        // free the spare descriptor to accept it, and close it
+        printf("smartcam: refused %s connection: %s\n", kind, strerror(error));
+        if(spareFd != -1)
+        {
+            close(spareFd);
+            int sock = accept(serverSocket, NULL, NULL);
+            if(sock != INVALID_SOCKET)
+            {
+                close(sock);
+            }
+            spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        }
+        return ACCEPT_RETRY;
+    }
+    COMM_ERROR_MSG("Could not accept %s connection on socket: %d\n(%s)", kind, error, strerror(error));
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, serverSocket, NULL);
+    close(serverSocket);
+    serverSocket = INVALID_SOCKET;
+    return ACCEPT_ERROR;
+}
+
+AcceptResultCode CCommHandler::AcceptBtClient(int& clientSocket, char* peerName, int peerNameLen)
 {
     struct sockaddr_rc remAddr = { 0 };
     socklen_t opt = sizeof(remAddr);
     // accept one connection
     if((clientSocket = accept(serverSocket, (struct sockaddr*) &remAddr, &opt)) == INVALID_SOCKET)
     {
-        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
-        {
-            return ACCEPT_RETRY;
-        }
-        CUIHandler::Msg("Could not accept bt connection on socket: %d\n(%s)", errno, strerror(errno));
-        close(serverSocket);
-        return ACCEPT_ERROR;
+        return OnAcceptError("bt");
+    }
+    if(SetNonBlocking(clientSocket) < 0)
+    {
+        close(clientSocket);
+        clientSocket = INVALID_SOCKET;
+        return ACCEPT_RETRY;
     }
 
     char buf[255] = {0};
     ba2str(&remAddr.rc_bdaddr, buf);
     printf("smartcam: accepted bt connection from %s\n", buf);
+    snprintf(peerName, peerNameLen, "%s", buf);
 
-    isConnected = 1;
-    pSmartEngine->OnConnected();
     return ACCEPT_OK;
 }
 
-AcceptResultCode CCommHandler::AcceptInetClient()
+AcceptResultCode CCommHandler::AcceptInetClient(int& clientSocket, char* peerName, int peerNameLen)
 {
     struct sockaddr_in remAddr = { 0 };
     socklen_t opt = sizeof(remAddr);
     // accept one connection
     if((clientSocket = accept(serverSocket, (struct sockaddr*) &remAddr, &opt)) == INVALID_SOCKET)
     {
-        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
-        {
-            return ACCEPT_RETRY;
-        }
-        CUIHandler::Msg("Could not accept inet connection on socket: %d\n(%s)", errno, strerror(errno));
-        close(serverSocket);
-        return ACCEPT_ERROR;
+        return OnAcceptError("inet");
+    }
+    if(SetNonBlocking(clientSocket) < 0)
+    {
+        close(clientSocket);
+        clientSocket = INVALID_SOCKET;
+        return ACCEPT_RETRY;
     }
 
     char* remAddrStr = inet_ntoa(remAddr.sin_addr);
     if(remAddrStr != NULL)
     {
         printf("smartcam: accepted inet connection from %s\n", remAddrStr);
+        snprintf(peerName, peerNameLen, "%s:%d", remAddrStr, ntohs(remAddr.sin_port));
     }
     else
     {
         printf("smartcam: accepted inet connection, but inet_ntoa() failed ...\n");
+        snprintf(peerName, peerNameLen, "inet");
     }
 
-    isConnected = 1;
-    pSmartEngine->OnConnected();
     return ACCEPT_OK;
 }
 
-int CCommHandler::Disconnect()
+AcceptResultCode CCommHandler::AcceptUnixClient(int& clientSocket, char* peerName, int peerNameLen)
 {
-    isConnected = 0;
-    // close the sockets (if opened)
-    if(clientSocket != INVALID_SOCKET)
+    // accept one connection, the peer address of a unix client is unnamed
+    if((clientSocket = accept(serverSocket, NULL, NULL)) == INVALID_SOCKET)
     {
-        close(clientSocket);
-        clientSocket = INVALID_SOCKET;
+        return OnAcceptError("unix");
     }
-    return 0;
-}
-
-int CCommHandler::RcvPacket()
-{
-    int retCode = 0;
-    unsigned char header[4] = {0};
-
-    retCode = recv(clientSocket, (char*) header, 4, 0);
-    if((retCode == 0) || (retCode == -1))
+    if(SetNonBlocking(clientSocket) < 0)
     {
-        Disconnect();
-        pSmartEngine->OnDisconnected();
-        return -1;
+        close(clientSocket);
+        clientSocket = INVALID_SOCKET;
+        return ACCEPT_RETRY;
     }
 
-    rcvPacketType = (SmartCamPacketType) (header[0]);
-    rcvPacketLen = ((unsigned int)header[1] << 16) | ((unsigned int)header[2] << 8) | ((unsigned int)header[3]);
-    if(rcvPacketMaxLen < rcvPacketLen)
+    // name the session after the connecting process, e.g. adb
+    struct ucred cred;
+    socklen_t credLen = sizeof(cred);
+    if(getsockopt(clientSocket, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) == 0)
     {
-        delete[] rcvPacket;
-        rcvPacketMaxLen = rcvPacketLen + rcvPacketLen/3;
-        rcvPacket = new unsigned char[rcvPacketMaxLen];
+        printf("smartcam: accepted unix connection from pid %d\n", (int) cred.pid);
+        snprintf(peerName, peerNameLen, "unix:%d", (int) cred.pid);
     }
-
-    int rcvdBytesCount = 0;
-    while(rcvdBytesCount < rcvPacketLen)
+    else
     {
-        retCode = recv(clientSocket, ((char*) rcvPacket) + rcvdBytesCount, rcvPacketLen - rcvdBytesCount, 0);
-        // Connection closed or socket error
-        if((retCode == 0) || (retCode == -1))
-        {
-            Disconnect();
-            pSmartEngine->OnDisconnected();
-            return -1;
-        }
-        // All went well, advance the byte count
-        else
-        {
-            rcvdBytesCount += retCode;
-        }
+        printf("smartcam: accepted unix connection\n");
+        snprintf(peerName, peerNameLen, "unix");
     }
 
-    return 0;
+    return ACCEPT_OK;
 }
 
 void CCommHandler::StopServer()
@@ -345,47 +490,119 @@ void CCommHandler::StopServer()
         sdpSession = NULL;
     }
 
-    // close the sockets (if open)
-    if(clientSocket != INVALID_SOCKET)
-    {
-        close(clientSocket);
-        clientSocket = INVALID_SOCKET;
-    }
+    // close the server socket (if open), sessions close their own sockets
     if(serverSocket != INVALID_SOCKET)
     {
         close(serverSocket);
         serverSocket = INVALID_SOCKET;
     }
+    if(unixSocketPath[0] != '\0')
+    {
+        unlink(unixSocketPath);
+        unixSocketPath[0] = '\0';
+    }
 }
 
-void CCommHandler::Cleanup()
+int CCommHandler::WaitEvents(CommEvent* events, int timeoutMillis)
 {
-    StopServer();
-    if(rcvPacket != NULL)
+    struct epoll_event epollEvents[MAX_COMM_EVENTS];
+    int count = epoll_wait(epollFd, epollEvents, MAX_COMM_EVENTS, timeoutMillis);
+    if(count < 0)
     {
-        delete[] rcvPacket;
-        rcvPacket = NULL;
+        if(errno == EINTR)
+            return 0;
+        COMM_ERROR_MSG("Could not wait for socket events: %d\n(%s)", errno, strerror(errno));
+        return -1;
     }
-    rcvPacketLen = 0;
-    rcvPacketMaxLen = 0;
+    for(int i = 0; i < count; i++)
+    {
+        events[i].pSession = NULL;
+        if(epollEvents[i].data.ptr == &wakeFd)
+        {
+            eventfd_t value = 0;
+            eventfd_read(wakeFd, &value);
+            events[i].type = COMM_EVENT_WAKEUP;
+        }
+        else if(epollEvents[i].data.ptr == &serverSocket)
+        {
+            events[i].type = COMM_EVENT_ACCEPT;
+        }
+        else
+        {
+            events[i].type = COMM_EVENT_READ;
+            events[i].pSession = (CSession*) epollEvents[i].data.ptr;
+        }
+    }
+    return count;
+}
+
+void CCommHandler::Wakeup()
+{
+    eventfd_write(wakeFd, 1);
+}
+
+int CCommHandler::AddSession(CSession* pSession)
+{
+    struct epoll_event event = { 0 };
+    event.events = EPOLLIN;
+    event.data.ptr = pSession;
+    return epoll_ctl(epollFd, EPOLL_CTL_ADD, pSession->GetSocket(), &event);
 }
 
-bool CCommHandler::IsConnected()
+// The session socket may stay open a while after this, until the workers
+// still running on the session are done with it.
+void CCommHandler::RemoveSession(CSession* pSession)
 {
-    return isConnected;
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, pSession->GetSocket(), NULL);
 }
 
-unsigned char* CCommHandler::GetRcvPacket()
+// Must be called before the comm thread starts
+int CCommHandler::StartRecording(const char* fileName)
 {
-    return rcvPacket;
+    pRecorder = new CStreamRecorder();
+    if(pRecorder->Open(fileName) != 0)
+    {
+        delete pRecorder;
+        pRecorder = NULL;
+        return -1;
+    }
+    return 0;
 }
 
-unsigned int CCommHandler::GetRcvPacketLen()
+void CCommHandler::StopRecording()
 {
-    return rcvPacketLen;
+    if(pRecorder != NULL)
+    {
+        delete pRecorder;
+        pRecorder = NULL;
+    }
 }
 
-SmartCamPacketType CCommHandler::GetRcvPacketType()
+void CCommHandler::RecordPacket(int sessionId, const unsigned char* header, const unsigned char* payload,
+                                unsigned int length, gint64 timeMicros)
 {
-    return rcvPacketType;
+    if(pRecorder != NULL)
+    {
+        pRecorder->RecordPacket(sessionId, header, payload, length, timeMicros);
+    }
+}
+
+void CCommHandler::Cleanup()
+{
+    StopServer();
+    if(wakeFd != -1)
+    {
+        close(wakeFd);
+        wakeFd = -1;
+    }
+    if(spareFd != -1)
+    {
+        close(spareFd);
+        spareFd = -1;
+    }
+    if(epollFd != -1)
+    {
+        close(epollFd);
+        epollFd = -1;
+    }
 }
@@ -22,12 +22,15 @@
 #ifndef __COMM_HANDLER_H__
 #define __COMM_HANDLER_H__
 
+#include <glib.h>
 #include <bluetooth/sdp.h>
 #include <bluetooth/sdp_lib.h>
 
 #define INVALID_SOCKET -1
 
 class CSmartEngine;
+class CSession;
+class CStreamRecorder;
 
 typedef enum AcceptResultCode
 {
@@ -42,7 +45,24 @@ typedef enum SmartCamPacketType
     PACKET_JPEG_DATA = 1
 } SmartCamPacketType;
 
+typedef enum CommEventType
+{
+    COMM_EVENT_WAKEUP = 0,  // Wakeup() was called (shutdown / reconfigure)
+    COMM_EVENT_ACCEPT = 1,  // a client is waiting on the server socket
+    COMM_EVENT_READ = 2     // a session socket is readable (or closed)
+} CommEventType;
+
+typedef struct CommEvent
+{
+    CommEventType type;
+    CSession* pSession;
+} CommEvent;
+
 #define DEFAULT_PAKET_MAX_LEN 4096
+// Pending connections queued by the kernel while the comm thread is busy
+#define SERVER_LISTEN_BACKLOG 8
+// Maximum number of events returned by one WaitEvents() call
+#define MAX_COMM_EVENTS 16
 
 class CCommHandler
 {
@@ -53,34 +73,46 @@ public:
     void Cleanup();
     int StartInetServer(int port);
     int StartBtServer();
+    // A leading '@' in path selects the abstract namespace
+    int StartUnixServer(const char* path);
     void StopServer();
-    AcceptResultCode AcceptBtClient();
-    AcceptResultCode AcceptInetClient();
-    int Disconnect();
-    int RcvPacket();
-    bool IsConnected();
-    unsigned char* GetRcvPacket();
-    unsigned int GetRcvPacketLen();
-    SmartCamPacketType GetRcvPacketType();
+    AcceptResultCode AcceptBtClient(int& clientSocket, char* peerName, int peerNameLen);
+    AcceptResultCode AcceptInetClient(int& clientSocket, char* peerName, int peerNameLen);
+    AcceptResultCode AcceptUnixClient(int& clientSocket, char* peerName, int peerNameLen);
+    // Event loop:
+    int WaitEvents(CommEvent* events, int timeoutMillis);
+    void Wakeup();
+    int AddSession(CSession* pSession);
+    void RemoveSession(CSession* pSession);
+    // Recording of the received packets, see StreamRecorder.h:
+    int StartRecording(const char* fileName);
+    void StopRecording();
+    void RecordPacket(int sessionId, const unsigned char* header, const unsigned char* payload,
+                      unsigned int length, gint64 timeMicros);
 
 private:
     // Methods:
     void RegisterBtService(uint8_t rfcommChannel);
     int DynamicBtBind(int sock, struct sockaddr_rc* sockaddr, uint8_t* port);
+    int WatchServerSocket();
+    AcceptResultCode OnAcceptError(const char* kind);
+    static int SetNonBlocking(int sock);
     // Data:
     CSmartEngine* pSmartEngine;
-    bool isConnected;
     // sockets:
     int serverSocket;
-    int clientSocket;
+    // filesystem socket to unlink when the server stops, empty if none
+    char unixSocketPath[108];  // sizeof(sockaddr_un.sun_path)
+    // event loop: epoll set and the eventfd used to wake it up
+    int epollFd;
+    int wakeFd;
+    // kept open so a connection can still be turned away when out of descriptors
+    int spareFd;
     // BT SDP:
     sdp_record_t* sdpRecord;
     sdp_session_t* sdpSession;
-
-    unsigned char* rcvPacket;
-    unsigned int rcvPacketLen;
-    unsigned int rcvPacketMaxLen;
-    SmartCamPacketType rcvPacketType;
+    // NULL unless recording, used by the comm thread only
+    CStreamRecorder* pRecorder;
 };
 
 #endif//__COMM_HANDLER_H__
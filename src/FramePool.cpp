@@ -0,0 +1,236 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// FramePool.cpp
+
+#include "FramePool.h"
+
+volatile gint CFramePool::allocationCount = 0;
+
+CFramePool::CFramePool(int packetCount, int frameCount, int width, int height):
+    lock(NULL),
+    freePackets(NULL),
+    freeFrames(NULL),
+    frameWidth(width),
+    frameHeight(height)
+{
+    lock = g_mutex_new();
+    for(int i = 0; i < packetCount; i++)
+    {
+        SmartCamPacket* pPacket = NewPacket(SMARTCAM_PACKET_PREALLOC_LEN);
+        pPacket->next = freePackets;
+        freePackets = pPacket;
+    }
+    for(int i = 0; i < frameCount; i++)
+    {
+        SmartCamFrame* pFrame = NewFrame();
+        pFrame->next = freeFrames;
+        freeFrames = pFrame;
+    }
+}
+
+// Everything acquired must have been released
+CFramePool::~CFramePool()
+{
+    while(freePackets != NULL)
+    {
+        SmartCamPacket* pPacket = freePackets;
+        freePackets = pPacket->next;
+        DeletePacket(pPacket);
+    }
+    while(freeFrames != NULL)
+    {
+        SmartCamFrame* pFrame = freeFrames;
+        freeFrames = pFrame->next;
+        DeleteFrame(pFrame);
+    }
+    g_mutex_free(lock);
+}
+
+SmartCamPacket* CFramePool::NewPacket(unsigned int length)
+{
+    SmartCamPacket* pPacket = new SmartCamPacket;
+    pPacket->type = PACKET_JPEG_DATA;
+    pPacket->data = new unsigned char[length];
+    pPacket->length = 0;
+    pPacket->maxLength = length;
+    pPacket->next = NULL;
+    return pPacket;
+}
+
+SmartCamFrame* CFramePool::NewFrame()
+{
+    SmartCamFrame* pFrame = new SmartCamFrame;
+    pFrame->outWidth = frameWidth;
+    pFrame->outHeight = frameHeight;
+    pFrame->rgbStride = frameWidth * 3;
+    pFrame->rgb = new unsigned char[pFrame->rgbStride * frameHeight];
+    pFrame->rgbWidth = frameWidth;
+    pFrame->rgbHeight = frameHeight;
+    pFrame->yuv = new unsigned char[frameWidth * frameHeight * 2];
+    pFrame->yuvFormat = 0;
+    pFrame->jpeg = NULL;
+    pFrame->jpegLength = 0;
+    pFrame->jpegMaxLength = 0;
+    pFrame->hasRGB = false;
+    pFrame->hasYUV = false;
+    pFrame->hasJPEG = false;
+    pFrame->width = 0;
+    pFrame->height = 0;
+    pFrame->next = NULL;
+    return pFrame;
+}
+
+void CFramePool::DeletePacket(SmartCamPacket* pPacket)
+{
+    delete[] pPacket->data;
+    delete pPacket;
+}
+
+void CFramePool::DeleteFrame(SmartCamFrame* pFrame)
+{
+    delete[] pFrame->rgb;
+    delete[] pFrame->yuv;
+    delete[] pFrame->jpeg;
+    delete pFrame;
+}
+
+SmartCamPacket* CFramePool::AcquirePacket(unsigned int length)
+{
+    g_mutex_lock(lock);
+    SmartCamPacket* pPacket = freePackets;
+    if(pPacket != NULL)
+    {
+        freePackets = pPacket->next;
+    }
+    g_mutex_unlock(lock);
+
+    if(pPacket == NULL)
+    {
+        // more packets in flight than the pool was sized for
+        CountAllocation();
+        return NewPacket(length);
+    }
+    pPacket->next = NULL;
+    ReservePacket(pPacket, length);
+    return pPacket;
+}
+
+// Grow the buffer if needed, with some headroom for the next larger frames
+void CFramePool::ReservePacket(SmartCamPacket* pPacket, unsigned int length)
+{
+    if(pPacket->maxLength < length)
+    {
+        CountAllocation();
+        delete[] pPacket->data;
+        pPacket->maxLength = length + length/3;
+        pPacket->data = new unsigned char[pPacket->maxLength];
+    }
+}
+
+void CFramePool::ReleasePacket(SmartCamPacket* pPacket)
+{
+    g_mutex_lock(lock);
+    pPacket->next = freePackets;
+    freePackets = pPacket;
+    g_mutex_unlock(lock);
+}
+
+SmartCamFrame* CFramePool::AcquireFrame()
+{
+    g_mutex_lock(lock);
+    SmartCamFrame* pFrame = freeFrames;
+    if(pFrame != NULL)
+    {
+        freeFrames = pFrame->next;
+    }
+    g_mutex_unlock(lock);
+
+    if(pFrame == NULL)
+    {
+        CountAllocation();
+        pFrame = NewFrame();
+    }
+    pFrame->next = NULL;
+    pFrame->rgbWidth = pFrame->outWidth;
+    pFrame->rgbHeight = pFrame->outHeight;
+    pFrame->hasRGB = false;
+    pFrame->hasYUV = false;
+    pFrame->hasJPEG = false;
+    return pFrame;
+}
+
+// Same headroom as the packets, the jpeg is the phone packet plus its tables
+void CFramePool::ReserveJpeg(SmartCamFrame* pFrame, unsigned int length)
+{
+    if(pFrame->jpegMaxLength < length)
+    {
+        CountAllocation();
+        delete[] pFrame->jpeg;
+        pFrame->jpegMaxLength = length + length/3;
+        pFrame->jpeg = new unsigned char[pFrame->jpegMaxLength];
+    }
+}
+
+void CFramePool::ReleaseFrame(SmartCamFrame* pFrame)
+{
+    g_mutex_lock(lock);
+    bool isStale = (pFrame->outWidth != frameWidth || pFrame->outHeight != frameHeight);
+    if(!isStale)
+    {
+        pFrame->next = freeFrames;
+        freeFrames = pFrame;
+    }
+    g_mutex_unlock(lock);
+    if(isStale)
+    {
+        DeleteFrame(pFrame);
+    }
+}
+
+void CFramePool::SetFrameSize(int width, int height)
+{
+    // only the caller changes the size, no lock needed to read it
+    if(width == frameWidth && height == frameHeight)
+    {
+        return;
+    }
+    g_mutex_lock(lock);
+    frameWidth = width;
+    frameHeight = height;
+    SmartCamFrame* staleFrames = freeFrames;
+    freeFrames = NULL;
+    g_mutex_unlock(lock);
+    while(staleFrames != NULL)
+    {
+        SmartCamFrame* pFrame = staleFrames;
+        staleFrames = pFrame->next;
+        DeleteFrame(pFrame);
+    }
+}
+
+void CFramePool::CountAllocation()
+{
+    g_atomic_int_inc(&allocationCount);
+}
+
+int CFramePool::GetAllocationCount()
+{
+    return g_atomic_int_get(&allocationCount);
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// FramePool.h
+
+#ifndef __FRAME_POOL_H__
+#define __FRAME_POOL_H__
+
+#include <glib.h>
+
+#include "Pipeline.h"
+
+// Initial size of the pooled receive buffers, a typical phone jpeg fits
+#define SMARTCAM_PACKET_PREALLOC_LEN (64 * 1024)
+
+// Packets and frames of one session, allocated when the session starts and
+// recycled afterwards so that streaming does no heap allocation per frame.
+// Acquire and release may be called from any thread.
+class CFramePool
+{
+public:
+    CFramePool(int packetCount, int frameCount, int frameWidth, int frameHeight);
+    virtual ~CFramePool();
+
+    // The returned packet can hold at least length bytes
+    SmartCamPacket* AcquirePacket(unsigned int length);
+    void ReleasePacket(SmartCamPacket* pPacket);
+    static void ReservePacket(SmartCamPacket* pPacket, unsigned int length);
+
+    SmartCamFrame* AcquireFrame();
+    void ReleaseFrame(SmartCamFrame* pFrame);
+    // The jpeg buffer of the frame can hold at least length bytes
+    static void ReserveJpeg(SmartCamFrame* pFrame, unsigned int length);
+    // Frames acquired afterwards are of the new size, the pooled ones are freed
+    // and frames of the old size still in flight are freed when released.
+    // Called by the decode stage only.
+    void SetFrameSize(int width, int height);
+
+    // Heap allocations done on the frame path by all sessions, including the
+    // buffers of the decoders and converters that had to grow. Only warm-up
+    // and resolution changes should move it.
+    static void CountAllocation();
+    static int GetAllocationCount();
+
+private:
+    SmartCamPacket* NewPacket(unsigned int length);
+    SmartCamFrame* NewFrame();
+    static void DeletePacket(SmartCamPacket* pPacket);
+    static void DeleteFrame(SmartCamFrame* pFrame);
+
+    GMutex* lock;
+    SmartCamPacket* freePackets;
+    SmartCamFrame* freeFrames;
+    int frameWidth;
+    int frameHeight;
+
+    static volatile gint allocationCount;
+};
+
+#endif//__FRAME_POOL_H__
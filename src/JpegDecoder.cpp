@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// JpegDecoder.cpp
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/time.h>
+
+#include "JpegDecoder.h"
+#include "JpegHandler.h"
+#include "JpegEncoder.h"
+#ifdef HAVE_TURBOJPEG
+#include "TurboJpegHandler.h"
+#endif
+
+// Sample frame used to time the backends: a typical phone frame, decoded
+// down to the device size like in the pipeline
+#define BENCHMARK_FRAME_WIDTH 640
+#define BENCHMARK_FRAME_HEIGHT 480
+#define BENCHMARK_TARGET_WIDTH 320
+#define BENCHMARK_TARGET_HEIGHT 240
+#define BENCHMARK_ROUNDS 10
+
+static const char* backendNames[] = { "auto", "libjpeg", "turbojpeg" };
+
+bool CJpegDecoder::isAvailable(JpegBackend backend)
+{
+    switch(backend)
+    {
+    case JPEG_BACKEND_LIBJPEG:
+        return true;
+#ifdef HAVE_TURBOJPEG
+    case JPEG_BACKEND_TURBOJPEG:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+CJpegDecoder* CJpegDecoder::create(JpegBackend backend)
+{
+    switch(backend)
+    {
+#ifdef HAVE_TURBOJPEG
+    case JPEG_BACKEND_TURBOJPEG:
+        return new CTurboJpegHandler();
+#endif
+    default:
+        return new CJpegHandler();
+    }
+}
+
+// Walks the marker segments from after SOI up to the first SOS or EOI marker
+// and returns the offset of that marker, -1 if the stream is malformed.
+// hasTables tells whether a DQT segment was found, width/height are set from
+// the SOF segment if there is one.
+static int scan_jpeg_segments(const unsigned char* buffer, int size, bool &hasTables, int &width, int &height)
+{
+    hasTables = false;
+    if(size < 4 || buffer[0] != 0xFF || buffer[1] != 0xD8)
+    {
+        return -1;
+    }
+    int pos = 2;
+    while(pos + 1 < size)
+    {
+        if(buffer[pos] != 0xFF)
+        {
+            return -1;
+        }
+        unsigned char marker = buffer[pos + 1];
+        if(marker == 0xFF)
+        {
+            // fill byte
+            pos++;
+            continue;
+        }
+        if(marker == 0xDA || marker == 0xD9)
+        {
+            // SOS or EOI
+            return pos;
+        }
+        if(marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7))
+        {
+            // TEM and RSTn have no length
+            pos += 2;
+            continue;
+        }
+        if(pos + 3 >= size)
+        {
+            return -1;
+        }
+        int length = (buffer[pos + 2] << 8) | buffer[pos + 3];
+        if(length < 2 || pos + 2 + length > size)
+        {
+            return -1;
+        }
+        if(marker == 0xDB)
+        {
+            hasTables = true;
+        }
+        else if(marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC &&
+                length >= 7)
+        {
+            // SOFn, not DHT, JPG or DAC: precision, height, width
+            height = (buffer[pos + 5] << 8) | buffer[pos + 6];
+            width = (buffer[pos + 7] << 8) | buffer[pos + 8];
+        }
+        pos += 2 + length;
+    }
+    return -1;
+}
+
+int CJpegDecoder::mergeTables(const unsigned char* tables, int tablesSize, const unsigned char* frame, int frameSize,
+                              unsigned char* dst, int maxSize, int &width, int &height)
+{
+    bool frameHasTables = false;
+    if(scan_jpeg_segments(frame, frameSize, frameHasTables, width, height) < 0)
+    {
+        return -1;
+    }
+    // the segments of the tables-only stream, between its SOI and EOI markers
+    int tablesEnd = -1;
+    if(!frameHasTables && tables != NULL)
+    {
+        bool hasTables = false;
+        int w = 0, h = 0;
+        tablesEnd = scan_jpeg_segments(tables, tablesSize, hasTables, w, h);
+    }
+    if(tablesEnd < 0)
+    {
+        // complete already, or nothing usable to merge in
+        if(frameSize > maxSize)
+        {
+            return -1;
+        }
+        memcpy(dst, frame, frameSize);
+        return frameSize;
+    }
+    int segmentsSize = tablesEnd - 2;
+    if(frameSize + segmentsSize > maxSize)
+    {
+        return -1;
+    }
+    memcpy(dst, frame, 2);
+    memcpy(dst + 2, tables + 2, segmentsSize);
+    memcpy(dst + 2 + segmentsSize, frame + 2, frameSize - 2);
+    return frameSize + segmentsSize;
+}
+
+// Encode the test pattern of the simulated phones, it gives the entropy decoder work to do
+unsigned char* CJpegDecoder::createSampleFrame(int width, int height, int &size)
+{
+    unsigned char* rgb = (unsigned char*) malloc(3 * width * height);
+    CJpegEncoder::drawTestPattern(rgb, width, height, 0);
+    CJpegEncoder encoder(width, height, 85);
+    unsigned char* frame = encoder.encodeImage(rgb, size);
+    free(rgb);
+    return frame;
+}
+
+// Returns the time in microseconds to decode the sample frame BENCHMARK_ROUNDS times, -1 on error
+long CJpegDecoder::benchmark(JpegBackend backend, const unsigned char* frame, int size)
+{
+    int w = 0, h = 0, outW = 0, outH = 0;
+    struct timeval start, end;
+    long elapsed = -1;
+    CJpegDecoder* pDecoder = create(backend);
+
+    // warm up: first call allocates the output buffer
+    if(pDecoder->decodeRGB24(frame, size, BENCHMARK_TARGET_WIDTH, BENCHMARK_TARGET_HEIGHT, w, h, outW, outH) != NULL)
+    {
+        gettimeofday(&start, NULL);
+        for(int i = 0; i < BENCHMARK_ROUNDS; i++)
+        {
+            pDecoder->decodeRGB24(frame, size, BENCHMARK_TARGET_WIDTH, BENCHMARK_TARGET_HEIGHT, w, h, outW, outH);
+        }
+        gettimeofday(&end, NULL);
+        elapsed = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+    }
+    delete pDecoder;
+    return elapsed;
+}
+
+JpegBackend CJpegDecoder::selectBackend(JpegBackend preferred)
+{
+    if(preferred != JPEG_BACKEND_AUTO)
+    {
+        if(isAvailable(preferred))
+        {
+            printf("smartcam: using the %s jpeg decoder\n", backendNames[preferred]);
+            return preferred;
+        }
+        printf("smartcam: %s jpeg decoder not available, selecting automatically\n",
+               (preferred > 0 && preferred <= JPEG_BACKEND_TURBOJPEG) ? backendNames[preferred] : "requested");
+    }
+
+    int size = 0;
+    unsigned char* frame = createSampleFrame(BENCHMARK_FRAME_WIDTH, BENCHMARK_FRAME_HEIGHT, size);
+    JpegBackend best = JPEG_BACKEND_LIBJPEG;
+    long bestTime = -1;
+    for(int backend = JPEG_BACKEND_LIBJPEG; backend <= JPEG_BACKEND_TURBOJPEG; backend++)
+    {
+        if(!isAvailable((JpegBackend) backend))
+        {
+            continue;
+        }
+        long elapsed = benchmark((JpegBackend) backend, frame, size);
+        printf("smartcam: %s jpeg decoder: %ld us per frame\n", backendNames[backend],
+               elapsed < 0 ? -1 : elapsed / BENCHMARK_ROUNDS);
+        if(elapsed >= 0 && (bestTime < 0 || elapsed < bestTime))
+        {
+            best = (JpegBackend) backend;
+            bestTime = elapsed;
+        }
+    }
+    free(frame);
+    printf("smartcam: using the %s jpeg decoder\n", backendNames[best]);
+    return best;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// JpegDecoder.h
+
+#ifndef __JPEG_DECODER_H__
+#define __JPEG_DECODER_H__
+
+#include "UserSettings.h"
+#include "ColorConvert.h"
+
+// Interface of the jpeg decoder backends. One instance per session, an
+// instance is only used by one thread at a time.
+class CJpegDecoder
+{
+public:
+    virtual ~CJpegDecoder() {}
+
+    virtual const char* getName() = 0;
+
+    // Loads the tables of an abbreviated stream, sent once after connecting
+    virtual bool decodeHeader(const unsigned char* buffer, int size) = 0;
+
+    // Decode at the smallest scaled size that still covers targetWidth x targetHeight
+    // (full size if the target is 0x0). width/height get the jpeg size, outWidth/outHeight
+    // the size of the returned RGB24 image. The buffer belongs to the decoder and
+    // is reused by the next call.
+    virtual unsigned char* decodeRGB24(const unsigned char* buffer, int size, int targetWidth, int targetHeight,
+                                       int &width, int &height, int &outWidth, int &outHeight) = 0;
+
+    // Same scaling as decodeRGB24, but keeps the planar YCbCr data of the jpeg
+    // (no color conversion, no chroma upsampling). Fails for streams that are
+    // not 3 component YCbCr. The planes belong to the decoder.
+    virtual bool decodeYUV(const unsigned char* buffer, int size, int targetWidth, int targetHeight,
+                           int &width, int &height, YUVImage& image) = 0;
+
+    // Passthrough of the phone jpegs (MJPEG capture): the phone sends the tables
+    // once in the header packet and the frames as abbreviated streams. Inserts the
+    // tables after the SOI marker of the frame so any decoder takes it; a frame that
+    // has its own tables is copied as is. width/height get the size from the SOF
+    // marker. Returns the length written to dst, -1 if the frame is not a jpeg or
+    // does not fit in maxSize.
+    static int mergeTables(const unsigned char* tables, int tablesSize, const unsigned char* frame, int frameSize,
+                           unsigned char* dst, int maxSize, int &width, int &height);
+
+    static bool isAvailable(JpegBackend backend);
+    static CJpegDecoder* create(JpegBackend backend);
+    // Resolve JPEG_BACKEND_AUTO (or a backend not compiled in) by timing
+    // every available backend on a built-in sample frame
+    static JpegBackend selectBackend(JpegBackend preferred);
+
+private:
+    static unsigned char* createSampleFrame(int width, int height, int &size);
+    static long benchmark(JpegBackend backend, const unsigned char* frame, int size);
+};
+
+#endif//__JPEG_DECODER_H__
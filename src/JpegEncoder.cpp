@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// JpegEncoder.cpp
+
+#include <cstdlib>
+
+#include "JpegEncoder.h"
+
+#define ENCODER_INITIAL_BUFFER_SIZE (64 * 1024)
+
+// Memory destination, libjpeg 6b has no jpeg_mem_dest()
+typedef struct EncoderDestMgr
+{
+    struct jpeg_destination_mgr pub;
+    unsigned char* buffer;
+    int size;
+} EncoderDestMgr;
+
+static void encoder_init_destination(j_compress_ptr cinfo)
+{
+    EncoderDestMgr* dest = (EncoderDestMgr*) cinfo->dest;
+    dest->pub.next_output_byte = dest->buffer;
+    dest->pub.free_in_buffer = dest->size;
+}
+
+static boolean encoder_empty_output_buffer(j_compress_ptr cinfo)
+{
+    EncoderDestMgr* dest = (EncoderDestMgr*) cinfo->dest;
+    int oldSize = dest->size;
+    dest->size *= 2;
+    dest->buffer = (unsigned char*) realloc(dest->buffer, dest->size);
+    dest->pub.next_output_byte = dest->buffer + oldSize;
+    dest->pub.free_in_buffer = dest->size - oldSize;
+    return TRUE;
+}
+
+static void encoder_term_destination(j_compress_ptr cinfo)
+{
+    EncoderDestMgr* dest = (EncoderDestMgr*) cinfo->dest;
+    dest->size -= dest->pub.free_in_buffer;
+}
+
+static void encoder_set_destination(j_compress_ptr cinfo, EncoderDestMgr* dest)
+{
+    dest->pub.init_destination = encoder_init_destination;
+    dest->pub.empty_output_buffer = encoder_empty_output_buffer;
+    dest->pub.term_destination = encoder_term_destination;
+    dest->size = ENCODER_INITIAL_BUFFER_SIZE;
+    dest->buffer = (unsigned char*) malloc(dest->size);
+    cinfo->dest = &dest->pub;
+}
+
+CJpegEncoder::CJpegEncoder(int width, int height, int quality)
+{
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+}
+
+CJpegEncoder::~CJpegEncoder()
+{
+    jpeg_destroy_compress(&cinfo);
+}
+
+unsigned char* CJpegEncoder::encodeHeader(int &size)
+{
+    EncoderDestMgr dest;
+    encoder_set_destination(&cinfo, &dest);
+    // marks the tables as sent, encodeFrame() leaves them out
+    jpeg_write_tables(&cinfo);
+    size = dest.size;
+    return dest.buffer;
+}
+
+unsigned char* CJpegEncoder::encodeFrame(const unsigned char* rgb, int &size)
+{
+    return compress(rgb, FALSE, size);
+}
+
+unsigned char* CJpegEncoder::encodeImage(const unsigned char* rgb, int &size)
+{
+    return compress(rgb, TRUE, size);
+}
+
+unsigned char* CJpegEncoder::compress(const unsigned char* rgb, boolean writeAllTables, int &size)
+{
+    EncoderDestMgr dest;
+    encoder_set_destination(&cinfo, &dest);
+    jpeg_start_compress(&cinfo, writeAllTables);
+    while(cinfo.next_scanline < cinfo.image_height)
+    {
+        JSAMPROW rowPtr = (JSAMPROW) (rgb + cinfo.next_scanline * cinfo.image_width * 3);
+        jpeg_write_scanlines(&cinfo, &rowPtr, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    size = dest.size;
+    return dest.buffer;
+}
+
+void CJpegEncoder::drawTestPattern(unsigned char* rgb, int width, int height, int frameIndex)
+{
+    int shift = frameIndex * 4;
+    for(int y = 0; y < height; y++)
+    {
+        unsigned char* row = rgb + y * width * 3;
+        for(int x = 0; x < width; x++)
+        {
+            row[3 * x] = (unsigned char) (255 * ((x + shift) % width) / width);
+            row[3 * x + 1] = (unsigned char) (255 * y / height);
+            row[3 * x + 2] = (unsigned char) ((((x + shift) ^ y) & 8) ? 200 : 40);
+        }
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// JpegEncoder.h
+
+#ifndef __JPEG_ENCODER_H__
+#define __JPEG_ENCODER_H__
+
+#include <cstdio>
+extern "C" {
+#include "jpeglib.h"
+}
+
+// Encodes frames the way the phone client sends them: the quantization and
+// huffman tables once in a tables-only stream (PACKET_JPEG_HEDAER), then
+// every frame as an abbreviated stream without tables (PACKET_JPEG_DATA).
+// The server uses it for the frames it makes itself (logo, backend benchmark).
+class CJpegEncoder
+{
+public:
+    CJpegEncoder(int width, int height, int quality);
+    ~CJpegEncoder();
+
+    // The returned buffers are malloc()ed and belong to the caller
+    unsigned char* encodeHeader(int &size);
+    // rgb is packed RGB24, width * 3 bytes per row
+    unsigned char* encodeFrame(const unsigned char* rgb, int &size);
+    // Complete stream that carries its own tables, whatever was sent before
+    unsigned char* encodeImage(const unsigned char* rgb, int &size);
+
+    // Moving gradient with some detail, so the entropy coder has work to do
+    static void drawTestPattern(unsigned char* rgb, int width, int height, int frameIndex);
+
+private:
+    unsigned char* compress(const unsigned char* rgb, boolean writeAllTables, int &size);
+
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+};
+
+#endif//__JPEG_ENCODER_H__
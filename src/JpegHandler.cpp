@@ -24,6 +24,7 @@
 #include <cmath>
 
 #include "JpegHandler.h"
+#include "FramePool.h"
 
 void CJpegHandler::init_source(j_decompress_ptr cinfo)
 {
@@ -64,12 +65,20 @@ CJpegHandler::CJpegHandler()
 
     rgbBuffer = NULL;
     rgbBufferSize = 0;
+    yuvBuffer = NULL;
+    yuvBufferSize = 0;
 }
 
 CJpegHandler::~CJpegHandler()
 {
     jpeg_destroy_decompress(&cinfo);
     free(rgbBuffer);
+    free(yuvBuffer);
+}
+
+const char* CJpegHandler::getName()
+{
+    return "libjpeg";
 }
 
 bool CJpegHandler::decodeHeader(const unsigned char* buffer, int size)
@@ -86,6 +95,37 @@ bool CJpegHandler::decodeHeader(const unsigned char* buffer, int size)
 }
 
 unsigned char* CJpegHandler::decodeRGB24(const unsigned char* buffer, int size, int &width, int &height)
+{
+    int outWidth = 0, outHeight = 0;
+    return decodeRGB24(buffer, size, 0, 0, width, height, outWidth, outHeight);
+}
+
+// Pick the scale factor giving the smallest output that is not smaller than
+// the target. Candidates are M/8: libjpeg 7+ and libjpeg-turbo honour them all,
+// libjpeg 6b rounds them up to 1/8, 1/4, 1/2 or 1/1, so the dimensions are
+// always taken from jpeg_calc_output_dimensions() rather than computed here.
+void CJpegHandler::selectScale(int targetWidth, int targetHeight)
+{
+    unsigned int bestNum = 8;
+    cinfo.scale_denom = 8;
+    if (targetWidth > 0 && targetHeight > 0)
+    {
+        for (unsigned int num = 1; num < 8; num++)
+        {
+            cinfo.scale_num = num;
+            jpeg_calc_output_dimensions(&cinfo);
+            if ((int) cinfo.output_width >= targetWidth && (int) cinfo.output_height >= targetHeight)
+            {
+                bestNum = num;
+                break;
+            }
+        }
+    }
+    cinfo.scale_num = bestNum;
+}
+
+unsigned char* CJpegHandler::decodeRGB24(const unsigned char* buffer, int size, int targetWidth, int targetHeight,
+                                         int &width, int &height, int &outWidth, int &outHeight)
 {
     if (setjmp(returnpoint)) {
         printf("Error: %s\n", messagebuffer);
@@ -95,26 +135,107 @@ unsigned char* CJpegHandler::decodeRGB24(const unsigned char* buffer, int size,
     srcmgr.next_input_byte = buffer;
 
     jpeg_read_header(&cinfo, TRUE);
+    selectScale(targetWidth, targetHeight);
     jpeg_start_decompress(&cinfo);
 
-    width = cinfo.output_width;
-    height = cinfo.output_height;
+    width = cinfo.image_width;
+    height = cinfo.image_height;
+    outWidth = cinfo.output_width;
+    outHeight = cinfo.output_height;
 
-    if (rgbBuffer == NULL || rgbBufferSize < 3 * width * height) {
-        rgbBufferSize = 3 * width * height;
+    if (rgbBuffer == NULL || rgbBufferSize < 3 * outWidth * outHeight) {
+        rgbBufferSize = 3 * outWidth * outHeight;
+        CFramePool::CountAllocation();
         free(rgbBuffer);
         rgbBuffer = (unsigned char*) malloc(rgbBufferSize);
     }
 
     while (cinfo.output_scanline < cinfo.output_height)
     {
-        unsigned char* crtRGBRow = rgbBuffer + 3 * cinfo.image_width * cinfo.output_scanline;
+        unsigned char* crtRGBRow = rgbBuffer + 3 * cinfo.output_width * cinfo.output_scanline;
         jpeg_read_scanlines(&cinfo, (JSAMPARRAY) &crtRGBRow, 1);
     }
     jpeg_finish_decompress(&cinfo);
     return rgbBuffer;
 }
 
+// Size in samples of one scaled DCT block, the field was split in libjpeg 7
+#if JPEG_LIB_VERSION >= 70
+#define COMP_SCALED_WIDTH(comp) ((comp)->DCT_h_scaled_size)
+#define COMP_SCALED_HEIGHT(comp) ((comp)->DCT_v_scaled_size)
+#define MIN_SCALED_HEIGHT(cinfo) ((cinfo).min_DCT_v_scaled_size)
+#else
+#define COMP_SCALED_WIDTH(comp) ((comp)->DCT_scaled_size)
+#define COMP_SCALED_HEIGHT(comp) ((comp)->DCT_scaled_size)
+#define MIN_SCALED_HEIGHT(cinfo) ((cinfo).min_DCT_scaled_size)
+#endif
+// Largest iMCU row: 4 (max sampling factor) * 16 (max scaled block size)
+#define MAX_IMCU_ROWS 64
+
+bool CJpegHandler::decodeYUV(const unsigned char* buffer, int size, int targetWidth, int targetHeight,
+                             int &width, int &height, YUVImage& image)
+{
+    if (setjmp(returnpoint)) {
+        printf("Error: %s\n", messagebuffer);
+        return false;
+    }
+    srcmgr.bytes_in_buffer = size;
+    srcmgr.next_input_byte = buffer;
+
+    jpeg_read_header(&cinfo, TRUE);
+    if (cinfo.jpeg_color_space != JCS_YCbCr || cinfo.num_components != 3) {
+        jpeg_abort_decompress(&cinfo);
+        return false;
+    }
+    cinfo.raw_data_out = TRUE;
+    cinfo.out_color_space = JCS_YCbCr;
+    selectScale(targetWidth, targetHeight);
+    jpeg_start_decompress(&cinfo);
+
+    width = cinfo.image_width;
+    height = cinfo.image_height;
+
+    // jpeg_read_raw_data() writes whole iMCU rows of whole blocks, so the
+    // planes are padded up to that
+    int rowsPerIMCU[3];
+    int needed = 0;
+    for (int c = 0; c < 3; c++)
+    {
+        jpeg_component_info* comp = &cinfo.comp_info[c];
+        rowsPerIMCU[c] = comp->v_samp_factor * COMP_SCALED_HEIGHT(comp);
+        image.strides[c] = comp->width_in_blocks * COMP_SCALED_WIDTH(comp);
+        image.widths[c] = comp->downsampled_width;
+        image.heights[c] = comp->downsampled_height;
+        needed += image.strides[c] * rowsPerIMCU[c] * cinfo.total_iMCU_rows;
+    }
+    if (yuvBuffer == NULL || yuvBufferSize < needed) {
+        yuvBufferSize = needed;
+        CFramePool::CountAllocation();
+        free(yuvBuffer);
+        yuvBuffer = (unsigned char*) malloc(yuvBufferSize);
+    }
+    image.planes[0] = yuvBuffer;
+    image.planes[1] = image.planes[0] + image.strides[0] * rowsPerIMCU[0] * cinfo.total_iMCU_rows;
+    image.planes[2] = image.planes[1] + image.strides[1] * rowsPerIMCU[1] * cinfo.total_iMCU_rows;
+
+    JSAMPROW rows[3][MAX_IMCU_ROWS];
+    JSAMPARRAY planes[3] = { rows[0], rows[1], rows[2] };
+    int linesPerIMCU = cinfo.max_v_samp_factor * MIN_SCALED_HEIGHT(cinfo);
+    for (unsigned int iMCURow = 0; cinfo.output_scanline < cinfo.output_height; iMCURow++)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            for (int i = 0; i < rowsPerIMCU[c]; i++)
+            {
+                rows[c][i] = image.planes[c] + (iMCURow * rowsPerIMCU[c] + i) * image.strides[c];
+            }
+        }
+        jpeg_read_raw_data(&cinfo, planes, linesPerIMCU);
+    }
+    jpeg_finish_decompress(&cinfo);
+    return true;
+}
+
 void CJpegHandler::error_exit(j_common_ptr cinfo)
 {
     CJpegHandler* data = (CJpegHandler*) cinfo->client_data;
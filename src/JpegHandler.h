@@ -28,16 +28,27 @@ extern "C" {
 }
 #include <setjmp.h>
 
-class CJpegHandler
+#include "JpegDecoder.h"
+
+// libjpeg backend
+class CJpegHandler : public CJpegDecoder
 {
 public:
     CJpegHandler();
     ~CJpegHandler();
 
+    const char* getName();
+
     bool decodeHeader(const unsigned char* buffer, int size);
 
     unsigned char* decodeRGB24(const unsigned char* buffer, int size, int &width, int &height);
 
+    unsigned char* decodeRGB24(const unsigned char* buffer, int size, int targetWidth, int targetHeight,
+                               int &width, int &height, int &outWidth, int &outHeight);
+
+    bool decodeYUV(const unsigned char* buffer, int size, int targetWidth, int targetHeight,
+                   int &width, int &height, YUVImage& image);
+
 private:
     struct jpeg_decompress_struct cinfo;
     struct jpeg_error_mgr jerr;
@@ -48,6 +59,10 @@ private:
 
     unsigned char* rgbBuffer;
     int rgbBufferSize;
+    unsigned char* yuvBuffer;
+    int yuvBufferSize;
+
+    void selectScale(int targetWidth, int targetHeight);
 
     static void error_exit(j_common_ptr cinfo);
     static void output_message(j_common_ptr cinfo);
@@ -0,0 +1,334 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// PhoneSimulator.cpp
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "PhoneSimulator.h"
+#include "JpegEncoder.h"
+
+// Constructor
+CSimulatedClip::CSimulatedClip():
+    header(NULL),
+    headerSize(0),
+    frames(NULL),
+    frameSizes(NULL),
+    frameCount(0)
+{
+}
+
+// Destructor
+CSimulatedClip::~CSimulatedClip()
+{
+    for(int i = 0; i < frameCount; i++)
+    {
+        free(frames[i]);
+    }
+    delete[] frames;
+    delete[] frameSizes;
+    free(header);
+}
+
+int CSimulatedClip::Encode(int width, int height, int quality, int count)
+{
+    CJpegEncoder encoder(width, height, quality);
+    unsigned char* rgb = new unsigned char[width * height * 3];
+
+    header = encoder.encodeHeader(headerSize);
+    frames = new unsigned char*[count];
+    frameSizes = new int[count];
+    for(frameCount = 0; frameCount < count; frameCount++)
+    {
+        CJpegEncoder::drawTestPattern(rgb, width, height, frameCount);
+        frames[frameCount] = encoder.encodeFrame(rgb, frameSizes[frameCount]);
+        if(frameSizes[frameCount] > 0x00FFFFFF)
+        {
+            // does not fit the 24 bit packet length
+            printf("smartcam-sim: frames too large, lower the quality or the resolution\n");
+            delete[] rgb;
+            return -1;
+        }
+    }
+    delete[] rgb;
+    return 0;
+}
+
+int CSimulatedClip::GetAverageFrameSize()
+{
+    gint64 total = 0;
+    for(int i = 0; i < frameCount; i++)
+    {
+        total += frameSizes[i];
+    }
+    return frameCount > 0 ? (int) (total / frameCount) : 0;
+}
+
+// Constructor
+CPhoneSimulator::CPhoneSimulator(int phoneIndex, const SimulatorOptions* pSimOptions, const CSimulatedClip* pSimClip):
+    index(phoneIndex),
+    pOptions(pSimOptions),
+    pClip(pSimClip),
+    sock(INVALID_SOCKET),
+    randSeed(phoneIndex + 1),
+    thread(NULL),
+    stopRequested(0),
+    running(0),
+    framesSent(0),
+    framesLate(0),
+    bytesSent(0)
+{
+}
+
+// Destructor
+CPhoneSimulator::~CPhoneSimulator()
+{
+    Stop();
+}
+
+int CPhoneSimulator::Start()
+{
+    GError* error = NULL;
+    if(Connect() != 0)
+    {
+        return -1;
+    }
+    g_atomic_int_set(&running, TRUE);
+    thread = g_thread_create(ThreadProc, this, TRUE, &error);
+    if(thread == NULL)
+    {
+        g_printerr("Failed to create phone thread: %s\n", error->message);
+        g_error_free(error);
+        g_atomic_int_set(&running, FALSE);
+        return -1;
+    }
+    return 0;
+}
+
+void CPhoneSimulator::Stop()
+{
+    g_atomic_int_set(&stopRequested, TRUE);
+    if(thread != NULL)
+    {
+        g_thread_join(thread);
+        thread = NULL;
+    }
+    if(sock != INVALID_SOCKET)
+    {
+        close(sock);
+        sock = INVALID_SOCKET;
+    }
+}
+
+bool CPhoneSimulator::IsRunning()
+{
+    return g_atomic_int_get(&running);
+}
+
+int CPhoneSimulator::GetFramesSent()
+{
+    return g_atomic_int_get(&framesSent);
+}
+
+gint64 CPhoneSimulator::GetBytesSent()
+{
+    return bytesSent;
+}
+
+int CPhoneSimulator::GetFramesLate()
+{
+    return g_atomic_int_get(&framesLate);
+}
+
+void CPhoneSimulator::GetSendDelay(LatencySummary& summary)
+{
+    sendDelay.GetSummary(summary);
+}
+
+void CPhoneSimulator::Print(double seconds)
+{
+    LatencySummary delay;
+    sendDelay.GetSummary(delay);
+    printf("smartcam-sim: phone %d: %d frames, %.1f fps, %.2f MB/s, %d late, send delay us p50 %d p99 %d max %d\n",
+           index, GetFramesSent(), seconds > 0 ? GetFramesSent() / seconds : 0.0,
+           seconds > 0 ? bytesSent / seconds / (1024 * 1024) : 0.0, GetFramesLate(),
+           delay.p50, delay.p99, delay.max);
+}
+
+int CPhoneSimulator::Connect()
+{
+    if(pOptions->unixPath != NULL)
+    {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        // a leading '@' names a socket in the abstract namespace
+        strncpy(addr.sun_path, pOptions->unixPath, sizeof(addr.sun_path) - 1);
+        socklen_t addrLen = offsetof(struct sockaddr_un, sun_path) + strlen(addr.sun_path);
+        if(addr.sun_path[0] == '@')
+        {
+            addr.sun_path[0] = '\0';
+        }
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(sock == INVALID_SOCKET || connect(sock, (struct sockaddr*) &addr, addrLen) < 0)
+        {
+            printf("smartcam-sim: phone %d could not connect to %s: %s\n", index, pOptions->unixPath, strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    struct addrinfo hints;
+    struct addrinfo* result = NULL;
+    char port[16];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", pOptions->port);
+    int error = getaddrinfo(pOptions->host, port, &hints, &result);
+    if(error != 0)
+    {
+        printf("smartcam-sim: could not resolve %s: %s\n", pOptions->host, gai_strerror(error));
+        return -1;
+    }
+    for(struct addrinfo* it = result; it != NULL; it = it->ai_next)
+    {
+        sock = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
+        if(sock == INVALID_SOCKET)
+        {
+            continue;
+        }
+        if(connect(sock, it->ai_addr, it->ai_addrlen) == 0)
+        {
+            break;
+        }
+        close(sock);
+        sock = INVALID_SOCKET;
+    }
+    freeaddrinfo(result);
+    if(sock == INVALID_SOCKET)
+    {
+        printf("smartcam-sim: phone %d could not connect to %s:%d: %s\n", index, pOptions->host, pOptions->port,
+               strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int CPhoneSimulator::SendAll(const unsigned char* data, int length)
+{
+    while(length > 0)
+    {
+        ssize_t sent = send(sock, data, length, MSG_NOSIGNAL);
+        if(sent < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        data += sent;
+        length -= sent;
+        bytesSent += sent;
+    }
+    return 0;
+}
+
+// Same framing as the phone client: type, then the 24 bit length, big endian
+int CPhoneSimulator::SendPacket(SmartCamPacketType type, const unsigned char* data, int length)
+{
+    unsigned char header[4];
+    header[0] = (unsigned char) type;
+    header[1] = (unsigned char) (length >> 16);
+    header[2] = (unsigned char) (length >> 8);
+    header[3] = (unsigned char) length;
+    if(SendAll(header, 4) != 0)
+    {
+        return -1;
+    }
+    return SendAll(data, length);
+}
+
+gpointer CPhoneSimulator::ThreadProc(gpointer data)
+{
+    ((CPhoneSimulator*) data)->Run();
+    return NULL;
+}
+
+void CPhoneSimulator::Run()
+{
+    gint64 intervalMicros = G_USEC_PER_SEC / MAX(pOptions->fps, 1);
+    int burst = MAX(pOptions->burstFrames, 1);
+    gint64 startMicros = CSessionStats::NowMicros();
+    gint64 endMicros = startMicros + (gint64) pOptions->durationSeconds * G_USEC_PER_SEC;
+    int frame = 0;
+
+    if(SendPacket(PACKET_JPEG_HEDAER, pClip->header, pClip->headerSize) != 0)
+    {
+        printf("smartcam-sim: phone %d: %s\n", index, strerror(errno));
+        g_atomic_int_set(&running, FALSE);
+        return;
+    }
+    while(!g_atomic_int_get(&stopRequested))
+    {
+        // a burst goes out when its last frame is due
+        gint64 dueMicros = startMicros + (frame + burst - 1) * intervalMicros;
+        if(pOptions->jitterMillis > 0)
+        {
+            dueMicros += (gint64) (rand_r(&randSeed) % (pOptions->jitterMillis + 1)) * 1000;
+        }
+        if(pOptions->durationSeconds > 0 && dueMicros >= endMicros)
+        {
+            break;
+        }
+        gint64 now = CSessionStats::NowMicros();
+        while(now < dueMicros && !g_atomic_int_get(&stopRequested))
+        {
+            g_usleep(MIN(dueMicros - now, G_USEC_PER_SEC / 10));
+            now = CSessionStats::NowMicros();
+        }
+        for(int i = 0; i < burst && !g_atomic_int_get(&stopRequested); i++, frame++)
+        {
+            int clipFrame = frame % pClip->frameCount;
+            if(SendPacket(PACKET_JPEG_DATA, pClip->frames[clipFrame], pClip->frameSizes[clipFrame]) != 0)
+            {
+                printf("smartcam-sim: phone %d disconnected: %s\n", index, strerror(errno));
+                g_atomic_int_set(&running, FALSE);
+                return;
+            }
+            gint64 delay = CSessionStats::NowMicros() - (startMicros + frame * intervalMicros);
+            sendDelay.Add(delay);
+            if(delay > intervalMicros * burst)
+            {
+                g_atomic_int_inc(&framesLate);
+            }
+            g_atomic_int_inc(&framesSent);
+        }
+    }
+    g_atomic_int_set(&running, FALSE);
+}
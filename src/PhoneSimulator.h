@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// PhoneSimulator.h
+
+#ifndef __PHONE_SIMULATOR_H__
+#define __PHONE_SIMULATOR_H__
+
+#include <glib.h>
+
+#include "CommHandler.h"
+#include "SessionStats.h"
+
+typedef struct SimulatorOptions
+{
+    const char* host;
+    int port;
+    const char* unixPath;   // connect to this Unix socket instead of TCP, '@' for abstract
+    int fps;
+    int jitterMillis;       // random extra delay of up to this much per frame
+    int burstFrames;        // frames held back and sent back to back, 1 for none
+    int durationSeconds;    // 0 to run until stopped
+} SimulatorOptions;
+
+// Frames sent by every simulated phone, encoded once before they connect
+// so the simulator spends its time sending, not encoding
+class CSimulatedClip
+{
+public:
+    CSimulatedClip();
+    ~CSimulatedClip();
+    int Encode(int width, int height, int quality, int frameCount);
+    int GetAverageFrameSize();
+
+    unsigned char* header;
+    int headerSize;
+    unsigned char** frames;
+    int* frameSizes;
+    int frameCount;
+};
+
+// One simulated phone: connects, sends the tables, then the clip frames in
+// a loop at the configured rate, on its own thread. The send delay of a
+// frame is the time from when it was due until it was completely written,
+// it grows when the server does not keep up.
+class CPhoneSimulator
+{
+public:
+    CPhoneSimulator(int phoneIndex, const SimulatorOptions* pOptions, const CSimulatedClip* pClip);
+    virtual ~CPhoneSimulator();
+    int Start();
+    void Stop();
+    bool IsRunning();
+    int GetFramesSent();
+    gint64 GetBytesSent();
+    int GetFramesLate();
+    void GetSendDelay(LatencySummary& summary);
+    void Print(double seconds);
+
+private:
+    // Methods:
+    int Connect();
+    int SendAll(const unsigned char* data, int length);
+    int SendPacket(SmartCamPacketType type, const unsigned char* data, int length);
+    void Run();
+    static gpointer ThreadProc(gpointer data);
+    // Data:
+    int index;
+    const SimulatorOptions* pOptions;
+    const CSimulatedClip* pClip;
+    int sock;
+    unsigned int randSeed;
+    GThread* thread;
+    volatile gint stopRequested;
+    volatile gint running;
+    volatile gint framesSent;
+    volatile gint framesLate;
+    gint64 bytesSent;       // written by the phone thread only
+    CLatencyHistogram sendDelay;
+};
+
+#endif//__PHONE_SIMULATOR_H__
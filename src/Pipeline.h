@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Pipeline.h
+
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include <glib.h>
+
+#include "CommHandler.h"
+
+// Number of items each hand-off queue can hold
+#define SMARTCAM_PIPELINE_DEPTH 4
+
+// Stages run on the worker pool; the receive stage runs on the comm thread.
+typedef enum PipelineStage
+{
+    STAGE_DECODE = 0,   // jpeg decode + scale
+    STAGE_OUTPUT = 1,   // device write + preview
+    STAGE_COUNT = 2
+} PipelineStage;
+
+// A packet received from the phone, handed from the receive to the decode stage
+typedef struct SmartCamPacket
+{
+    SmartCamPacketType type;
+    unsigned char* data;
+    unsigned int length;
+    unsigned int maxLength;
+    gint64 headerTime;              // monotonic, microseconds
+    gint64 payloadTime;
+    int frameId;                    // per session, for the trace
+    struct SmartCamPacket* next;    // free list link, used by the pool
+} SmartCamPacket;
+
+// A decoded frame at output size, handed from the decode to the output stage.
+// The output size is the capture size of the consumer, the buffers are allocated for it.
+// Both buffers are always allocated: hasRGB tells whether rgb holds the frame
+// (RGB frames, or previewed YUV frames), hasYUV whether yuv does, in the
+// yuvFormat layout (YUYV, or NV12 and I420 which are smaller).
+// MJPEG captures get the phone jpeg instead (hasJPEG), rgb then only holds the
+// preview, at rgbWidth x rgbHeight.
+typedef struct SmartCamFrame
+{
+    unsigned char* rgb;     // packed RGB24, rgbStride bytes per row
+    int rgbStride;
+    int rgbWidth;
+    int rgbHeight;
+    unsigned char* yuv;     // outWidth * outHeight * 2 bytes
+    guint32 yuvFormat;      // V4L2 fourcc
+    unsigned char* jpeg;    // allocated on first use, grows with the frames
+    unsigned int jpegLength;
+    unsigned int jpegMaxLength;
+    bool hasRGB;
+    bool hasYUV;
+    bool hasJPEG;
+    int outWidth;       // output size
+    int outHeight;
+    int width;          // phone resolution
+    int height;
+    gint64 headerTime;  // monotonic, microseconds, see CSessionStats
+    gint64 payloadTime;
+    gint64 decodeTime;
+    gint64 convertTime;
+    int frameId;
+    struct SmartCamFrame* next;     // free list link, used by the pool
+} SmartCamFrame;
+
+// Bounded single producer / single consumer queue. Push() must only be called
+// from one thread at a time and Pop() from one thread at a time; the indexes
+// are published with glib atomics so no lock is taken.
+template <class T> class CRingQueue
+{
+public:
+    CRingQueue(int capacity):
+        size(capacity + 1),
+        head(0),
+        tail(0)
+    {
+        items = new T[size];
+    }
+
+    ~CRingQueue()
+    {
+        delete[] items;
+    }
+
+    // Fails when the queue has no more than 'reserved' free slots
+    bool Push(T item, int reserved = 0)
+    {
+        gint t = g_atomic_int_get(&tail);
+        gint h = g_atomic_int_get(&head);
+        gint count = (t - h + size) % size;
+        if(size - 1 - count <= reserved)
+        {
+            return false;
+        }
+        items[t] = item;
+        g_atomic_int_set(&tail, (t + 1) % size);
+        return true;
+    }
+
+    bool Pop(T& item)
+    {
+        gint h = g_atomic_int_get(&head);
+        if(h == g_atomic_int_get(&tail))
+        {
+            return false;
+        }
+        item = items[h];
+        g_atomic_int_set(&head, (h + 1) % size);
+        return true;
+    }
+
+    // Consumer only: the item 'index' places behind the one Pop() returns next,
+    // false if fewer items are queued
+    bool Peek(int index, T& item)
+    {
+        gint h = g_atomic_int_get(&head);
+        gint count = (g_atomic_int_get(&tail) - h + size) % size;
+        if(index >= count)
+        {
+            return false;
+        }
+        item = items[(h + index) % size];
+        return true;
+    }
+
+    bool IsEmpty()
+    {
+        return g_atomic_int_get(&head) == g_atomic_int_get(&tail);
+    }
+
+    int GetCount()
+    {
+        return (g_atomic_int_get(&tail) - g_atomic_int_get(&head) + size) % size;
+    }
+
+private:
+    T* items;
+    gint size;
+    volatile gint head;     // next slot to read, written by the consumer
+    volatile gint tail;     // next slot to write, written by the producer
+};
+
+#endif//__PIPELINE_H__
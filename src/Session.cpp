@@ -0,0 +1,809 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Session.cpp
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+
+#include "Session.h"
+#include "SmartEngine.h"
+#include "JpegDecoder.h"
+#include "FramePool.h"
+#include "Tracer.h"
+
+int CSession::nextId = 0;
+
+// Constructor
+CSession::CSession(CSmartEngine* pEngine, int socket, const char* peer):
+    pSmartEngine(pEngine),
+    id(nextId++),
+    refCount(1),
+    isConnected(true),
+    clientSocket(socket),
+    deviceFd(-1),
+    deviceAcceptsYUYV(false),
+    capturePixelFormat(V4L2_PIX_FMT_RGB24),
+    captureWidth(CSmartEngine::SMARTCAM_FRAME_WIDTH),
+    captureHeight(CSmartEngine::SMARTCAM_FRAME_HEIGHT),
+    captureFormatStale(TRUE),
+    yuvPipeline(false),
+    colorMatrix(COLOR_MATRIX_BT601),
+    pJpegHandler(NULL),
+    jpegTables(NULL),
+    jpegTablesLength(0),
+    jpegTablesMaxLength(0),
+    passThroughSizeWarned(false),
+    crtWidth(-1),
+    crtHeight(-1),
+    lastSampleMicros(0),
+    lastSampleFrames(0),
+    lastSampleBytes(0),
+    stats(),
+    rcvHeaderLen(0),
+    rcvdBytesCount(0),
+    pRcvPacket(NULL),
+    nextFrameId(0),
+    pFramePool(NULL),
+    decodeQueue(SMARTCAM_PIPELINE_DEPTH),
+    outputQueue(SMARTCAM_PIPELINE_DEPTH),
+    decodeDropPolicy(DROP_NEWEST),
+    outputDropPolicy(DROP_OLDEST),
+    lowLatency(false),
+    targetFps(0),
+    nextOutputMicros(0)
+{
+    memset(peerName, 0, sizeof(peerName));
+    if(peer != NULL)
+    {
+        strncpy(peerName, peer, sizeof(peerName) - 1);
+    }
+    for(int i = 0; i < STAGE_COUNT; i++)
+    {
+        tasks[i].pSession = this;
+        tasks[i].stage = (PipelineStage) i;
+        stageScheduled[i] = 0;
+    }
+}
+
+// Destructor
+CSession::~CSession()
+{
+    Cleanup();
+}
+
+int CSession::Initialize()
+{
+    CUserSettings settings = pSmartEngine->GetSettings();
+    lowLatency = settings.lowLatency;
+    SetDropPolicy(settings.decodeDropPolicy, settings.outputDropPolicy);
+    SetTargetFps(settings.targetFps);
+    pJpegHandler = CJpegDecoder::create(pSmartEngine->GetJpegBackend());
+    // one packet being received and one being decoded, one frame being
+    // decoded and one being written, plus what the queues hold
+    pFramePool = new CFramePool(SMARTCAM_PIPELINE_DEPTH + 2, SMARTCAM_PIPELINE_DEPTH + 2,
+                                CSmartEngine::SMARTCAM_FRAME_WIDTH, CSmartEngine::SMARTCAM_FRAME_HEIGHT);
+    deviceFd = pSmartEngine->AcquireDevice();
+    if(deviceFd == -1)
+    {
+        printf("smartcam: session %d (%s) has no free smartcam device, preview only\n", id, peerName);
+    }
+    deviceAcceptsYUYV = CSmartEngine::AcceptsYUYVFrames(deviceFd);
+    colorMatrix = settings.colorMatrix;
+    if(CSmartEngine::SetColorMatrix(deviceFd, colorMatrix) == -1 && colorMatrix != COLOR_MATRIX_BT601)
+    {
+        // the consumer would take the frames for BT.601
+        printf("smartcam: session %d (%s): the driver can not report BT.709, using BT.601\n", id, peerName);
+        colorMatrix = COLOR_MATRIX_BT601;
+    }
+    // the jpeg planes are BT.601, other matrices go through RGB
+    yuvPipeline = settings.yuvPipeline && colorMatrix == COLOR_MATRIX_BT601;
+    return 0;
+}
+
+void CSession::Cleanup()
+{
+    SmartCamPacket* pPacket = NULL;
+    SmartCamFrame* pFrame = NULL;
+
+    if(clientSocket != INVALID_SOCKET)
+    {
+        close(clientSocket);
+        clientSocket = INVALID_SOCKET;
+    }
+    if(deviceFd != -1)
+    {
+        pSmartEngine->ReleaseDevice(deviceFd);
+        deviceFd = -1;
+    }
+    if(pJpegHandler != NULL)
+    {
+        delete pJpegHandler;
+        pJpegHandler = NULL;
+    }
+    if(jpegTables != NULL)
+    {
+        delete[] jpegTables;
+        jpegTables = NULL;
+        jpegTablesLength = 0;
+        jpegTablesMaxLength = 0;
+    }
+    // drop what is still in flight
+    if(pRcvPacket != NULL)
+    {
+        FreePacket(pRcvPacket);
+        pRcvPacket = NULL;
+    }
+    while(decodeQueue.Pop(pPacket))
+    {
+        FreePacket(pPacket);
+    }
+    while(outputQueue.Pop(pFrame))
+    {
+        FreeFrame(pFrame);
+    }
+    if(pFramePool != NULL)
+    {
+        delete pFramePool;
+        pFramePool = NULL;
+        printf("smartcam: session %d (%s) closed, frame path allocations so far: %d\n",
+               id, peerName, CFramePool::GetAllocationCount());
+        stats.Print(id);
+        pSmartEngine->AddClosedSessionStats(&stats);
+    }
+}
+
+// Every worker task holds a reference, the session is deleted by the last one
+void CSession::Ref()
+{
+    g_atomic_int_inc(&refCount);
+}
+
+void CSession::Unref()
+{
+    if(g_atomic_int_dec_and_test(&refCount))
+    {
+        delete this;
+    }
+}
+
+int CSession::Disconnect()
+{
+    isConnected = false;
+    // the comm thread sees the socket hang up, the socket is closed in Cleanup()
+    if(clientSocket != INVALID_SOCKET)
+    {
+        shutdown(clientSocket, SHUT_RDWR);
+    }
+    return 0;
+}
+
+// Reads what is available without blocking: returns the number of bytes read,
+// 0 if the socket has no more data for now, -1 if the connection is gone.
+int CSession::RcvBytes(unsigned char* buffer, unsigned int length)
+{
+    int retCode = 0;
+    while(1)
+    {
+        retCode = recv(clientSocket, (char*) buffer, length, 0);
+        if(retCode > 0)
+        {
+            return retCode;
+        }
+        if(retCode == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if(retCode == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return 0;
+        }
+        // Connection closed or socket error
+        return -1;
+    }
+}
+
+void CSession::ParseHeader()
+{
+    unsigned int length = ((unsigned int)rcvHeader[1] << 16) | ((unsigned int)rcvHeader[2] << 8) | ((unsigned int)rcvHeader[3]);
+    if(pRcvPacket == NULL)
+    {
+        pRcvPacket = pFramePool->AcquirePacket(length);
+    }
+    else
+    {
+        // reused after a skipped frame
+        CFramePool::ReservePacket(pRcvPacket, length);
+    }
+    pRcvPacket->type = (SmartCamPacketType) (rcvHeader[0]);
+    pRcvPacket->length = length;
+    pRcvPacket->headerTime = CSessionStats::NowMicros();
+    pRcvPacket->frameId = nextFrameId++;
+}
+
+// True when the next packet waiting in the socket is a complete jpeg frame
+bool CSession::IsNewerFrameBuffered()
+{
+    int queuedBytes = 0;
+    unsigned char nextHeader[4] = {0};
+    if(ioctl(clientSocket, FIONREAD, &queuedBytes) < 0 || queuedBytes < 4)
+    {
+        return false;
+    }
+    if(recv(clientSocket, (char*) nextHeader, 4, MSG_PEEK) != 4 || nextHeader[0] != PACKET_JPEG_DATA)
+    {
+        return false;
+    }
+    unsigned int length = ((unsigned int)nextHeader[1] << 16) | ((unsigned int)nextHeader[2] << 8) | ((unsigned int)nextHeader[3]);
+    return (unsigned int) queuedBytes >= 4 + length;
+}
+
+// Decode stage: a header packet queued behind the frame does not replace it
+bool CSession::IsNewerFrameQueued()
+{
+    SmartCamPacket* pNext = NULL;
+    for(int i = 0; decodeQueue.Peek(i, pNext); i++)
+    {
+        if(pNext->type == PACKET_JPEG_DATA)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+RcvResultCode CSession::RcvPacket()
+{
+    int retCode = 0;
+    CTraceScope trace("RcvPacket", id);
+
+    if(!isConnected)
+    {
+        return RCV_ERROR;
+    }
+
+NEXT_PACKET:
+    while(rcvHeaderLen < 4)
+    {
+        retCode = RcvBytes(rcvHeader + rcvHeaderLen, 4 - rcvHeaderLen);
+        if(retCode <= 0)
+        {
+            break;
+        }
+        rcvHeaderLen += retCode;
+        if(rcvHeaderLen == 4)
+        {
+            ParseHeader();
+        }
+    }
+
+    while(rcvHeaderLen == 4 && rcvdBytesCount < pRcvPacket->length)
+    {
+        retCode = RcvBytes(pRcvPacket->data + rcvdBytesCount, pRcvPacket->length - rcvdBytesCount);
+        if(retCode <= 0)
+        {
+            break;
+        }
+        rcvdBytesCount += retCode;
+    }
+
+    if(retCode < 0)
+    {
+        isConnected = false;
+        return RCV_ERROR;
+    }
+    if(rcvHeaderLen < 4 || rcvdBytesCount < pRcvPacket->length)
+    {
+        return RCV_PARTIAL;
+    }
+    pRcvPacket->payloadTime = CSessionStats::NowMicros();
+    trace.SetFrame(id, pRcvPacket->frameId);
+    pSmartEngine->GetCommHandler()->RecordPacket(id, rcvHeader, pRcvPacket->data, pRcvPacket->length,
+                                                 pRcvPacket->payloadTime);
+    stats.CountReceived(4 + pRcvPacket->length, pRcvPacket->type == PACKET_JPEG_DATA);
+    // latest frame wins: skip this frame without decoding it if a newer one
+    // has already arrived, its buffer is reused for the newer one
+    if(lowLatency && pRcvPacket->type == PACKET_JPEG_DATA && IsNewerFrameBuffered())
+    {
+        stats.CountDropped();
+        rcvHeaderLen = 0;
+        rcvdBytesCount = 0;
+        goto NEXT_PACKET;
+    }
+    return RCV_COMPLETE;
+}
+
+// Hands the complete packet to the decode stage and starts a new one
+void CSession::QueuePacket()
+{
+    SmartCamPacket* pPacket = pRcvPacket;
+    pRcvPacket = NULL;
+    rcvHeaderLen = 0;
+    rcvdBytesCount = 0;
+
+    // the last free slot is kept for header packets, they are never dropped
+    if(!decodeQueue.Push(pPacket, (pPacket->type == PACKET_JPEG_DATA) ? 1 : 0))
+    {
+        stats.CountDropped();
+        FreePacket(pPacket);
+        return;
+    }
+    ScheduleStage(STAGE_DECODE);
+}
+
+void CSession::ScheduleStage(PipelineStage stage)
+{
+    if(g_atomic_int_compare_and_exchange(&stageScheduled[stage], 0, 1))
+    {
+        Ref();
+        pSmartEngine->ScheduleTask(&tasks[stage]);
+    }
+}
+
+void CSession::RunStage(PipelineStage stage)
+{
+    while(1)
+    {
+        if(stage == STAGE_DECODE)
+        {
+            DecodeStage();
+        }
+        else
+        {
+            OutputStage();
+        }
+        g_atomic_int_set(&stageScheduled[stage], 0);
+        // an item may have been queued after the queue was seen empty
+        bool isEmpty = (stage == STAGE_DECODE) ? decodeQueue.IsEmpty() : outputQueue.IsEmpty();
+        if(isEmpty || !g_atomic_int_compare_and_exchange(&stageScheduled[stage], 0, 1))
+        {
+            break;
+        }
+    }
+}
+
+void CSession::DecodeStage()
+{
+    SmartCamPacket* pPacket = NULL;
+    while(decodeQueue.Pop(pPacket))
+    {
+        if(!pSmartEngine->IsAlive())
+        {
+            // shutting down, just drain the queue
+        }
+        else if(pPacket->type == PACKET_JPEG_HEDAER)
+        {
+            CTraceScope trace("decodeHeader", id, pPacket->frameId);
+            pJpegHandler->decodeHeader(pPacket->data, pPacket->length);
+            // the consumer may switch to MJPEG at any time, keep a copy; the
+            // buffer only grows, counted with the pool buffers
+            if(jpegTablesMaxLength < (int) pPacket->length)
+            {
+                CFramePool::CountAllocation();
+                delete[] jpegTables;
+                jpegTablesMaxLength = pPacket->length;
+                jpegTables = new unsigned char[jpegTablesMaxLength];
+            }
+            memcpy(jpegTables, pPacket->data, pPacket->length);
+            jpegTablesLength = pPacket->length;
+        }
+        else if(pPacket->type == PACKET_JPEG_DATA)
+        {
+            if(decodeDropPolicy == DROP_OLDEST && IsNewerFrameQueued())
+            {
+                // a newer frame is already queued
+                stats.CountDropped();
+            }
+            else
+            {
+                SmartCamFrame* pFrame = NULL;
+                // frames are produced at the size and in the format the consumer captures
+                if(g_atomic_int_get(&captureFormatStale))
+                {
+                    RefreshCaptureFormat();
+                }
+                guint32 pixelFormat = capturePixelFormat;
+                int outWidth = captureWidth;
+                int outHeight = captureHeight;
+                // convert here rather than in the driver when the consumer wants YUYV;
+                // the planar formats (driver 0.5.0) are never converted by the driver
+                guint32 yuvFormat = 0;
+                if((deviceAcceptsYUYV && pixelFormat == V4L2_PIX_FMT_YUYV) ||
+                   pixelFormat == V4L2_PIX_FMT_NV12 || pixelFormat == V4L2_PIX_FMT_YUV420)
+                {
+                    yuvFormat = pixelFormat;
+                }
+                if(pixelFormat == V4L2_PIX_FMT_MJPEG)
+                {
+                    // the consumer decodes, the phone jpeg goes through as it is
+                    pFrame = PassThroughFrame(pPacket, outWidth, outHeight);
+                }
+                else if(yuvFormat != 0 && yuvPipeline)
+                {
+                    // skip the RGB round trip
+                    pFrame = DecodeFrameYUV(pPacket, yuvFormat, outWidth, outHeight);
+                }
+                if(pFrame == NULL && pixelFormat != V4L2_PIX_FMT_MJPEG)
+                {
+                    pFrame = DecodeFrame(pPacket, yuvFormat, outWidth, outHeight);
+                }
+                if(pFrame != NULL)
+                {
+                    if(outputQueue.Push(pFrame))
+                    {
+                        ScheduleStage(STAGE_OUTPUT);
+                    }
+                    else
+                    {
+                        stats.CountDropped();
+                        FreeFrame(pFrame);
+                    }
+                }
+            }
+        }
+        FreePacket(pPacket);
+    }
+}
+
+// Decode stage: reads the capture format with VIDIOC_G_FMT, and sizes the pool frames for it
+void CSession::RefreshCaptureFormat()
+{
+    // a request made while reading the format is not lost
+    g_atomic_int_set(&captureFormatStale, FALSE);
+    capturePixelFormat = V4L2_PIX_FMT_RGB24;
+    captureWidth = CSmartEngine::SMARTCAM_FRAME_WIDTH;
+    captureHeight = CSmartEngine::SMARTCAM_FRAME_HEIGHT;
+    CSmartEngine::GetCaptureFormat(deviceFd, capturePixelFormat, captureWidth, captureHeight);
+    pFramePool->SetFrameSize(captureWidth, captureHeight);
+}
+
+SmartCamFrame* CSession::DecodeFrame(SmartCamPacket* pPacket, guint32 yuvFormat, int outWidth, int outHeight)
+{
+    int w = 0, h = 0;
+    int decodedW = 0, decodedH = 0;
+    unsigned char* rgb24 = NULL;
+    {
+        CTraceScope trace("decodeRGB24", id, pPacket->frameId);
+        // let the decoder do most of the downscaling in the DCT domain
+        rgb24 = pJpegHandler->decodeRGB24(pPacket->data, pPacket->length, outWidth, outHeight,
+                                w, h, decodedW, decodedH);
+    }
+    if(rgb24 == NULL)
+    {
+        return NULL; // error, maybe just disconnected...
+    }
+    gint64 decodeTime = CSessionStats::NowMicros();
+
+    // the decoder reuses its buffer for the next frame, so the frame gets a copy
+    CTraceScope trace("scale", id, pPacket->frameId);
+    SmartCamFrame* pFrame = pFramePool->AcquireFrame();
+    unsigned char* pixels = pFrame->rgb;
+    int rowstride = pFrame->rgbStride;
+    if(decodedW != outWidth || decodedH != outHeight)
+    {
+        CColorConvert::scaleRGB24(rgb24, decodedW * 3, decodedW, decodedH, pixels, rowstride,
+                                  outWidth, outHeight);
+    }
+    else
+    {
+        for(int y = 0; y < decodedH; y++)
+        {
+            memcpy(pixels + y * rowstride, rgb24 + y * decodedW * 3, decodedW * 3);
+        }
+    }
+    pFrame->hasRGB = true;
+    pFrame->width = w;
+    pFrame->height = h;
+    if(yuvFormat != 0)
+    {
+        CColorConvert::rgb24ToYUV(pixels, rowstride, yuvFormat, pFrame->yuv, outWidth, outHeight, colorMatrix);
+        pFrame->yuvFormat = yuvFormat;
+        pFrame->hasYUV = true;
+    }
+    pFrame->headerTime = pPacket->headerTime;
+    pFrame->payloadTime = pPacket->payloadTime;
+    pFrame->frameId = pPacket->frameId;
+    pFrame->decodeTime = decodeTime;
+    pFrame->convertTime = CSessionStats::NowMicros();
+    return pFrame;
+}
+
+// Decode to planar YCbCr, scale the planes and pack them as YUYV, NV12 or I420:
+// the jpeg planes go to the device without any color conversion. Returns NULL
+// if the jpeg is not YCbCr, the caller then goes through RGB.
+SmartCamFrame* CSession::DecodeFrameYUV(SmartCamPacket* pPacket, guint32 yuvFormat, int outWidth, int outHeight)
+{
+    int w = 0, h = 0;
+    YUVImage image;
+    bool decoded = false;
+    {
+        CTraceScope trace("decodeYUV", id, pPacket->frameId);
+        decoded = pJpegHandler->decodeYUV(pPacket->data, pPacket->length, outWidth, outHeight,
+                                w, h, image);
+    }
+    if(!decoded)
+    {
+        return NULL;
+    }
+    gint64 decodeTime = CSessionStats::NowMicros();
+    CTraceScope trace("scale", id, pPacket->frameId);
+    SmartCamFrame* pFrame = pFramePool->AcquireFrame();
+    pFrame->width = w;
+    pFrame->height = h;
+    colorConvert.packYUV(image, yuvFormat, pFrame->yuv, outWidth, outHeight);
+    pFrame->yuvFormat = yuvFormat;
+    pFrame->hasYUV = true;
+
+    // RGB is only needed for the preview
+    if(pSmartEngine->IsPreviewDue(this))
+    {
+        CColorConvert::yuvToRGB24(pFrame->yuv, yuvFormat, pFrame->rgb, outWidth, outHeight);
+        pFrame->hasRGB = true;
+    }
+    pFrame->headerTime = pPacket->headerTime;
+    pFrame->payloadTime = pPacket->payloadTime;
+    pFrame->frameId = pPacket->frameId;
+    pFrame->decodeTime = decodeTime;
+    pFrame->convertTime = CSessionStats::NowMicros();
+    return pFrame;
+}
+
+// MJPEG capture: no decode, no scaling, the frame gets the phone jpeg with the
+// tables of the header packet merged in. The jpeg keeps the phone resolution
+// whatever size the consumer asked for. Only the preview decodes, at its own size.
+SmartCamFrame* CSession::PassThroughFrame(SmartCamPacket* pPacket, int outWidth, int outHeight)
+{
+    int w = 0, h = 0;
+    CTraceScope trace("passThrough", id, pPacket->frameId);
+    SmartCamFrame* pFrame = pFramePool->AcquireFrame();
+    CFramePool::ReserveJpeg(pFrame, pPacket->length + jpegTablesLength);
+    int length = CJpegDecoder::mergeTables(jpegTables, jpegTablesLength, pPacket->data, pPacket->length,
+                                           pFrame->jpeg, pFrame->jpegMaxLength, w, h);
+    if(length < 0)
+    {
+        printf("smartcam: session %d got a frame that is not a jpeg\n", id);
+        FreeFrame(pFrame);
+        return NULL;
+    }
+    pFrame->jpegLength = length;
+    pFrame->hasJPEG = true;
+    pFrame->width = w;
+    pFrame->height = h;
+    if((w != outWidth || h != outHeight) && !passThroughSizeWarned)
+    {
+        printf("smartcam: session %d passes %dx%d jpegs to a %dx%d MJPEG capture unscaled\n",
+               id, w, h, outWidth, outHeight);
+        passThroughSizeWarned = true;
+    }
+    gint64 decodeTime = CSessionStats::NowMicros();
+
+    if(pSmartEngine->IsPreviewDue(this))
+    {
+        int decodedW = 0, decodedH = 0;
+        int previewW = MIN(outWidth, CSmartEngine::SMARTCAM_FRAME_WIDTH);
+        int previewH = MIN(outHeight, CSmartEngine::SMARTCAM_FRAME_HEIGHT);
+        unsigned char* rgb24 = pJpegHandler->decodeRGB24(pPacket->data, pPacket->length, previewW, previewH,
+                                                          w, h, decodedW, decodedH);
+        if(rgb24 != NULL)
+        {
+            CColorConvert::scaleRGB24(rgb24, decodedW * 3, decodedW, decodedH, pFrame->rgb, pFrame->rgbStride,
+                                      previewW, previewH);
+            pFrame->rgbWidth = previewW;
+            pFrame->rgbHeight = previewH;
+            pFrame->hasRGB = true;
+        }
+    }
+    pFrame->headerTime = pPacket->headerTime;
+    pFrame->payloadTime = pPacket->payloadTime;
+    pFrame->frameId = pPacket->frameId;
+    pFrame->decodeTime = decodeTime;
+    pFrame->convertTime = CSessionStats::NowMicros();
+    return pFrame;
+}
+
+void CSession::OutputStage()
+{
+    SmartCamFrame* pFrame = NULL;
+    while(outputQueue.Pop(pFrame))
+    {
+        if(!pSmartEngine->IsAlive())
+        {
+            // shutting down, just drain the queue
+        }
+        else if(outputDropPolicy == DROP_OLDEST && !outputQueue.IsEmpty())
+        {
+            // a newer frame is already queued
+            stats.CountDropped();
+        }
+        else if(!IsOutputDue())
+        {
+            // above the target output rate
+            stats.CountDropped();
+        }
+        else
+        {
+            // write the frame in the driver
+            {
+                CTraceScope trace("WriteDeviceFrame", id, pFrame->frameId);
+                int result = 0;
+                if(pFrame->hasJPEG)
+                {
+                    result = CSmartEngine::WriteDeviceFrame(deviceFd, (const char*) pFrame->jpeg, pFrame->jpegLength);
+                }
+                else if(pFrame->hasYUV)
+                {
+                    result = CSmartEngine::WriteDeviceFrame(deviceFd, (const char*) pFrame->yuv,
+                                                            CColorConvert::yuvFrameSize(pFrame->yuvFormat,
+                                                                                        pFrame->outWidth, pFrame->outHeight));
+                }
+                else
+                {
+                    result = CSmartEngine::WriteDeviceFrame(deviceFd, (const char*) pFrame->rgb,
+                                                            pFrame->outWidth * pFrame->outHeight * 3);
+                }
+                if(result == -1 && errno == EINVAL)
+                {
+                    // the consumer changed the format
+                    g_atomic_int_set(&captureFormatStale, TRUE);
+                }
+            }
+            gint64 writeTime = CSessionStats::NowMicros();
+            stats.CountWritten();
+            stats.AddLatency(LATENCY_RECEIVE, pFrame->payloadTime - pFrame->headerTime);
+            stats.AddLatency(LATENCY_DECODE, pFrame->decodeTime - pFrame->payloadTime);
+            stats.AddLatency(LATENCY_CONVERT, pFrame->convertTime - pFrame->decodeTime);
+            stats.AddLatency(LATENCY_OUTPUT, writeTime - pFrame->convertTime);
+            stats.AddLatency(LATENCY_TOTAL, writeTime - pFrame->headerTime);
+            // draw the frame
+            if(pFrame->hasRGB)
+            {
+                CTraceScope trace("DrawFrame", id, pFrame->frameId);
+                pSmartEngine->DrawFrame(this, pFrame->rgb, pFrame->rgbStride, pFrame->rgbWidth, pFrame->rgbHeight);
+            }
+            SampleFPS(writeTime);
+
+            // Update resolution status bar message
+            if(crtWidth != pFrame->width || crtHeight != pFrame->height)
+            {
+                crtWidth = pFrame->width;
+                crtHeight = pFrame->height;
+                pSmartEngine->UpdateResolution(this, crtWidth, crtHeight);
+            }
+        }
+        FreeFrame(pFrame);
+    }
+}
+
+void CSession::FreePacket(SmartCamPacket* pPacket)
+{
+    pFramePool->ReleasePacket(pPacket);
+}
+
+void CSession::FreeFrame(SmartCamFrame* pFrame)
+{
+    pFramePool->ReleaseFrame(pFrame);
+}
+
+// Frames written per second, refreshed about once a second
+void CSession::SampleFPS(gint64 nowMicros)
+{
+    int frames = stats.GetFramesWritten();
+    gint64 bytes = stats.GetBytesReceived();
+    if(lastSampleMicros == 0)
+    {
+        lastSampleMicros = nowMicros;
+        lastSampleFrames = frames;
+        lastSampleBytes = bytes;
+        return;
+    }
+    gint64 elapsedMicros = nowMicros - lastSampleMicros;
+    if(elapsedMicros >= 1000000)
+    {
+        float fps = ((float)(frames - lastSampleFrames) * 1000000)/elapsedMicros;
+        float bytesPerSecond = ((float)(bytes - lastSampleBytes) * 1000000)/elapsedMicros;
+        stats.SetRates(fps, bytesPerSecond);
+        pSmartEngine->UpdateFps(this, fps, GetDroppedFrames());
+        // catch format changes that did not make a write fail
+        g_atomic_int_set(&captureFormatStale, TRUE);
+        lastSampleMicros = nowMicros;
+        lastSampleFrames = frames;
+        lastSampleBytes = bytes;
+    }
+}
+
+bool CSession::IsConnected()
+{
+    return isConnected;
+}
+
+int CSession::GetId()
+{
+    return id;
+}
+
+int CSession::GetSocket()
+{
+    return clientSocket;
+}
+
+const char* CSession::GetPeerName()
+{
+    return peerName;
+}
+
+int CSession::GetDroppedFrames()
+{
+    return stats.GetFramesDropped();
+}
+
+CSessionStats* CSession::GetStats()
+{
+    return &stats;
+}
+
+// Last resolution seen by the output stage, -1 before the first frame
+void CSession::GetResolution(int& width, int& height)
+{
+    width = crtWidth;
+    height = crtHeight;
+}
+
+// The stages pick the new policy up with their next frame
+void CSession::SetDropPolicy(FrameDropPolicy decodePolicy, FrameDropPolicy outputPolicy)
+{
+    if(lowLatency)
+    {
+        // queued frames are stale as soon as a newer one is behind them
+        decodePolicy = DROP_OLDEST;
+        outputPolicy = DROP_OLDEST;
+    }
+    decodeDropPolicy = decodePolicy;
+    outputDropPolicy = outputPolicy;
+}
+
+void CSession::SetTargetFps(int fps)
+{
+    g_atomic_int_set(&targetFps, MAX(fps, 0));
+}
+
+// Output stage: true if writing a frame now stays within targetFps
+bool CSession::IsOutputDue()
+{
+    int fps = g_atomic_int_get(&targetFps);
+    if(fps <= 0)
+    {
+        return true;
+    }
+    gint64 nowMicros = CSessionStats::NowMicros();
+    gint64 intervalMicros = 1000000 / fps;
+    if(nowMicros < nextOutputMicros)
+    {
+        return false;
+    }
+    // keep the cadence, but do not catch up in a burst after a stall
+    if(nowMicros - nextOutputMicros < intervalMicros)
+        nextOutputMicros += intervalMicros;
+    else
+        nextOutputMicros = nowMicros + intervalMicros;
+    return true;
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Session.h
+
+#ifndef __SESSION_H__
+#define __SESSION_H__
+
+#include "CommHandler.h"
+#include "Pipeline.h"
+#include "UserSettings.h"
+#include "ColorConvert.h"
+#include "SessionStats.h"
+
+class CSmartEngine;
+class CJpegDecoder;
+class CFramePool;
+class CSession;
+
+typedef enum RcvResultCode
+{
+    RCV_PARTIAL = 0,    // no more data for now, wait for the socket
+    RCV_COMPLETE = 1,   // a whole packet is in the receive buffer
+    RCV_ERROR = 2       // connection closed or socket error
+} RcvResultCode;
+
+// Work item pushed to the worker pool: run one pipeline stage of a session
+typedef struct SessionTask
+{
+    CSession* pSession;
+    PipelineStage stage;
+} SessionTask;
+
+// One connected phone: owns the client socket, the receive buffer,
+// the jpeg decoder, the fps counters and the output device.
+// Packets go through receive (comm thread) -> decode -> output stages,
+// connected by single producer / single consumer queues. Each stage runs
+// on at most one worker at a time, so the stages of one session overlap
+// with each other and with the other sessions.
+class CSession
+{
+public:
+    CSession(CSmartEngine* pEngine, int socket, const char* peerName);
+    virtual ~CSession();
+    int Initialize();
+    void Cleanup();
+    void Ref();
+    void Unref();
+    // Receive stage, comm thread only:
+    RcvResultCode RcvPacket();
+    void QueuePacket();
+    // Decode and output stages, worker pool only:
+    void RunStage(PipelineStage stage);
+    int Disconnect();
+    bool IsConnected();
+    int GetId();
+    int GetSocket();
+    const char* GetPeerName();
+    int GetDroppedFrames();
+    CSessionStats* GetStats();
+    void GetResolution(int& width, int& height);
+    // Runtime tuning, may be called from any thread:
+    void SetDropPolicy(FrameDropPolicy decodePolicy, FrameDropPolicy outputPolicy);
+    void SetTargetFps(int fps);
+
+private:
+    // Methods:
+    int RcvBytes(unsigned char* buffer, unsigned int length);
+    void ParseHeader();
+    bool IsNewerFrameBuffered();
+    bool IsNewerFrameQueued();
+    void ScheduleStage(PipelineStage stage);
+    void DecodeStage();
+    void OutputStage();
+    SmartCamFrame* DecodeFrame(SmartCamPacket* pPacket, guint32 yuvFormat, int outWidth, int outHeight);
+    SmartCamFrame* DecodeFrameYUV(SmartCamPacket* pPacket, guint32 yuvFormat, int outWidth, int outHeight);
+    SmartCamFrame* PassThroughFrame(SmartCamPacket* pPacket, int outWidth, int outHeight);
+    bool IsOutputDue();
+    void RefreshCaptureFormat();
+    void SampleFPS(gint64 nowMicros);
+    void FreePacket(SmartCamPacket* pPacket);
+    void FreeFrame(SmartCamFrame* pFrame);
+    // Data:
+    CSmartEngine* pSmartEngine;
+    int id;
+    volatile gint refCount;
+    bool isConnected;
+    int clientSocket;
+    char peerName[64];
+    int deviceFd;
+    // the driver takes YUYV frames without converting them
+    bool deviceAcceptsYUYV;
+    // format the consumer captures, read by the decode stage only; refreshed
+    // there after the output stage sets captureFormatStale (once per fps
+    // sample, or when the driver refuses a frame after the consumer's S_FMT)
+    guint32 capturePixelFormat;
+    int captureWidth;
+    int captureHeight;
+    volatile gint captureFormatStale;
+    bool yuvPipeline;
+    ColorMatrix colorMatrix;
+    CJpegDecoder* pJpegHandler;
+    // last header packet, merged into the frames passed through to MJPEG captures
+    unsigned char* jpegTables;
+    int jpegTablesLength;
+    int jpegTablesMaxLength;
+    bool passThroughSizeWarned;
+    CColorConvert colorConvert;
+    int crtWidth;
+    int crtHeight;
+    gint64 lastSampleMicros;
+    int lastSampleFrames;
+    gint64 lastSampleBytes;
+    CSessionStats stats;
+
+    // Receive state, filled incrementally as data arrives:
+    unsigned char rcvHeader[4];
+    unsigned int rcvHeaderLen;
+    unsigned int rcvdBytesCount;
+    SmartCamPacket* pRcvPacket;
+    int nextFrameId;
+
+    // Pipeline:
+    CFramePool* pFramePool;
+    CRingQueue<SmartCamPacket*> decodeQueue;
+    CRingQueue<SmartCamFrame*> outputQueue;
+    FrameDropPolicy decodeDropPolicy;
+    FrameDropPolicy outputDropPolicy;
+    bool lowLatency;
+    // output rate cap, 0 for none; nextOutputMicros is output stage only
+    volatile gint targetFps;
+    gint64 nextOutputMicros;
+    SessionTask tasks[STAGE_COUNT];
+    volatile gint stageScheduled[STAGE_COUNT];
+
+    static int nextId;
+};
+
+#endif//__SESSION_H__
@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// SessionStats.cpp
+
+#include <stdio.h>
+#include <time.h>
+
+#include "SessionStats.h"
+
+const char* CSessionStats::STAGE_NAMES[LATENCY_STAGE_COUNT] =
+{
+    "receive", "decode", "convert", "output", "total"
+};
+
+CLatencyHistogram::CLatencyHistogram():
+    maxMicros(0)
+{
+    for(int i = 0; i < BUCKET_COUNT; i++)
+    {
+        counts[i] = 0;
+    }
+}
+
+int CLatencyHistogram::BucketOf(gint64 micros)
+{
+    if(micros < 16)
+    {
+        return (micros < 0) ? 0 : (int) micros;
+    }
+    int exponent = 63 - __builtin_clzll((unsigned long long) micros);
+    int bucket = 16 + (exponent - 4) * 4 + (int) ((micros >> (exponent - 2)) & 3);
+    return MIN(bucket, BUCKET_COUNT - 1);
+}
+
+gint64 CLatencyHistogram::BucketUpperBound(int bucket)
+{
+    if(bucket < 16)
+    {
+        return bucket;
+    }
+    int exponent = (bucket - 16) / 4 + 4;
+    int sub = (bucket - 16) % 4;
+    return ((gint64) (5 + sub) << (exponent - 2)) - 1;
+}
+
+void CLatencyHistogram::Add(gint64 micros)
+{
+    g_atomic_int_inc(&counts[BucketOf(micros)]);
+    gint value = (gint) MIN(micros, (gint64) G_MAXINT);
+    gint crtMax = g_atomic_int_get(&maxMicros);
+    while(value > crtMax && !g_atomic_int_compare_and_exchange(&maxMicros, crtMax, value))
+    {
+        crtMax = g_atomic_int_get(&maxMicros);
+    }
+}
+
+void CLatencyHistogram::Merge(CLatencyHistogram& other)
+{
+    for(int i = 0; i < BUCKET_COUNT; i++)
+    {
+        g_atomic_int_add(&counts[i], g_atomic_int_get(&other.counts[i]));
+    }
+    gint otherMax = g_atomic_int_get(&other.maxMicros);
+    gint crtMax = g_atomic_int_get(&maxMicros);
+    while(otherMax > crtMax && !g_atomic_int_compare_and_exchange(&maxMicros, crtMax, otherMax))
+    {
+        crtMax = g_atomic_int_get(&maxMicros);
+    }
+}
+
+int CLatencyHistogram::Percentile(const int* snapshot, int total, int percent, int maxValue)
+{
+    // smallest bucket holding at least percent% of the samples
+    gint64 rank = ((gint64) total * percent + 99) / 100;
+    gint64 seen = 0;
+    for(int i = 0; i < BUCKET_COUNT; i++)
+    {
+        seen += snapshot[i];
+        if(seen >= rank)
+        {
+            return (int) MIN(BucketUpperBound(i), (gint64) maxValue);
+        }
+    }
+    return maxValue;
+}
+
+// Samples added meanwhile may or may not be included
+void CLatencyHistogram::GetSummary(LatencySummary& summary)
+{
+    int snapshot[BUCKET_COUNT];
+    int total = 0;
+    for(int i = 0; i < BUCKET_COUNT; i++)
+    {
+        snapshot[i] = g_atomic_int_get(&counts[i]);
+        total += snapshot[i];
+    }
+    summary.count = total;
+    summary.max = g_atomic_int_get(&maxMicros);
+    if(total == 0)
+    {
+        summary.p50 = summary.p95 = summary.p99 = 0;
+        return;
+    }
+    summary.p50 = Percentile(snapshot, total, 50, summary.max);
+    summary.p95 = Percentile(snapshot, total, 95, summary.max);
+    summary.p99 = Percentile(snapshot, total, 99, summary.max);
+}
+
+CSessionStats::CSessionStats():
+    bytesReceived(0),
+    framesReceived(0),
+    framesDropped(0),
+    framesWritten(0),
+    fpsCentis(0),
+    bytesPerSecond(0)
+{
+}
+
+gint64 CSessionStats::NowMicros()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (gint64) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void CSessionStats::AddLatency(LatencyStage stage, gint64 micros)
+{
+    latency[stage].Add(micros);
+}
+
+void CSessionStats::GetLatency(LatencyStage stage, LatencySummary& summary)
+{
+    latency[stage].GetSummary(summary);
+}
+
+void CSessionStats::CountReceived(unsigned int bytes, bool isFrame)
+{
+    bytesReceived += bytes;
+    if(isFrame)
+    {
+        g_atomic_int_inc(&framesReceived);
+    }
+}
+
+void CSessionStats::CountDropped()
+{
+    g_atomic_int_inc(&framesDropped);
+}
+
+void CSessionStats::CountWritten()
+{
+    g_atomic_int_inc(&framesWritten);
+}
+
+gint64 CSessionStats::GetBytesReceived()
+{
+    return bytesReceived;
+}
+
+int CSessionStats::GetFramesReceived()
+{
+    return g_atomic_int_get(&framesReceived);
+}
+
+int CSessionStats::GetFramesDropped()
+{
+    return g_atomic_int_get(&framesDropped);
+}
+
+int CSessionStats::GetFramesWritten()
+{
+    return g_atomic_int_get(&framesWritten);
+}
+
+void CSessionStats::SetRates(float fps, float bytesRate)
+{
+    g_atomic_int_set(&fpsCentis, (gint) (fps * 100));
+    g_atomic_int_set(&bytesPerSecond, (gint) bytesRate);
+}
+
+float CSessionStats::GetFps()
+{
+    return g_atomic_int_get(&fpsCentis) / 100.0f;
+}
+
+float CSessionStats::GetBytesPerSecond()
+{
+    return (float) g_atomic_int_get(&bytesPerSecond);
+}
+
+void CSessionStats::Merge(CSessionStats& other)
+{
+    for(int i = 0; i < LATENCY_STAGE_COUNT; i++)
+    {
+        latency[i].Merge(other.latency[i]);
+    }
+    bytesReceived += other.GetBytesReceived();
+    g_atomic_int_add(&framesReceived, other.GetFramesReceived());
+    g_atomic_int_add(&framesDropped, other.GetFramesDropped());
+    g_atomic_int_add(&framesWritten, other.GetFramesWritten());
+}
+
+void CSessionStats::Print(int sessionId)
+{
+    printf("smartcam: session %d: %d frames received (%lld bytes), %d written, %d dropped\n",
+           sessionId, GetFramesReceived(), (long long) GetBytesReceived(), GetFramesWritten(), GetFramesDropped());
+    for(int i = 0; i < LATENCY_STAGE_COUNT; i++)
+    {
+        LatencySummary summary;
+        GetLatency((LatencyStage) i, summary);
+        printf("smartcam: session %d: %-8s latency p50 %.1f ms, p95 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+               sessionId, STAGE_NAMES[i], summary.p50 / 1000.0, summary.p95 / 1000.0,
+               summary.p99 / 1000.0, summary.max / 1000.0);
+    }
+}
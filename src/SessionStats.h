@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// SessionStats.h
+
+#ifndef __SESSION_STATS_H__
+#define __SESSION_STATS_H__
+
+#include <glib.h>
+
+// Latencies measured for every frame that reaches the device, between the
+// timestamps taken at header received, payload complete, decode done,
+// scale/convert done and device write done.
+typedef enum LatencyStage
+{
+    LATENCY_RECEIVE = 0,    // header -> payload complete: network
+    LATENCY_DECODE = 1,     // payload complete -> decoded, includes the decode queue
+    LATENCY_CONVERT = 2,    // decoded -> scaled and converted to the device format
+    LATENCY_OUTPUT = 3,     // converted -> written, includes the output queue
+    LATENCY_TOTAL = 4,      // header -> written
+    LATENCY_STAGE_COUNT = 5
+} LatencyStage;
+
+// In microseconds
+typedef struct LatencySummary
+{
+    int count;
+    int p50;
+    int p95;
+    int p99;
+    int max;
+} LatencySummary;
+
+// Log-linear histogram: exact below 16us, then 4 buckets per power of two,
+// so percentiles are reported with at most 25% error. Add() may be called
+// from any thread, it only does atomic increments.
+class CLatencyHistogram
+{
+public:
+    CLatencyHistogram();
+    void Add(gint64 micros);
+    void Merge(CLatencyHistogram& other);
+    void GetSummary(LatencySummary& summary);
+
+    static const int BUCKET_COUNT = 112;
+
+private:
+    int Percentile(const int* counts, int total, int percent, int maxMicros);
+    static int BucketOf(gint64 micros);
+    static gint64 BucketUpperBound(int bucket);
+
+    volatile gint counts[BUCKET_COUNT];
+    volatile gint maxMicros;
+};
+
+// Counters and latency histograms of one session, kept for its lifetime
+class CSessionStats
+{
+public:
+    CSessionStats();
+    // Monotonic clock, in microseconds
+    static gint64 NowMicros();
+
+    void AddLatency(LatencyStage stage, gint64 micros);
+    void GetLatency(LatencyStage stage, LatencySummary& summary);
+    void CountReceived(unsigned int bytes, bool isFrame);   // comm thread only
+    void CountDropped();
+    void CountWritten();
+    gint64 GetBytesReceived();
+    int GetFramesReceived();
+    int GetFramesDropped();
+    int GetFramesWritten();
+    // Rates over the last sampling window, set by the output stage
+    void SetRates(float fps, float bytesPerSecond);
+    float GetFps();
+    float GetBytesPerSecond();
+    void Print(int sessionId);
+    // Adds the counters and latencies of another session, for totals
+    void Merge(CSessionStats& other);
+
+    static const char* STAGE_NAMES[LATENCY_STAGE_COUNT];
+
+private:
+    CLatencyHistogram latency[LATENCY_STAGE_COUNT];
+    // written by the comm thread only, a torn read on 32 bit hosts can
+    // only skew what is displayed
+    gint64 bytesReceived;
+    volatile gint framesReceived;
+    volatile gint framesDropped;
+    volatile gint framesWritten;
+    volatile gint fpsCentis;
+    volatile gint bytesPerSecond;
+};
+
+#endif//__SESSION_STATS_H__
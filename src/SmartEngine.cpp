@@ -19,6 +19,10 @@
 
 // SmartEngine.cpp
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/time.h>
@@ -27,66 +31,153 @@
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <linux/videodev2.h>
+#include <linux/version.h>
+#ifndef SMARTCAM_HEADLESS
 #include <dbus/dbus-glib-lowlevel.h>    // dbus_connection_setup_with_g_main
 #include <gdk/gdkx.h>
+#endif
 
 #include "SmartEngine.h"
 #include "CommHandler.h"
+#ifndef SMARTCAM_HEADLESS
 #include "UIHandler.h"
-#include "JpegHandler.h"
+#endif
+#include "JpegDecoder.h"
+#include "JpegEncoder.h"
+#include "FramePool.h"
+#include "ColorConvert.h"
+#include "Session.h"
+#include "Tracer.h"
+#include "StreamRecorder.h"
 #include "smartcam.h"
 
 #define SMARTCAM_DRIVER_NAME "smartcam"
+// First driver version that takes YUYV frames as they are
+#define SMARTCAM_DRIVER_YUYV_VERSION KERNEL_VERSION(0, 2, 0)
+// Private control of the driver (since 0.5.1), 0 is BT.601 and 1 is BT.709
+#define SMARTCAM_CID_COLOR_MATRIX (V4L2_CID_PRIVATE_BASE + 0)
+// Lower bound of the worker pool size, regardless of the number of CPUs
+#define SMARTCAM_MIN_WORKERS 2
 
 static void term_handler(int signo)
 {
     g_pEngine->ExitApp(TRUE);
 }
 
+#ifndef SMARTCAM_HEADLESS
+static unsigned long now_millis()
+{
+    struct timeval now = {0};
+    gettimeofday(&now, NULL);
+    return now.tv_sec * 1000 + now.tv_usec/1000;
+}
+#endif
+
+int CSmartEngine::outputFileFd = -1;
+gboolean CSmartEngine::outputFileYUYV = FALSE;
+int CSmartEngine::outputFileWidth = CSmartEngine::SMARTCAM_FRAME_WIDTH;
+int CSmartEngine::outputFileHeight = CSmartEngine::SMARTCAM_FRAME_HEIGHT;
+
 CSmartEngine::CSmartEngine():
         commThread(NULL),
-        dbusConnection(NULL),
-        crtWidth(-1),
-        crtHeight(-1),
-        lastSampleTimeMillis(0),
-        crtSampleFrames(0),
-        deviceFd(-1),
+        deviceCount(0),
         isAlive(0),
+        reconfigurePending(0),
+        activeConnectionType(CONN_BLUETOOTH),
         pCommHandler(NULL),
-        pJpegHandler(NULL),
+        pReplayer(NULL),
+        crtSettings(),
+        jpegBackend(JPEG_BACKEND_LIBJPEG),
+        workerPool(NULL),
+        sessionsLock(NULL),
+        sessions(NULL),
+#ifdef SMARTCAM_HEADLESS
+        mainLoop(NULL)
+#else
+        dbusConnection(NULL),
         pUIHandler(NULL),
-        crtSettings()
+        uiStateLock(NULL),
+        uiFrame(NULL),
+        uiFrameDirty(FALSE),
+        uiFpsDirty(FALSE),
+        uiWidth(0),
+        uiHeight(0),
+        uiResolutionDirty(FALSE),
+        uiConnectionEvent(UI_EVENT_NONE),
+        uiServerStopped(FALSE),
+        uiUpdatePending(0),
+        previewVisible(FALSE),
+        previewEnabled(TRUE),
+        previewIntervalMillis(0),
+        nextPreviewMillis(0)
+#endif
 {
+#ifndef SMARTCAM_HEADLESS
+    memset(uiFps, 0, sizeof(uiFps));
+#endif
+    for(int i = 0; i < MAX_SMARTCAM_DEVICES; i++)
+    {
+        deviceFds[i] = -1;
+        deviceBusy[i] = FALSE;
+    }
 }
 
 CSmartEngine::~CSmartEngine()
 {
+    if(pReplayer != NULL)
+    {
+        delete pReplayer;
+        pReplayer = NULL;
+    }
     if(pCommHandler != NULL)
     {
         delete pCommHandler;
         pCommHandler = NULL;
     }
-    if(pJpegHandler != NULL)
+    if(sessionsLock != NULL)
     {
-        delete pJpegHandler;
-        pJpegHandler = NULL;
+        g_mutex_free(sessionsLock);
+        sessionsLock = NULL;
     }
+#ifdef SMARTCAM_HEADLESS
+    if(mainLoop != NULL)
+    {
+        g_main_loop_unref(mainLoop);
+        mainLoop = NULL;
+    }
+#else
     if(pUIHandler != NULL)
     {
         delete pUIHandler;
         pUIHandler = NULL;
     }
+    if(uiStateLock != NULL)
+    {
+        g_mutex_free(uiStateLock);
+        uiStateLock = NULL;
+    }
+#endif
 }
 
+#ifndef SMARTCAM_HEADLESS
 DBusHandlerResult CSmartEngine::dbus_msg_handler(
         DBusConnection *connection, DBusMessage *message, void *user_data)
 {
-    gboolean handled = FALSE;
+    gboolean handled = TRUE;
     if(dbus_message_is_method_call(message, SMARTCAM_DBUS_INTERFACE, SMARTCAM_DBUS_BRING_TO_FRONT_METHOD_NAME))
-    {
         g_pEngine->BringToFrontDBusCB(message, connection);
-        handled = TRUE;
-    }
+    else if(dbus_message_is_method_call(message, SMARTCAM_DBUS_INTERFACE, SMARTCAM_DBUS_GET_STATS_METHOD_NAME))
+        g_pEngine->GetStatsDBusCB(message, connection);
+    else if(dbus_message_is_method_call(message, SMARTCAM_DBUS_INTERFACE, SMARTCAM_DBUS_GET_SESSION_STATS_METHOD_NAME))
+        g_pEngine->GetSessionStatsDBusCB(message, connection);
+    else if(dbus_message_is_method_call(message, SMARTCAM_DBUS_INTERFACE, SMARTCAM_DBUS_SET_TARGET_FPS_METHOD_NAME))
+        g_pEngine->SetTargetFpsDBusCB(message, connection);
+    else if(dbus_message_is_method_call(message, SMARTCAM_DBUS_INTERFACE, SMARTCAM_DBUS_SET_PREVIEW_ENABLED_METHOD_NAME))
+        g_pEngine->SetPreviewEnabledDBusCB(message, connection);
+    else if(dbus_message_is_method_call(message, SMARTCAM_DBUS_INTERFACE, SMARTCAM_DBUS_SET_DROP_POLICY_METHOD_NAME))
+        g_pEngine->SetDropPolicyDBusCB(message, connection);
+    else
+        handled = FALSE;
     return (handled ? DBUS_HANDLER_RESULT_HANDLED : DBUS_HANDLER_RESULT_NOT_YET_HANDLED);
 }
 
@@ -103,7 +194,168 @@ void CSmartEngine::BringToFrontDBusCB(DBusMessage *message, DBusConnection *conn
     dbus_message_unref(reply);
 }
 
-int CSmartEngine::Initialize()
+// Appends a {sv} entry to an a{sv} dictionary; value points to a value of the given basic type
+static void append_dict_entry(DBusMessageIter* dict, const char* key, int type, const void* value)
+{
+    DBusMessageIter entry, variant;
+    char signature[2] = { (char) type, '\0' };
+    dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+    dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, signature, &variant);
+    dbus_message_iter_append_basic(&variant, type, value);
+    dbus_message_iter_close_container(&entry, &variant);
+    dbus_message_iter_close_container(dict, &entry);
+}
+
+static void append_dict_int(DBusMessageIter* dict, const char* key, int value)
+{
+    dbus_int32_t v = value;
+    append_dict_entry(dict, key, DBUS_TYPE_INT32, &v);
+}
+
+static void append_dict_double(DBusMessageIter* dict, const char* key, double value)
+{
+    append_dict_entry(dict, key, DBUS_TYPE_DOUBLE, &value);
+}
+
+static void append_dict_bool(DBusMessageIter* dict, const char* key, gboolean value)
+{
+    dbus_bool_t v = value ? TRUE : FALSE;
+    append_dict_entry(dict, key, DBUS_TYPE_BOOLEAN, &v);
+}
+
+static void append_dict_string(DBusMessageIter* dict, const char* key, const char* value)
+{
+    append_dict_entry(dict, key, DBUS_TYPE_STRING, &value);
+}
+
+static void send_reply(DBusConnection* connection, DBusMessage* reply)
+{
+    if(reply != NULL)
+    {
+        dbus_connection_send(connection, reply, NULL);
+        dbus_message_unref(reply);
+    }
+}
+
+// get_stats() -> a{sv}: engine wide state and the current tuning
+void CSmartEngine::GetStatsDBusCB(DBusMessage *message, DBusConnection *connection)
+{
+    DBusMessageIter iter, dict;
+    CUserSettings settings = GetSettings();
+    guint sessionCount = 0;
+    g_mutex_lock(sessionsLock);
+    sessionCount = g_list_length(sessions);
+    g_mutex_unlock(sessionsLock);
+
+    DBusMessage* reply = dbus_message_new_method_return(message);
+    dbus_message_iter_init_append(reply, &iter);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+    append_dict_string(&dict, "version", SMARTCAM_VERSION);
+    append_dict_string(&dict, "jpeg_backend", (jpegBackend == JPEG_BACKEND_TURBOJPEG) ? "turbojpeg" : "libjpeg");
+    append_dict_int(&dict, "sessions", sessionCount);
+    append_dict_int(&dict, "frame_path_allocations", CFramePool::GetAllocationCount());
+    append_dict_bool(&dict, "preview_enabled", g_atomic_int_get(&previewEnabled));
+    append_dict_int(&dict, "target_fps", settings.targetFps);
+    append_dict_int(&dict, "decode_drop_policy", settings.decodeDropPolicy);
+    append_dict_int(&dict, "output_drop_policy", settings.outputDropPolicy);
+    append_dict_bool(&dict, "low_latency", settings.lowLatency);
+    dbus_message_iter_close_container(&iter, &dict);
+    send_reply(connection, reply);
+}
+
+// get_session_stats() -> aa{sv}: one dictionary per connected phone, latencies in microseconds
+void CSmartEngine::GetSessionStatsDBusCB(DBusMessage *message, DBusConnection *connection)
+{
+    DBusMessageIter iter, array, dict;
+    DBusMessage* reply = dbus_message_new_method_return(message);
+    dbus_message_iter_init_append(reply, &iter);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "a{sv}", &array);
+    // sessions stay alive while they are in the list
+    g_mutex_lock(sessionsLock);
+    for(GList* it = sessions; it != NULL; it = it->next)
+    {
+        CSession* pSession = (CSession*) it->data;
+        CSessionStats* pStats = pSession->GetStats();
+        int width = 0, height = 0;
+        char key[32];
+        pSession->GetResolution(width, height);
+        dbus_int64_t bytesReceived = pStats->GetBytesReceived();
+
+        dbus_message_iter_open_container(&array, DBUS_TYPE_ARRAY, "{sv}", &dict);
+        append_dict_int(&dict, "id", pSession->GetId());
+        append_dict_string(&dict, "peer", pSession->GetPeerName());
+        append_dict_bool(&dict, "primary", it == sessions);
+        append_dict_int(&dict, "width", width);
+        append_dict_int(&dict, "height", height);
+        append_dict_double(&dict, "fps", pStats->GetFps());
+        append_dict_double(&dict, "bytes_per_second", pStats->GetBytesPerSecond());
+        append_dict_entry(&dict, "bytes_received", DBUS_TYPE_INT64, &bytesReceived);
+        append_dict_int(&dict, "frames_received", pStats->GetFramesReceived());
+        append_dict_int(&dict, "frames_written", pStats->GetFramesWritten());
+        append_dict_int(&dict, "frames_dropped", pStats->GetFramesDropped());
+        for(int i = 0; i < LATENCY_STAGE_COUNT; i++)
+        {
+            LatencySummary summary;
+            pStats->GetLatency((LatencyStage) i, summary);
+            snprintf(key, sizeof(key), "%s_p50_us", CSessionStats::STAGE_NAMES[i]);
+            append_dict_int(&dict, key, summary.p50);
+            snprintf(key, sizeof(key), "%s_p95_us", CSessionStats::STAGE_NAMES[i]);
+            append_dict_int(&dict, key, summary.p95);
+            snprintf(key, sizeof(key), "%s_p99_us", CSessionStats::STAGE_NAMES[i]);
+            append_dict_int(&dict, key, summary.p99);
+            snprintf(key, sizeof(key), "%s_max_us", CSessionStats::STAGE_NAMES[i]);
+            append_dict_int(&dict, key, summary.max);
+        }
+        dbus_message_iter_close_container(&array, &dict);
+    }
+    g_mutex_unlock(sessionsLock);
+    dbus_message_iter_close_container(&iter, &array);
+    send_reply(connection, reply);
+}
+
+// set_target_fps(i fps), 0 writes every frame
+void CSmartEngine::SetTargetFpsDBusCB(DBusMessage *message, DBusConnection *connection)
+{
+    dbus_int32_t fps = 0;
+    if(!dbus_message_get_args(message, NULL, DBUS_TYPE_INT32, &fps, DBUS_TYPE_INVALID) || fps < 0)
+    {
+        send_reply(connection, dbus_message_new_error(message, DBUS_ERROR_INVALID_ARGS, "expected a frame rate >= 0"));
+        return;
+    }
+    SetTargetFps(fps);
+    send_reply(connection, dbus_message_new_method_return(message));
+}
+
+// set_preview_enabled(b enabled)
+void CSmartEngine::SetPreviewEnabledDBusCB(DBusMessage *message, DBusConnection *connection)
+{
+    dbus_bool_t enabled = TRUE;
+    if(!dbus_message_get_args(message, NULL, DBUS_TYPE_BOOLEAN, &enabled, DBUS_TYPE_INVALID))
+    {
+        send_reply(connection, dbus_message_new_error(message, DBUS_ERROR_INVALID_ARGS, "expected a boolean"));
+        return;
+    }
+    SetPreviewEnabled(enabled);
+    send_reply(connection, dbus_message_new_method_return(message));
+}
+
+// set_drop_policy(i decode, i output), 0 drops the newest frames, 1 the oldest
+void CSmartEngine::SetDropPolicyDBusCB(DBusMessage *message, DBusConnection *connection)
+{
+    dbus_int32_t decodePolicy = 0, outputPolicy = 0;
+    if(!dbus_message_get_args(message, NULL, DBUS_TYPE_INT32, &decodePolicy, DBUS_TYPE_INT32, &outputPolicy, DBUS_TYPE_INVALID) ||
+       (decodePolicy != DROP_NEWEST && decodePolicy != DROP_OLDEST) ||
+       (outputPolicy != DROP_NEWEST && outputPolicy != DROP_OLDEST))
+    {
+        send_reply(connection, dbus_message_new_error(message, DBUS_ERROR_INVALID_ARGS, "expected two drop policies, 0 or 1"));
+        return;
+    }
+    SetDropPolicy((FrameDropPolicy) decodePolicy, (FrameDropPolicy) outputPolicy);
+    send_reply(connection, dbus_message_new_method_return(message));
+}
+
+int CSmartEngine::InitializeDBus()
 {
     int result = 0;
     DBusError dberr;
@@ -151,6 +403,19 @@ int CSmartEngine::Initialize()
     }
 
     printf("smartcam: registered DBUS service \"%s\"\n", SMARTCAM_DBUS_SERVICE);
+    return 0;
+}
+#endif//SMARTCAM_HEADLESS
+
+int CSmartEngine::Initialize()
+{
+    int result = 0;
+#ifndef SMARTCAM_HEADLESS
+    result = InitializeDBus();
+    if(result != 0)
+        return result;
+#endif
+
     // set up signal handlers
     if(signal(SIGTERM, term_handler) == SIG_ERR)
     {
@@ -164,27 +429,49 @@ int CSmartEngine::Initialize()
         return -1;
     }
 
+#ifndef SMARTCAM_HEADLESS
     pUIHandler = new CUIHandler(this);
     result = pUIHandler->Initialize();
     if (result != 0)
         return result;
+#endif
 
     pCommHandler = new CCommHandler(this);
     result = pCommHandler->Initialize();
     if (result != 0)
         return result;
 
-    pJpegHandler = new CJpegHandler();
+    sessionsLock = g_mutex_new();
 
-    if(OpenSmartCamDevice() != 0)
+#ifdef SMARTCAM_HEADLESS
+    mainLoop = g_main_loop_new(NULL, FALSE);
+    if(OpenSmartCamDevices() != 0)
+    {
+        printf("smartcam: no smartcam device found, is the smartcam driver loaded?\n");
+    }
+    // crtSettings were given by SetSettings()
+#else
+    uiStateLock = g_mutex_new();
+    uiFrame = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, SMARTCAM_FRAME_WIDTH, SMARTCAM_FRAME_HEIGHT);
+
+    if(OpenSmartCamDevices() != 0)
     {
         pUIHandler->ShowDeviceErrorDlg();
     }
     
     crtSettings = CUserSettings::LoadSettings();
+    if(crtSettings.previewFps > 0)
+    {
+        previewIntervalMillis = 1000 / crtSettings.previewFps;
+    }
+#endif
+    jpegBackend = CJpegDecoder::selectBackend(crtSettings.jpegBackend);
 
-    // put logo image in the driver
-    WriteDeviceFrame((const char*) gdk_pixbuf_get_pixels(pUIHandler->GetLogoIcon()), SMARTCAM_FRAME_SIZE);
+    // put logo image in the drivers
+    for(int i = 0; i < deviceCount; i++)
+    {
+        WriteLogoFrame(deviceFds[i]);
+    }
 
     return 0;
 }
@@ -192,97 +479,228 @@ int CSmartEngine::Initialize()
 void CSmartEngine::Cleanup(gboolean fromSignal)
 {
     StopCommThread(fromSignal);
+    if(pReplayer != NULL)
+        pReplayer->Stop();
+#ifndef SMARTCAM_HEADLESS
     // close DBUS
     if(dbusConnection != NULL)
     {
         dbus_connection_unref(dbusConnection);
         dbusConnection = NULL;
     }
-    // put logo image in the driver
-    if(pUIHandler != NULL && pUIHandler->GetLogoIcon() != NULL)
+#endif
+    // put logo image in the drivers and close the smartcam device files
+    for(int i = 0; i < deviceCount; i++)
     {
-        WriteDeviceFrame((const char*) gdk_pixbuf_get_pixels(pUIHandler->GetLogoIcon()), SMARTCAM_FRAME_SIZE);
+        WriteLogoFrame(deviceFds[i]);
+        close(deviceFds[i]);
+        deviceFds[i] = -1;
     }
-
-    // close smartcam device file
-    if(deviceFd != -1)
-        close(deviceFd);
+    deviceCount = 0;
+    outputFileFd = -1;
 
     if(pCommHandler != NULL)
         pCommHandler->Cleanup();
+#ifndef SMARTCAM_HEADLESS
     if(pUIHandler != NULL)
         pUIHandler->Cleanup();
+    if(uiFrame != NULL)
+    {
+        g_object_unref(uiFrame);
+        uiFrame = NULL;
+    }
+#endif
+}
+
+#ifdef SMARTCAM_HEADLESS
+void CSmartEngine::SetSettings(const CUserSettings& settings)
+{
+    crtSettings = settings;
+}
+
+int CSmartEngine::OpenReplay(const char* fileName, double speed)
+{
+    pReplayer = new CStreamReplayer();
+    return pReplayer->Open(fileName, speed);
+}
+
+// Must be called after Initialize(), the smartcam devices found are closed
+int CSmartEngine::OpenOutputFile(const char* fileName, gboolean yuyv, int width, int height)
+{
+    if(width < 2 || width > SMARTCAM_MAX_FRAME_WIDTH || (width & 1) != 0 ||
+       height < 1 || height > SMARTCAM_MAX_FRAME_HEIGHT)
+    {
+        printf("smartcam: can not write %dx%d frames\n", width, height);
+        return -1;
+    }
+    int fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1)
+    {
+        printf("smartcam: could not open %s: %s\n", fileName, strerror(errno));
+        return -1;
+    }
+    for(int i = 0; i < deviceCount; i++)
+    {
+        close(deviceFds[i]);
+        deviceFds[i] = -1;
+    }
+    deviceFds[0] = fd;
+    deviceBusy[0] = FALSE;
+    deviceCount = 1;
+    outputFileFd = fd;
+    outputFileYUYV = yuyv;
+    outputFileWidth = width;
+    outputFileHeight = height;
+    printf("smartcam: writing %dx%d %s frames to %s\n", width, height, yuyv ? "YUYV" : "RGB24", fileName);
+    return 0;
 }
 
+// Serve phones until ExitApp() is called
+int CSmartEngine::Run()
+{
+    if(pReplayer != NULL)
+    {
+        g_timeout_add(250, ReplayWatchProc, this);
+    }
+    g_main_loop_run(mainLoop);
+    return 0;
+}
+
+gboolean CSmartEngine::ReplayWatchProc(gpointer data)
+{
+    CSmartEngine* pEngine = (CSmartEngine*) data;
+    if(!pEngine->pReplayer->IsDone() || pEngine->IsConnected())
+    {
+        return TRUE;
+    }
+    printf("smartcam: replay finished\n");
+    pEngine->ExitApp(FALSE);
+    return FALSE;
+}
+#else
 int CSmartEngine::StartUI()
 {
     return pUIHandler->CreateMainWnd();
 }
+#endif
 
 void* CSmartEngine::CommThreadProc(void *args)
 {
-    int errCode = 0;
-    int frameSize = 0;
-    int crtBytesRcvd = 0;
-    int totalBytesRcvd = 0;
-
-    GError* error = NULL;
+    CommEvent events[MAX_COMM_EVENTS];
+    int count = 0;
 
-    g_pEngine->StartServer();
-
-ACCEPT_CLIENT:
-    while(1)
+    CTracer::SetThreadName("comm");
+    if(g_pEngine->pReplayer != NULL)
     {
-        errCode = g_pEngine->AcceptClient();
-        if(errCode == ACCEPT_OK)
-        {
-            break;
-        }
-        else if(errCode == ACCEPT_ERROR)
-        {
-            return NULL;
-        }
-        else if(errCode == ACCEPT_RETRY)
-        {
-            if(g_pEngine->isAlive)
-            {
-                usleep(300000);
-            }
-            else
-            {
-                return NULL;
-            }
-        }
+        g_pEngine->StartReplaySessions();
+    }
+    else
+    {
+        g_pEngine->StartServer();
     }
 
     while(g_pEngine->isAlive)
     {
-        errCode = g_pEngine->RcvPacket();
-        if (errCode == 0) // SUCCESS
+        // sleep until a phone connects, sends data or Wakeup() is called
+        count = g_pEngine->pCommHandler->WaitEvents(events, -1);
+        if(count < 0)
         {
-            g_pEngine->ProcessPacket();
+            break;
         }
-        else             // ERROR
+        for(int i = 0; i < count && g_pEngine->isAlive; i++)
         {
-            if(g_pEngine->isAlive)
+            if(events[i].type == COMM_EVENT_WAKEUP)
+            {
+                if(g_atomic_int_get(&g_pEngine->reconfigurePending))
+                {
+                    g_atomic_int_set(&g_pEngine->reconfigurePending, FALSE);
+                    g_pEngine->pCommHandler->StopServer();
+                    g_pEngine->StartServer();
+                }
+            }
+            else if(events[i].type == COMM_EVENT_ACCEPT)
             {
-                goto ACCEPT_CLIENT;
+                g_pEngine->AcceptClients();
             }
-            else
+            else if(events[i].type == COMM_EVENT_READ)
             {
-                return NULL;
+                g_pEngine->OnSessionReadable(events[i].pSession);
             }
         }
     }
+    // sessions still open are deleted by StopCommThread() once the workers are done
+    g_pEngine->DisconnectSessions();
 
     return NULL;
 }
 
+void CSmartEngine::AcceptClients()
+{
+    int clientSocket = INVALID_SOCKET;
+    char peerName[64];
+    AcceptResultCode result = ACCEPT_OK;
+
+    while((result = AcceptClient(clientSocket, peerName, sizeof(peerName))) == ACCEPT_OK)
+    {
+        StartSession(clientSocket, peerName);
+    }
+    if(result == ACCEPT_ERROR)
+    {
+        OnServerStopped();
+    }
+}
+
+// Receive stage: runs on the comm thread, complete packets are queued for decoding
+void CSmartEngine::OnSessionReadable(CSession* pSession)
+{
+    RcvResultCode result = pSession->RcvPacket();
+    if(result == RCV_COMPLETE)
+    {
+        pSession->QueuePacket();
+    }
+    else if(result == RCV_ERROR)
+    {
+        CloseSession(pSession);
+    }
+}
+
+void CSmartEngine::ScheduleTask(SessionTask* pTask)
+{
+    g_thread_pool_push(workerPool, pTask, NULL);
+}
+
+void CSmartEngine::SessionProc(gpointer data, gpointer user_data)
+{
+    SessionTask* pTask = (SessionTask*) data;
+    CSession* pSession = pTask->pSession;
+
+    pSession->RunStage(pTask->stage);
+    // drop the reference taken when the task was scheduled
+    pSession->Unref();
+}
+
+gboolean CSmartEngine::IsAlive()
+{
+    return isAlive;
+}
+
 int CSmartEngine::StartCommThread()
 {
+    GError* error = NULL;
+    // Create the worker pool, one worker per CPU
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if(workers < SMARTCAM_MIN_WORKERS)
+        workers = SMARTCAM_MIN_WORKERS;
+    workerPool = g_thread_pool_new(SessionProc, this, workers, FALSE, &error);
+    if(workerPool == NULL)
+    {
+        g_printerr("Failed to create worker pool: %s\n", error->message);
+        g_error_free(error);
+        return -1;
+    }
     // Create the comm thread
     isAlive = TRUE;
-    GError* error = NULL;
+    reconfigurePending = FALSE;
     commThread = g_thread_create(CommThreadProc, NULL, TRUE, &error);
     if(commThread == NULL)
     {
@@ -290,33 +708,108 @@ int CSmartEngine::StartCommThread()
         g_error_free(error);
         return -1;
     }
-    printf("smartcam: started comm thread\n");
+    printf("smartcam: started comm thread, %ld workers\n", workers);
     return 0;
 }
 
 void CSmartEngine::StopCommThread(gboolean fromSignal)
 {
     isAlive = FALSE;
-    if(!fromSignal)
-        gdk_threads_leave();
+    pCommHandler->Wakeup();
     if(commThread)
         g_thread_join(commThread);
-    if(!fromSignal)
-        gdk_threads_enter();
+    // wait for the frames being processed, then drop the remaining sessions
+    if(workerPool)
+        g_thread_pool_free(workerPool, FALSE, TRUE);
+    while(sessions != NULL)
+    {
+        CloseSession((CSession*) sessions->data);
+    }
 
     pCommHandler->StopServer();
     printf("smartcam: stopped comm thread\n");
     commThread = NULL;
+    workerPool = NULL;
+}
+
+void CSmartEngine::StartSession(int clientSocket, const char* peerName)
+{
+    CSession* pSession = new CSession(this, clientSocket, peerName);
+    if(pSession->Initialize() != 0)
+    {
+        delete pSession;
+        return;
+    }
+    g_mutex_lock(sessionsLock);
+    sessions = g_list_append(sessions, pSession);
+    g_mutex_unlock(sessionsLock);
+    OnConnected(pSession);
+    if(pCommHandler->AddSession(pSession) < 0)
+    {
+        printf("smartcam: could not watch session %d: %s\n", pSession->GetId(), strerror(errno));
+        CloseSession(pSession);
+    }
+}
+
+// Comm thread: the replayed connections are served like accepted phones
+void CSmartEngine::StartReplaySessions()
+{
+    char peerName[64];
+    for(int i = 0; i < pReplayer->GetStreamCount(); i++)
+    {
+        snprintf(peerName, sizeof(peerName), "replay %d", i);
+        StartSession(pReplayer->GetStreamSocket(i), peerName);
+    }
+    pReplayer->Start();
+}
+
+void CSmartEngine::CloseSession(CSession* pSession)
+{
+    pCommHandler->RemoveSession(pSession);
+    pSession->Disconnect();
+    OnDisconnected(pSession);
+    // deleted here or by the last worker task still running on it
+    pSession->Unref();
+}
+
+void CSmartEngine::RequestReconfigure()
+{
+    g_atomic_int_set(&reconfigurePending, TRUE);
+    pCommHandler->Wakeup();
+}
+
+void CSmartEngine::DisconnectSessions()
+{
+    g_mutex_lock(sessionsLock);
+    for(GList* it = sessions; it != NULL; it = it->next)
+    {
+        ((CSession*) it->data)->Disconnect();
+    }
+    g_mutex_unlock(sessionsLock);
+}
+
+gboolean CSmartEngine::IsPrimarySession(CSession* pSession)
+{
+    gboolean result = FALSE;
+    g_mutex_lock(sessionsLock);
+    result = (sessions != NULL && sessions->data == pSession);
+    g_mutex_unlock(sessionsLock);
+    return result;
 }
 
 int CSmartEngine::Disconnect()
 {
-    return pCommHandler->Disconnect();
+    DisconnectSessions();
+    return 0;
 }
 
 gboolean CSmartEngine::IsConnected()
 {
-    return pCommHandler->IsConnected();
+    gboolean result = FALSE;
+    g_mutex_lock(sessionsLock);
+    result = (sessions != NULL);
+    g_mutex_unlock(sessionsLock);
+    return result;
 }
 
 int CSmartEngine::xioctl(int fd, int request, void *arg)
@@ -329,17 +822,17 @@ int CSmartEngine::xioctl(int fd, int request, void *arg)
     return r;
 }
 
-int CSmartEngine::OpenSmartCamDevice()
+int CSmartEngine::OpenSmartCamDevices()
 {
     int crt_video_dev = 0;
     char dev_name[12];
 
-    for(crt_video_dev = 0; crt_video_dev < 10; crt_video_dev++)
+    deviceCount = 0;
+    for(crt_video_dev = 0; crt_video_dev < 10 && deviceCount < MAX_SMARTCAM_DEVICES; crt_video_dev++)
     {
         struct stat st;
         struct v4l2_capability v4l2cap;
-
-        deviceFd = -1;
+        int deviceFd = -1;
 
         sprintf(dev_name, "%s%d", "/dev/video", crt_video_dev);
         if(-1 == stat(dev_name, &st))
@@ -376,171 +869,456 @@ int CSmartEngine::OpenSmartCamDevice()
             close(deviceFd);
             continue;
         }
-        // found the smartcam device
+        // found a smartcam device
         else
         {
             printf("Found smartcam device file: %s\n", dev_name);
-            return 0;
+            deviceFds[deviceCount] = deviceFd;
+            deviceBusy[deviceCount] = FALSE;
+            deviceCount++;
+        }
+    }
+    return (deviceCount > 0) ? 0 : -1;
+}
+
+int CSmartEngine::AcquireDevice()
+{
+    int fd = -1;
+    g_mutex_lock(sessionsLock);
+    for(int i = 0; i < deviceCount; i++)
+    {
+        if(!deviceBusy[i])
+        {
+            deviceBusy[i] = TRUE;
+            fd = deviceFds[i];
+            break;
+        }
+    }
+    g_mutex_unlock(sessionsLock);
+    return fd;
+}
+
+void CSmartEngine::ReleaseDevice(int fd)
+{
+    WriteLogoFrame(fd);
+    g_mutex_lock(sessionsLock);
+    for(int i = 0; i < deviceCount; i++)
+    {
+        if(deviceFds[i] == fd)
+        {
+            deviceBusy[i] = FALSE;
         }
     }
-    return -1;
+    g_mutex_unlock(sessionsLock);
+}
+
+// Shown while no phone is connected, at the size the consumer captures
+void CSmartEngine::WriteLogoFrame(int fd)
+{
+    guint32 pixelFormat = V4L2_PIX_FMT_RGB24;
+    int width = SMARTCAM_FRAME_WIDTH;
+    int height = SMARTCAM_FRAME_HEIGHT;
+    GetCaptureFormat(fd, pixelFormat, width, height);
+    SetColorMatrix(fd, COLOR_MATRIX_BT601);
+    // the logo is a png, without gdk-pixbuf the device gets a black frame
+    unsigned char* rgb = (unsigned char*) g_malloc0(width * height * 3);
+#ifndef SMARTCAM_HEADLESS
+    GdkPixbuf* logo = (pUIHandler != NULL) ? pUIHandler->GetLogoIcon() : NULL;
+    if(logo != NULL)
+    {
+        GdkPixbuf* scaled = gdk_pixbuf_scale_simple(logo, width, height, GDK_INTERP_BILINEAR);
+        if(scaled != NULL && gdk_pixbuf_get_rowstride(scaled) == width * 3)
+        {
+            memcpy(rgb, gdk_pixbuf_get_pixels(scaled), width * height * 3);
+        }
+        if(scaled != NULL)
+        {
+            g_object_unref(scaled);
+        }
+    }
+#endif
+    if(pixelFormat == V4L2_PIX_FMT_MJPEG)
+    {
+        // the driver only takes jpegs in MJPEG captures
+        int size = 0;
+        CJpegEncoder encoder(width, height, 85);
+        unsigned char* jpeg = encoder.encodeImage(rgb, size);
+        WriteDeviceFrame(fd, (const char*) jpeg, size);
+        free(jpeg);
+    }
+    else if(pixelFormat == V4L2_PIX_FMT_NV12 || pixelFormat == V4L2_PIX_FMT_YUV420)
+    {
+        // nor does it convert to the planar formats
+        int size = CColorConvert::yuvFrameSize(pixelFormat, width, height);
+        unsigned char* yuv = (unsigned char*) g_malloc(size);
+        CColorConvert::rgb24ToYUV(rgb, width * 3, pixelFormat, yuv, width, height, COLOR_MATRIX_BT601);
+        WriteDeviceFrame(fd, (const char*) yuv, size);
+        g_free(yuv);
+    }
+    else
+    {
+        WriteDeviceFrame(fd, (const char*) rgb, width * height * 3);
+    }
+    g_free(rgb);
 }
 
 int CSmartEngine::StartServer()
 {
     int result = 0;
-    if (crtSettings.connectionType == CONN_INET)
-        result = pCommHandler->StartInetServer(crtSettings.inetPort);
-    else if (crtSettings.connectionType == CONN_BLUETOOTH)
+    // accepted clients are dispatched on the type of the running server
+    CUserSettings settings = GetSettings();
+    activeConnectionType = settings.connectionType;
+    if (settings.connectionType == CONN_INET)
+        result = pCommHandler->StartInetServer(settings.inetPort);
+    else if (settings.connectionType == CONN_BLUETOOTH)
         result = pCommHandler->StartBtServer();
+    else if (settings.connectionType == CONN_UNIX)
+        result = pCommHandler->StartUnixServer(settings.unixSocketPath);
     return result;
 }
 
-AcceptResultCode CSmartEngine::AcceptClient()
+AcceptResultCode CSmartEngine::AcceptClient(int& clientSocket, char* peerName, int peerNameLen)
 {
-    AcceptResultCode result = ACCEPT_OK;
-    if(crtSettings.connectionType == CONN_INET)
+    AcceptResultCode result = ACCEPT_RETRY;
+    if(activeConnectionType == CONN_INET)
     {
-        result = pCommHandler->AcceptInetClient();
+        result = pCommHandler->AcceptInetClient(clientSocket, peerName, peerNameLen);
     }
-    else if(crtSettings.connectionType == CONN_BLUETOOTH)
+    else if(activeConnectionType == CONN_BLUETOOTH)
     {
-        result = pCommHandler->AcceptBtClient();
+        result = pCommHandler->AcceptBtClient(clientSocket, peerName, peerNameLen);
+    }
+    else if(activeConnectionType == CONN_UNIX)
+    {
+        result = pCommHandler->AcceptUnixClient(clientSocket, peerName, peerNameLen);
     }
     return result;
 }
 
-int CSmartEngine::RcvPacket()
+int CSmartEngine::WriteDeviceFrame(int fd, const char* frameData, int frameLength)
 {
-    return pCommHandler->RcvPacket();
+    if(fd == -1)
+    {
+        return 0;
+    }
+    int result = 0;
+    int size = frameLength;
+    while(size > 0)
+    {
+        result = write(fd, frameData + (frameLength - size), size);
+        if(result == -1)
+        {
+            if(errno == EAGAIN || errno == EINTR)
+            {
+                continue;
+            }
+            int error = errno;
+            printf("smartcam: error writing device frame: %s\n", strerror(error));
+            errno = error;
+            return -1;
+        }
+        size -= result;
+    }
+    return 0;
 }
 
-void CSmartEngine::ProcessPacket()
+// Frames of SMARTCAM_YUYV_FRAME_SIZE bytes are not converted by the driver
+gboolean CSmartEngine::AcceptsYUYVFrames(int fd)
 {
-    if(pCommHandler->GetRcvPacketType() == PACKET_JPEG_HEDAER)
+    struct v4l2_capability v4l2cap;
+    if(fd != -1 && fd == outputFileFd)
     {
-        pJpegHandler->decodeHeader(pCommHandler->GetRcvPacket(), pCommHandler->GetRcvPacketLen());
+        return outputFileYUYV;
     }
-    else if(pCommHandler->GetRcvPacketType() == PACKET_JPEG_DATA)
+    if(fd == -1 || xioctl(fd, VIDIOC_QUERYCAP, &v4l2cap) == -1)
     {
-        int w = 0, h = 0;
-        GdkPixbuf* pixbuf = NULL, * scaledPixbuf = NULL;
-        unsigned char* driverBufferRgb24 = NULL;
-        unsigned char* rgb24 = pJpegHandler->decodeRGB24(pCommHandler->GetRcvPacket(), pCommHandler->GetRcvPacketLen(), w, h);
-        if(rgb24 == NULL)
-        {
-            return; // error, maybe just disconnected...
-        }
-        gdk_threads_enter();
-        pixbuf = gdk_pixbuf_new_from_data(rgb24, GDK_COLORSPACE_RGB, FALSE, 8, w, h, w * 3, NULL, NULL);
-        if(w != SMARTCAM_FRAME_WIDTH || h != SMARTCAM_FRAME_HEIGHT)
-        {
-            scaledPixbuf = gdk_pixbuf_scale_simple(
-                                pixbuf, SMARTCAM_FRAME_WIDTH, SMARTCAM_FRAME_HEIGHT, GDK_INTERP_BILINEAR);
-            g_object_unref(pixbuf);
-            pixbuf = NULL;
-            driverBufferRgb24 = gdk_pixbuf_get_pixels(scaledPixbuf);
-        }
-        else // do not scale, use original buffer/pixbuf
-        {
-            scaledPixbuf = pixbuf;
-            driverBufferRgb24 = rgb24;
-        }
-        gdk_threads_leave();
-        // write the frame in the driverb
-        WriteDeviceFrame((const char*)driverBufferRgb24, SMARTCAM_FRAME_SIZE);
-        // draw the frame
-        gdk_threads_enter();
-        pUIHandler->DrawFrame(scaledPixbuf);
-        gdk_threads_leave();
-        g_object_unref(scaledPixbuf);
-        scaledPixbuf = NULL;
-        SampleFPS();
-
-        // Update resolution status bar message
-        if(crtWidth != w || crtHeight != h)
-        {
-            crtWidth = w;
-            crtHeight = h;
-            gdk_threads_enter();
-            pUIHandler->UpdateStatusbarResolution(crtWidth, crtHeight);
-            gdk_threads_leave();
-        }
+        return FALSE;
+    }
+    return v4l2cap.version >= SMARTCAM_DRIVER_YUYV_VERSION;
+}
+
+// The capture format is chosen by the consumer (video call application)
+gboolean CSmartEngine::GetCaptureFormat(int fd, guint32& pixelFormat, int& width, int& height)
+{
+    struct v4l2_format v4l2fmt;
+    memset(&v4l2fmt, 0, sizeof(v4l2fmt));
+    v4l2fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if(fd != -1 && fd == outputFileFd)
+    {
+        pixelFormat = outputFileYUYV ? V4L2_PIX_FMT_YUYV : V4L2_PIX_FMT_RGB24;
+        width = outputFileWidth;
+        height = outputFileHeight;
+        return TRUE;
+    }
+    if(fd == -1 || xioctl(fd, VIDIOC_G_FMT, &v4l2fmt) == -1)
+    {
+        return FALSE;
     }
+    // YUYV pairs pixels, drivers before 0.3.0 always report 320x240
+    int w = v4l2fmt.fmt.pix.width;
+    int h = v4l2fmt.fmt.pix.height;
+    if(w < 2 || w > SMARTCAM_MAX_FRAME_WIDTH || (w & 1) != 0 || h < 1 || h > SMARTCAM_MAX_FRAME_HEIGHT)
+    {
+        return FALSE;
+    }
+    pixelFormat = v4l2fmt.fmt.pix.pixelformat;
+    width = w;
+    height = h;
+    return TRUE;
 }
 
-void CSmartEngine::WriteDeviceFrame(const char* frameData, int frameLength)
+int CSmartEngine::SetColorMatrix(int fd, ColorMatrix matrix)
 {
-    if(deviceFd == -1)
+    struct v4l2_control v4l2ctrl;
+    if(fd == -1 || fd == outputFileFd)
+    {
+        // no consumer to tell
+        return 0;
+    }
+    memset(&v4l2ctrl, 0, sizeof(v4l2ctrl));
+    v4l2ctrl.id = SMARTCAM_CID_COLOR_MATRIX;
+    v4l2ctrl.value = (matrix == COLOR_MATRIX_BT709) ? 1 : 0;
+    return xioctl(fd, VIDIOC_S_CTRL, &v4l2ctrl);
+}
+
+#ifdef SMARTCAM_HEADLESS
+// No preview and no status bar: resolution changes are logged, the rest is dropped
+gboolean CSmartEngine::IsPreviewDue(CSession* pSession)
+{
+    return FALSE;
+}
+
+void CSmartEngine::DrawFrame(CSession* pSession, const unsigned char* rgb, int rowstride, int width, int height)
+{
+}
+
+void CSmartEngine::UpdateFps(CSession* pSession, float fps, int droppedFrames)
+{
+}
+
+void CSmartEngine::UpdateResolution(CSession* pSession, int width, int height)
+{
+    printf("smartcam: session %d streams %dx%d\n", pSession->GetId(), width, height);
+}
+#else
+// Whether a frame of the session would be drawn now, so the decode stage
+// can skip the RGB conversion that only the preview needs
+gboolean CSmartEngine::IsPreviewDue(CSession* pSession)
+{
+    if(!g_atomic_int_get(&previewVisible) || !g_atomic_int_get(&previewEnabled) || !IsPrimarySession(pSession))
+    {
+        return FALSE;
+    }
+    gboolean result = FALSE;
+    g_mutex_lock(uiStateLock);
+    result = (now_millis() >= nextPreviewMillis);
+    g_mutex_unlock(uiStateLock);
+    return result;
+}
+
+// Called by the output stage: the frame is copied and shown later by the
+// UI thread, so the worker never waits for the gdk lock
+void CSmartEngine::DrawFrame(CSession* pSession, const unsigned char* rgb, int rowstride, int width, int height)
+{
+    // only the primary (first connected) session is previewed
+    if(!g_atomic_int_get(&previewVisible) || !g_atomic_int_get(&previewEnabled) ||
+       !IsPrimarySession(pSession) || uiFrame == NULL)
     {
         return;
     }
-    int result = 0;
-    int size = frameLength;
-    while(size > 0)
+    unsigned char* pixels = gdk_pixbuf_get_pixels(uiFrame);
+    int uiRowstride = gdk_pixbuf_get_rowstride(uiFrame);
+    unsigned long nowMillis = now_millis();
+    g_mutex_lock(uiStateLock);
+    if(nowMillis < nextPreviewMillis)
     {
-        result = write(deviceFd, frameData + (frameLength - size), size);
-        if(result == -1 && errno != EAGAIN)
-        {
-            printf("smartcam: error writing device frame: %s\n", strerror(errno));
-            return;
-        }
-        else
+        g_mutex_unlock(uiStateLock);
+        return;
+    }
+    nextPreviewMillis = nowMillis + g_atomic_int_get(&previewIntervalMillis);
+    if(width != SMARTCAM_FRAME_WIDTH || height != SMARTCAM_FRAME_HEIGHT)
+    {
+        // the consumer captures another size, the preview window stays small
+        CColorConvert::scaleRGB24(rgb, rowstride, width, height, pixels, uiRowstride,
+                                  SMARTCAM_FRAME_WIDTH, SMARTCAM_FRAME_HEIGHT);
+    }
+    else
+    {
+        for(int y = 0; y < SMARTCAM_FRAME_HEIGHT; y++)
         {
-            size -= result;
+            memcpy(pixels + y * uiRowstride, rgb + y * rowstride, SMARTCAM_FRAME_WIDTH * 3);
         }
     }
+    uiFrameDirty = TRUE;
+    g_mutex_unlock(uiStateLock);
+    ScheduleUIUpdate();
 }
 
-void CSmartEngine::SampleFPS()
+void CSmartEngine::UpdateFps(CSession* pSession, float fps, int droppedFrames)
 {
-    struct timeval now = {0};
-    if(gettimeofday(&now, NULL))
+    if(!IsPrimarySession(pSession))
     {
         return;
     }
-    unsigned long nowMillis = now.tv_sec * 1000 + now.tv_usec/1000;
-    if(lastSampleTimeMillis == 0)
+    char fps_str[40];
+    memset(fps_str, 0, 40);
+    if(droppedFrames > 0)
+        sprintf(fps_str, "FPS: %.2f (%d dropped)", fps, droppedFrames);
+    else
+        sprintf(fps_str, "FPS: %.2f", fps);
+    g_mutex_lock(uiStateLock);
+    memcpy(uiFps, fps_str, sizeof(uiFps));
+    uiFpsDirty = TRUE;
+    g_mutex_unlock(uiStateLock);
+    ScheduleUIUpdate();
+}
+
+void CSmartEngine::UpdateResolution(CSession* pSession, int width, int height)
+{
+    if(!IsPrimarySession(pSession))
     {
-        lastSampleTimeMillis = nowMillis;
         return;
     }
-    unsigned long elapsedMillis = nowMillis - lastSampleTimeMillis;
-    if(elapsedMillis >= 1000)
+    g_mutex_lock(uiStateLock);
+    uiWidth = width;
+    uiHeight = height;
+    uiResolutionDirty = TRUE;
+    g_mutex_unlock(uiStateLock);
+    ScheduleUIUpdate();
+}
+
+// At most one idle callback is pending: updates published while it waits
+// are picked up by the same run
+void CSmartEngine::ScheduleUIUpdate()
+{
+    if(g_atomic_int_compare_and_exchange(&uiUpdatePending, 0, 1))
     {
-        float fps = ((float)crtSampleFrames * 1000)/elapsedMillis;
-        char fps_str[30];
-        memset(fps_str, 0, 30);
-        sprintf(fps_str, "FPS: %.2f", fps);
-        gdk_threads_enter();
-        pUIHandler->UpdateStatusbarFps(fps_str);
-        gdk_threads_leave();
-        lastSampleTimeMillis = nowMillis;
-        crtSampleFrames = 0;
+        gdk_threads_add_idle(UIUpdateProc, this);
     }
-    else
+}
+
+gboolean CSmartEngine::UIUpdateProc(gpointer data)
+{
+    ((CSmartEngine*) data)->UpdateUI();
+    return FALSE;
+}
+
+// Main thread only, with the gdk lock held
+void CSmartEngine::UpdateUI()
+{
+    UIConnectionEvent event = UI_EVENT_NONE;
+    gboolean serverStopped = FALSE;
+    gboolean fpsDirty = FALSE;
+    gboolean resolutionDirty = FALSE;
+    char fps[40];
+    int width = 0;
+    int height = 0;
+
+    // reset first, so an update published from now on schedules a new run
+    g_atomic_int_set(&uiUpdatePending, 0);
+
+    g_mutex_lock(uiStateLock);
+    event = uiConnectionEvent;
+    uiConnectionEvent = UI_EVENT_NONE;
+    serverStopped = uiServerStopped;
+    uiServerStopped = FALSE;
+    fpsDirty = uiFpsDirty;
+    uiFpsDirty = FALSE;
+    memcpy(fps, uiFps, sizeof(fps));
+    resolutionDirty = uiResolutionDirty;
+    uiResolutionDirty = FALSE;
+    width = uiWidth;
+    height = uiHeight;
+    g_mutex_unlock(uiStateLock);
+
+    if(event == UI_EVENT_CONNECTED)
+    {
+        pUIHandler->UpdateOnConnected();
+    }
+    else if(event == UI_EVENT_DISCONNECTED)
     {
-        ++crtSampleFrames;
+        pUIHandler->UpdateOnDisconnected();
     }
+    if(serverStopped)
+    {
+        pUIHandler->UpdateOnServerStopped();
+    }
+    if(event == UI_EVENT_DISCONNECTED)
+    {
+        return;
+    }
+    if(fpsDirty)
+    {
+        pUIHandler->UpdateStatusbarFps(fps);
+    }
+    if(resolutionDirty)
+    {
+        pUIHandler->UpdateStatusbarResolution(width, height);
+    }
+
+    g_mutex_lock(uiStateLock);
+    if(uiFrameDirty)
+    {
+        pUIHandler->DrawFrame(uiFrame);
+        uiFrameDirty = FALSE;
+    }
+    g_mutex_unlock(uiStateLock);
+}
+#endif//SMARTCAM_HEADLESS
+
+void CSmartEngine::OnConnected(CSession* pSession)
+{
+    guint count = 0;
+    g_mutex_lock(sessionsLock);
+    count = g_list_length(sessions);
+    g_mutex_unlock(sessionsLock);
+    printf("smartcam: session %d connected (%s), %u active\n", pSession->GetId(), pSession->GetPeerName(), count);
+#ifndef SMARTCAM_HEADLESS
+    if(count == 1)
+    {
+        g_mutex_lock(uiStateLock);
+        uiConnectionEvent = UI_EVENT_CONNECTED;
+        g_mutex_unlock(uiStateLock);
+        ScheduleUIUpdate();
+    }
+#endif
 }
 
-void CSmartEngine::OnConnected()
+void CSmartEngine::OnDisconnected(CSession* pSession)
 {
-    crtSampleFrames = 0;
-    lastSampleTimeMillis = 0;
-    pUIHandler->UpdateOnConnected();
+    gboolean isEmpty = FALSE;
+    g_mutex_lock(sessionsLock);
+    sessions = g_list_remove(sessions, pSession);
+    isEmpty = (sessions == NULL);
+    g_mutex_unlock(sessionsLock);
+    printf("smartcam: session %d disconnected (%s)\n", pSession->GetId(), pSession->GetPeerName());
+#ifndef SMARTCAM_HEADLESS
+    if(isEmpty)
+    {
+        // the logo replaces the preview, drop what is still pending
+        g_mutex_lock(uiStateLock);
+        uiConnectionEvent = UI_EVENT_DISCONNECTED;
+        uiFrameDirty = FALSE;
+        uiFpsDirty = FALSE;
+        uiResolutionDirty = FALSE;
+        g_mutex_unlock(uiStateLock);
+        ScheduleUIUpdate();
+    }
+#endif
 }
 
-void CSmartEngine::OnDisconnected()
+void CSmartEngine::OnServerStopped()
 {
-    crtWidth = -1;
-    crtHeight = -1;
-    crtSampleFrames = 0;
-    lastSampleTimeMillis = 0;
-    WriteDeviceFrame((const char*) gdk_pixbuf_get_pixels(pUIHandler->GetLogoIcon()), SMARTCAM_FRAME_SIZE);
-    pUIHandler->UpdateOnDisconnected();
+    printf("smartcam: server stopped, phones can not connect until it is restarted\n");
+#ifndef SMARTCAM_HEADLESS
+    g_mutex_lock(uiStateLock);
+    uiServerStopped = TRUE;
+    g_mutex_unlock(uiStateLock);
+    ScheduleUIUpdate();
+#endif
 }
 
+#ifndef SMARTCAM_HEADLESS
 GtkWidget* CSmartEngine::GetMainWindow()
 {
     return pUIHandler->GetMainWindow();
@@ -564,6 +1342,15 @@ void CSmartEngine::SetMainWndPos(gint posX, gint posY)
 void CSmartEngine::OnMainWndMinimized(gboolean isMainWndMinimized)
 {
     pUIHandler->OnMainWndMinimized(isMainWndMinimized);
+    OnMainWndVisibilityChanged();
+}
+
+// UI thread: the window was shown, hidden, minimized or restored
+void CSmartEngine::OnMainWndVisibilityChanged()
+{
+    GtkWidget* mainWindow = pUIHandler->GetMainWindow();
+    gboolean visible = (mainWindow != NULL && GTK_WIDGET_VISIBLE(mainWindow) && !pUIHandler->IsMainWndMinimized());
+    g_atomic_int_set(&previewVisible, visible);
 }
 
 gboolean CSmartEngine::IsMainWndMinimized()
@@ -586,37 +1373,109 @@ GtkStatusIcon* CSmartEngine::GetStatusIcon()
     return pUIHandler->GetStatusIcon();
 }
 
+void CSmartEngine::ShowSettingsDlg(void)
+{
+    pUIHandler->ShowSettingsDlg();
+}
+#endif//SMARTCAM_HEADLESS
+
 void CSmartEngine::ExitApp(gboolean fromSignal)
 {
     printf("smartcam: exit app\n");
     Cleanup(fromSignal);
+#ifdef SMARTCAM_HEADLESS
+    if(mainLoop != NULL)
+        g_main_loop_quit(mainLoop);
+#else
     gtk_main_quit();
+#endif
 }
 
-void CSmartEngine::ShowSettingsDlg(void)
+CUserSettings CSmartEngine::GetSettings()
 {
-    pUIHandler->ShowSettingsDlg();
+    CUserSettings settings;
+    g_mutex_lock(sessionsLock);
+    settings = crtSettings;
+    g_mutex_unlock(sessionsLock);
+    return settings;
 }
 
-CUserSettings CSmartEngine::GetSettings()
+void CSmartEngine::SetTargetFps(int fps)
+{
+    g_mutex_lock(sessionsLock);
+    crtSettings.targetFps = fps;
+    for(GList* it = sessions; it != NULL; it = it->next)
+    {
+        ((CSession*) it->data)->SetTargetFps(fps);
+    }
+    g_mutex_unlock(sessionsLock);
+    printf("smartcam: target output rate set to %d fps\n", fps);
+}
+
+void CSmartEngine::SetPreviewEnabled(gboolean enabled)
+{
+#ifndef SMARTCAM_HEADLESS
+    g_atomic_int_set(&previewEnabled, enabled);
+#endif
+    printf("smartcam: preview %s\n", enabled ? "enabled" : "disabled");
+}
+
+void CSmartEngine::SetDropPolicy(FrameDropPolicy decodePolicy, FrameDropPolicy outputPolicy)
+{
+    g_mutex_lock(sessionsLock);
+    crtSettings.decodeDropPolicy = decodePolicy;
+    crtSettings.outputDropPolicy = outputPolicy;
+    for(GList* it = sessions; it != NULL; it = it->next)
+    {
+        ((CSession*) it->data)->SetDropPolicy(decodePolicy, outputPolicy);
+    }
+    g_mutex_unlock(sessionsLock);
+    printf("smartcam: drop policy set to %d (decode), %d (output)\n", decodePolicy, outputPolicy);
+}
+
+CCommHandler* CSmartEngine::GetCommHandler()
+{
+    return pCommHandler;
+}
+
+void CSmartEngine::AddClosedSessionStats(CSessionStats* pStats)
+{
+    g_mutex_lock(sessionsLock);
+    closedSessionStats.Merge(*pStats);
+    g_mutex_unlock(sessionsLock);
+}
+
+CSessionStats* CSmartEngine::GetClosedSessionStats()
+{
+    return &closedSessionStats;
+}
+
+JpegBackend CSmartEngine::GetJpegBackend()
 {
-    return crtSettings;
+    return jpegBackend;
 }
 
+#ifndef SMARTCAM_HEADLESS
 void CSmartEngine::SaveSettings(CUserSettings settings)
 {
     if((crtSettings.connectionType != settings.connectionType) ||
-       (crtSettings.inetPort != settings.inetPort))
+       (crtSettings.inetPort != settings.inetPort) ||
+       (strcmp(crtSettings.unixSocketPath, settings.unixSocketPath) != 0) ||
+       (crtSettings.lowLatency != settings.lowLatency))
     {
         CUserSettings::SaveSettings(settings);
-        CUserSettings oldSettings = crtSettings;
+        CUserSettings oldSettings = GetSettings();
+        g_mutex_lock(sessionsLock);
         crtSettings = settings;
+        g_mutex_unlock(sessionsLock);
         if((oldSettings.connectionType != settings.connectionType) ||
-           (oldSettings.inetPort != settings.inetPort))
+           (oldSettings.inetPort != settings.inetPort) ||
+           (strcmp(oldSettings.unixSocketPath, settings.unixSocketPath) != 0))
         {
             pUIHandler->UpdateStatusbarConnIcon(settings.connectionType);
-            StopCommThread(FALSE);
-            StartCommThread();
+            // restart the server from the comm thread, sessions are kept
+            RequestReconfigure();
         }
     }
 }
+#endif//SMARTCAM_HEADLESS
@@ -22,11 +22,16 @@
 #ifndef __SMART_ENGINE_H__
 #define __SMART_ENGINE_H__
 
+#include <glib.h>
+// smartcamd (SMARTCAM_HEADLESS) is built without GTK, D-Bus and GConf
+#ifndef SMARTCAM_HEADLESS
 #include <gtk/gtk.h>
 #include <dbus/dbus.h>
+#endif
 
 #include "CommHandler.h"
 #include "UserSettings.h"
+#include "SessionStats.h"
 
 // SmartCam DBus service
 #define SMARTCAM_DBUS_SERVICE                               "org.gnome.smartcam"
@@ -36,9 +41,29 @@
 #define SMARTCAM_DBUS_PATH                                  "/org/gnome/smartcam"
 // SmartCam DBus bring to front method
 #define SMARTCAM_DBUS_BRING_TO_FRONT_METHOD_NAME            "bring_to_front"
+// SmartCam DBus statistics methods, see smartcam-dbus.xml
+#define SMARTCAM_DBUS_GET_STATS_METHOD_NAME                 "get_stats"
+#define SMARTCAM_DBUS_GET_SESSION_STATS_METHOD_NAME         "get_session_stats"
+// SmartCam DBus tuning methods
+#define SMARTCAM_DBUS_SET_TARGET_FPS_METHOD_NAME            "set_target_fps"
+#define SMARTCAM_DBUS_SET_PREVIEW_ENABLED_METHOD_NAME       "set_preview_enabled"
+#define SMARTCAM_DBUS_SET_DROP_POLICY_METHOD_NAME           "set_drop_policy"
+
+// Maximum number of smartcam device files (/dev/videoN) used for output
+#define MAX_SMARTCAM_DEVICES 8
 
 class CUIHandler;
-class CJpegHandler;
+class CSession;
+class CStreamReplayer;
+struct SessionTask;
+
+// Connection change waiting to be shown by the UI thread; the last one wins
+typedef enum UIConnectionEvent
+{
+    UI_EVENT_NONE = 0,
+    UI_EVENT_CONNECTED = 1,
+    UI_EVENT_DISCONNECTED = 2
+} UIConnectionEvent;
 
 class CSmartEngine
 {
@@ -47,60 +72,168 @@ public:
     virtual ~CSmartEngine();
     int Initialize();
     void Cleanup(gboolean fromSignal);
-    int StartUI();
     int StartCommThread();
     void StopCommThread(gboolean fromSignal);
     int Disconnect();
-    void OnConnected();
-    void OnDisconnected();
+    void OnConnected(CSession* pSession);
+    void OnDisconnected(CSession* pSession);
+    // The server socket failed, no phone can connect until the server restarts
+    void OnServerStopped();
+    int AcquireDevice();
+    void ReleaseDevice(int fd);
+    gboolean IsPreviewDue(CSession* pSession);
+    // The frame is shown scaled to SMARTCAM_FRAME_WIDTH x SMARTCAM_FRAME_HEIGHT
+    void DrawFrame(CSession* pSession, const unsigned char* rgb, int rowstride, int width, int height);
+    void UpdateFps(CSession* pSession, float fps, int droppedFrames);
+    void UpdateResolution(CSession* pSession, int width, int height);
+    void ScheduleTask(SessionTask* pTask);
+    gboolean IsAlive();
+    gboolean IsConnected();
+    CUserSettings GetSettings();
+    JpegBackend GetJpegBackend();
+    CCommHandler* GetCommHandler();
+    // Totals of the sessions that ended, merged when a session is deleted
+    void AddClosedSessionStats(CSessionStats* pStats);
+    CSessionStats* GetClosedSessionStats();
+    // Runtime tuning, applied to the running sessions and the next ones:
+    void SetTargetFps(int fps);
+    void SetPreviewEnabled(gboolean enabled);
+    void SetDropPolicy(FrameDropPolicy decodePolicy, FrameDropPolicy outputPolicy);
+    void ExitApp(gboolean fromSignal);
+#ifdef SMARTCAM_HEADLESS
+    // Settings come from the command line or a key file instead of GConf
+    void SetSettings(const CUserSettings& settings);
+    // Serve a recorded stream instead of starting the server, see StreamRecorder.h
+    int OpenReplay(const char* fileName, double speed);
+    // Write the frames to a file (or /dev/null) instead of the smartcam devices
+    int OpenOutputFile(const char* fileName, gboolean yuyv,
+                       int width = SMARTCAM_FRAME_WIDTH, int height = SMARTCAM_FRAME_HEIGHT);
+    int Run();
+#else
+    int StartUI();
     GtkWidget* GetMainWindow();
     void ShowMainWindow();
     void HideMainWindow();
     void SetMainWndPos(gint posX, gint posY);
     void OnMainWndMinimized(gboolean isMainWndMinimized);
+    void OnMainWndVisibilityChanged();
     gboolean IsMainWndMinimized();
     void SetStatusMenu(GtkWidget* menu);
     GtkWidget* GetStatusMenu();
     GtkStatusIcon* GetStatusIcon();
-    gboolean IsConnected();
     void ShowSettingsDlg(void);
-    CUserSettings GetSettings();
     void SaveSettings(CUserSettings settings);
-    void ExitApp(gboolean fromSignal);
+#endif
+    // -1 with errno set if the device refused the frame (EINVAL: not the capture format)
+    static int WriteDeviceFrame(int fd, const char* frame_data, int frame_length);
+    static gboolean AcceptsYUYVFrames(int fd);
+    // Pixel format (V4L2 fourcc) and size picked by the consumer (video call application),
+    // FALSE if the device can not tell or asks for a size that is not produced
+    static gboolean GetCaptureFormat(int fd, guint32& pixelFormat, int& width, int& height);
+    // Tells the driver (0.5.1) which matrix the YCbCr frames are converted with,
+    // -1 if it can not report it to the consumer
+    static int SetColorMatrix(int fd, ColorMatrix matrix);
+    gboolean IsPrimarySession(CSession* pSession);
+
+    // Default output size, drivers since 0.3.0 let the consumer pick up to the maximum
+    static const int SMARTCAM_FRAME_WIDTH = 320;
+    static const int SMARTCAM_FRAME_HEIGHT = 240;
+    static const int SMARTCAM_MAX_FRAME_WIDTH = 1920;
+    static const int SMARTCAM_MAX_FRAME_HEIGHT = 1080;
+    static const int SMARTCAM_FRAME_SIZE = SMARTCAM_FRAME_WIDTH * SMARTCAM_FRAME_HEIGHT * 3;
+    static const int SMARTCAM_YUYV_FRAME_SIZE = SMARTCAM_FRAME_WIDTH * SMARTCAM_FRAME_HEIGHT * 2;
 
 private:
     // Methods:
-    int OpenSmartCamDevice();
+    int OpenSmartCamDevices();
+    void WriteLogoFrame(int fd);
     int StartServer();
-    AcceptResultCode AcceptClient();
-    int RcvPacket();
-    void ProcessPacket();
-    void WriteDeviceFrame(const char* frame_data, int frame_length);
-    void SampleFPS();
+    AcceptResultCode AcceptClient(int& clientSocket, char* peerName, int peerNameLen);
+    void AcceptClients();
+    void StartSession(int clientSocket, const char* peerName);
+    void StartReplaySessions();
+    void OnSessionReadable(CSession* pSession);
+    void CloseSession(CSession* pSession);
+    void DisconnectSessions();
+    void RequestReconfigure();
+#ifndef SMARTCAM_HEADLESS
+    int InitializeDBus();
+    void ScheduleUIUpdate();
+    void UpdateUI();
     void BringToFrontDBusCB(DBusMessage *message, DBusConnection *connection);
+    void GetStatsDBusCB(DBusMessage *message, DBusConnection *connection);
+    void GetSessionStatsDBusCB(DBusMessage *message, DBusConnection *connection);
+    void SetTargetFpsDBusCB(DBusMessage *message, DBusConnection *connection);
+    void SetPreviewEnabledDBusCB(DBusMessage *message, DBusConnection *connection);
+    void SetDropPolicyDBusCB(DBusMessage *message, DBusConnection *connection);
+#endif
     // Static methods:
     static int xioctl(int fd, int request, void *arg);
+#ifndef SMARTCAM_HEADLESS
     static DBusHandlerResult dbus_msg_handler(DBusConnection *connection, DBusMessage *message, void *user_data);
+    // Idle callback, applies the published UI state on the main thread:
+    static gboolean UIUpdateProc(gpointer data);
+#endif
     // Comm thread procedure:
     static void* CommThreadProc(void* args);
+    // Worker pool procedure, runs one pipeline stage of a session:
+    static void SessionProc(gpointer data, gpointer user_data);
+#ifdef SMARTCAM_HEADLESS
+    // Main loop timer, exits once the replayed sessions are done:
+    static gboolean ReplayWatchProc(gpointer data);
+#endif
 
     // Data:
     GThread* commThread;
-    DBusConnection* dbusConnection;
-    int crtWidth;
-    int crtHeight;
-    unsigned long lastSampleTimeMillis;
-    int crtSampleFrames;
-    int deviceFd;
+    // Output devices, one per session:
+    int deviceFds[MAX_SMARTCAM_DEVICES];
+    gboolean deviceBusy[MAX_SMARTCAM_DEVICES];
+    int deviceCount;
     // Comm thread
     gboolean isAlive;
+    gint reconfigurePending;
+    ConnectionType activeConnectionType;
     CCommHandler* pCommHandler;
-    CJpegHandler* pJpegHandler;
-    CUIHandler* pUIHandler;
+    // NULL unless replaying a recording
+    CStreamReplayer* pReplayer;
     CUserSettings crtSettings;
-
-    static const int SMARTCAM_FRAME_WIDTH = 320;
-    static const int SMARTCAM_FRAME_HEIGHT = 240;
-    static const int SMARTCAM_FRAME_SIZE = SMARTCAM_FRAME_WIDTH * SMARTCAM_FRAME_HEIGHT * 3;
+    // Decoder chosen at startup, from the settings or by benchmark
+    JpegBackend jpegBackend;
+    CSessionStats closedSessionStats;
+    // Output file used as the only device, see OpenOutputFile()
+    static int outputFileFd;
+    static gboolean outputFileYUYV;
+    static int outputFileWidth;
+    static int outputFileHeight;
+    // Sessions, served by the worker pool. sessionsLock also guards
+    // crtSettings, which the tuning methods change at runtime:
+    GThreadPool* workerPool;
+    GMutex* sessionsLock;
+    GList* sessions;
+#ifdef SMARTCAM_HEADLESS
+    GMainLoop* mainLoop;
+#else
+    DBusConnection* dbusConnection;
+    CUIHandler* pUIHandler;
+    // UI state published by the comm thread and the workers without taking
+    // the gdk lock; UIUpdateProc() shows it from the main loop:
+    GMutex* uiStateLock;
+    GdkPixbuf* uiFrame;
+    gboolean uiFrameDirty;
+    char uiFps[40];
+    gboolean uiFpsDirty;
+    int uiWidth;
+    int uiHeight;
+    gboolean uiResolutionDirty;
+    UIConnectionEvent uiConnectionEvent;
+    gboolean uiServerStopped;
+    volatile gint uiUpdatePending;
+    // Preview throttling: nothing is drawn while the main window is hidden
+    // or minimized, at most one frame per previewIntervalMillis otherwise
+    volatile gint previewVisible;
+    volatile gint previewEnabled;
+    volatile gint previewIntervalMillis;
+    unsigned long nextPreviewMillis;
+#endif
 };
 #endif//__SMART_ENGINE_H__
@@ -0,0 +1,380 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// StreamRecorder.cpp
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include "StreamRecorder.h"
+#include "SessionStats.h"
+
+static void put_be32(unsigned char* buffer, guint32 value)
+{
+    buffer[0] = (unsigned char) (value >> 24);
+    buffer[1] = (unsigned char) (value >> 16);
+    buffer[2] = (unsigned char) (value >> 8);
+    buffer[3] = (unsigned char) value;
+}
+
+static guint32 get_be32(const unsigned char* buffer)
+{
+    return ((guint32) buffer[0] << 24) | ((guint32) buffer[1] << 16) |
+           ((guint32) buffer[2] << 8) | (guint32) buffer[3];
+}
+
+// Constructor
+CStreamRecorder::CStreamRecorder():
+    file(NULL),
+    startMicros(0),
+    packetCount(0)
+{
+}
+
+// Destructor
+CStreamRecorder::~CStreamRecorder()
+{
+    Close();
+}
+
+int CStreamRecorder::Open(const char* fileName)
+{
+    file = fopen(fileName, "wb");
+    if(file == NULL)
+    {
+        printf("smartcam: could not create the recording %s: %s\n", fileName, strerror(errno));
+        return -1;
+    }
+    fwrite(SMARTCAM_RECORDING_MAGIC, 1, 8, file);
+    startMicros = CSessionStats::NowMicros();
+    packetCount = 0;
+    printf("smartcam: recording the phone stream to %s\n", fileName);
+    return 0;
+}
+
+void CStreamRecorder::Close()
+{
+    if(file != NULL)
+    {
+        fclose(file);
+        file = NULL;
+        printf("smartcam: recorded %u packets\n", packetCount);
+    }
+}
+
+void CStreamRecorder::RecordPacket(int sessionId, const unsigned char* header, const unsigned char* payload,
+                                   unsigned int length, gint64 timeMicros)
+{
+    unsigned char recordHeader[SMARTCAM_RECORD_HEADER_SIZE];
+    if(file == NULL)
+    {
+        return;
+    }
+    guint64 time = (guint64) (timeMicros - startMicros);
+    put_be32(recordHeader, (guint32) (time >> 32));
+    put_be32(recordHeader + 4, (guint32) time);
+    put_be32(recordHeader + 8, (guint32) sessionId);
+    memcpy(recordHeader + 12, header, 4);
+    if(fwrite(recordHeader, 1, sizeof(recordHeader), file) != sizeof(recordHeader) ||
+       fwrite(payload, 1, length, file) != length)
+    {
+        printf("smartcam: could not write the recording: %s\n", strerror(errno));
+        fclose(file);
+        file = NULL;
+        return;
+    }
+    packetCount++;
+}
+
+// Constructor
+CStreamReader::CStreamReader():
+    time(0),
+    sessionId(-1),
+    type(PACKET_JPEG_DATA),
+    payload(NULL),
+    length(0),
+    file(NULL),
+    maxLength(0)
+{
+}
+
+// Destructor
+CStreamReader::~CStreamReader()
+{
+    if(file != NULL)
+    {
+        fclose(file);
+    }
+    g_free(payload);
+}
+
+int CStreamReader::Open(const char* fileName)
+{
+    char magic[8];
+    file = fopen(fileName, "rb");
+    if(file == NULL)
+    {
+        printf("smartcam: could not open the recording %s: %s\n", fileName, strerror(errno));
+        return -1;
+    }
+    if(fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+       memcmp(magic, SMARTCAM_RECORDING_MAGIC, sizeof(magic)) != 0)
+    {
+        printf("smartcam: %s is not a smartcam recording\n", fileName);
+        return -1;
+    }
+    return 0;
+}
+
+int CStreamReader::ReadPacket(bool withPayload)
+{
+    unsigned char recordHeader[SMARTCAM_RECORD_HEADER_SIZE];
+    size_t count = fread(recordHeader, 1, sizeof(recordHeader), file);
+    if(count == 0)
+    {
+        return 0;
+    }
+    if(count != sizeof(recordHeader))
+    {
+        return -1;
+    }
+    time = (gint64) (((guint64) get_be32(recordHeader) << 32) | get_be32(recordHeader + 4));
+    sessionId = (int) get_be32(recordHeader + 8);
+    memcpy(header, recordHeader + 12, 4);
+    type = (SmartCamPacketType) header[0];
+    length = get_be32(header) & 0x00FFFFFF;
+    if(!withPayload)
+    {
+        return fseek(file, length, SEEK_CUR) == 0 ? 1 : -1;
+    }
+    if(length > maxLength)
+    {
+        payload = (unsigned char*) g_realloc(payload, length);
+        maxLength = length;
+    }
+    return fread(payload, 1, length, file) == length ? 1 : -1;
+}
+
+void CStreamReader::Rewind()
+{
+    fseek(file, strlen(SMARTCAM_RECORDING_MAGIC), SEEK_SET);
+}
+
+// Constructor
+CStreamReplayer::CStreamReplayer():
+    speed(1.0),
+    streamCount(0),
+    replayThread(NULL),
+    stopRequested(0),
+    done(0)
+{
+    for(int i = 0; i < MAX_REPLAY_STREAMS; i++)
+    {
+        streamIds[i] = -1;
+        feedSockets[i] = -1;
+        engineSockets[i] = -1;
+    }
+}
+
+// Destructor
+CStreamReplayer::~CStreamReplayer()
+{
+    Stop();
+    for(int i = 0; i < streamCount; i++)
+    {
+        if(feedSockets[i] != -1)
+        {
+            close(feedSockets[i]);
+        }
+    }
+}
+
+int CStreamReplayer::FindStream(int sessionId)
+{
+    for(int i = 0; i < streamCount; i++)
+    {
+        if(streamIds[i] == sessionId)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Checks the recording and opens one connection per recorded session
+int CStreamReplayer::Open(const char* fileName, double replaySpeed)
+{
+    speed = replaySpeed;
+    if(reader.Open(fileName) != 0)
+    {
+        return -1;
+    }
+    while(reader.ReadPacket(false) > 0)
+    {
+        if(FindStream(reader.sessionId) < 0)
+        {
+            int sockets[2];
+            if(streamCount == MAX_REPLAY_STREAMS)
+            {
+                printf("smartcam: the recording has more than %d sessions\n", MAX_REPLAY_STREAMS);
+                return -1;
+            }
+            if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) < 0)
+            {
+                printf("smartcam: could not create a replay connection: %s\n", strerror(errno));
+                return -1;
+            }
+            // the engine side is served like an accepted socket
+            fcntl(sockets[1], F_SETFL, fcntl(sockets[1], F_GETFL, NULL) | O_NONBLOCK);
+            streamIds[streamCount] = reader.sessionId;
+            feedSockets[streamCount] = sockets[0];
+            engineSockets[streamCount] = sockets[1];
+            streamCount++;
+        }
+    }
+    reader.Rewind();
+    printf("smartcam: replaying %s, %d sessions, speed %.1f\n", fileName, streamCount, speed);
+    return 0;
+}
+int CStreamReplayer::GetStreamCount()
+{
+    return streamCount;
+}
+
+int CStreamReplayer::GetStreamSocket(int index)
+{
+    return engineSockets[index];
+}
+
+int CStreamReplayer::Start()
+{
+    GError* error = NULL;
+    replayThread = g_thread_create(ReplayThreadProc, this, TRUE, &error);
+    if(replayThread == NULL)
+    {
+        g_printerr("Failed to create replay thread: %s\n", error->message);
+        g_error_free(error);
+        return -1;
+    }
+    return 0;
+}
+
+void CStreamReplayer::Stop()
+{
+    g_atomic_int_set(&stopRequested, TRUE);
+    if(replayThread != NULL)
+    {
+        g_thread_join(replayThread);
+        replayThread = NULL;
+    }
+}
+
+bool CStreamReplayer::IsDone()
+{
+    return g_atomic_int_get(&done);
+}
+
+gpointer CStreamReplayer::ReplayThreadProc(gpointer data)
+{
+    ((CStreamReplayer*) data)->Replay();
+    return NULL;
+}
+
+// Blocks while the session socket is full, like a phone on a slow link
+int CStreamReplayer::SendAll(int stream, const unsigned char* data, unsigned int length)
+{
+    while(length > 0)
+    {
+        ssize_t sent = send(feedSockets[stream], data, length, MSG_NOSIGNAL);
+        if(sent < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+void CStreamReplayer::Replay()
+{
+    unsigned int packetCount = 0;
+    guint64 byteCount = 0;
+    gint64 startMicros = CSessionStats::NowMicros();
+    // the wait for the phone before the first packet is not replayed
+    gint64 firstTime = -1;
+    int result = 0;
+
+    while(!g_atomic_int_get(&stopRequested) && (result = reader.ReadPacket()) > 0)
+    {
+        int stream = FindStream(reader.sessionId);
+        if(firstTime < 0)
+        {
+            firstTime = reader.time;
+        }
+        if(speed > 0)
+        {
+            gint64 dueMicros = startMicros + (gint64) ((reader.time - firstTime) / speed);
+            gint64 now = CSessionStats::NowMicros();
+            while(now < dueMicros && !g_atomic_int_get(&stopRequested))
+            {
+                g_usleep(MIN(dueMicros - now, G_USEC_PER_SEC / 10));
+                now = CSessionStats::NowMicros();
+            }
+        }
+        // a session closed by the engine just stops receiving
+        if(feedSockets[stream] == -1)
+        {
+            continue;
+        }
+        if(SendAll(stream, reader.header, 4) != 0 || SendAll(stream, reader.payload, reader.length) != 0)
+        {
+            close(feedSockets[stream]);
+            feedSockets[stream] = -1;
+            continue;
+        }
+        packetCount++;
+        byteCount += 4 + reader.length;
+    }
+    if(result < 0)
+    {
+        printf("smartcam: the recording is truncated\n");
+    }
+
+    // end of the recording: the sessions see the phones disconnect
+    for(int i = 0; i < streamCount; i++)
+    {
+        if(feedSockets[i] != -1)
+        {
+            close(feedSockets[i]);
+            feedSockets[i] = -1;
+        }
+    }
+    double seconds = (CSessionStats::NowMicros() - startMicros) / (double) G_USEC_PER_SEC;
+    printf("smartcam: replayed %u packets, %llu bytes in %.2f s\n", packetCount,
+           (unsigned long long) byteCount, seconds);
+    g_atomic_int_set(&done, TRUE);
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// StreamRecorder.h
+
+#ifndef __STREAM_RECORDER_H__
+#define __STREAM_RECORDER_H__
+
+#include <stdio.h>
+#include <glib.h>
+
+#include "CommHandler.h"
+
+// Recording file layout, all integers big endian like the wire header:
+//   8 bytes magic, SMARTCAM_RECORDING_MAGIC
+//   then one record per received packet:
+//     8 bytes  time the packet was complete, microseconds since the recording started
+//     4 bytes  session id
+//     4 bytes  packet header as sent by the phone (type, 24 bit length)
+//     payload
+#define SMARTCAM_RECORDING_MAGIC "SCAMREC1"
+#define SMARTCAM_RECORD_HEADER_SIZE 16
+
+// Sessions a recording can hold, one replayed connection each
+#define MAX_REPLAY_STREAMS 8
+
+// Writes the packets received from the phones to a recording file.
+// RecordPacket() is called by the comm thread only.
+class CStreamRecorder
+{
+public:
+    CStreamRecorder();
+    virtual ~CStreamRecorder();
+    int Open(const char* fileName);
+    void Close();
+    void RecordPacket(int sessionId, const unsigned char* header, const unsigned char* payload,
+                      unsigned int length, gint64 timeMicros);
+
+private:
+    FILE* file;
+    gint64 startMicros;
+    unsigned int packetCount;
+};
+
+// Reads the packets of a recording in order
+class CStreamReader
+{
+public:
+    CStreamReader();
+    virtual ~CStreamReader();
+    int Open(const char* fileName);
+    // 1 when a packet was read, 0 at the end of the recording, -1 if it is
+    // truncated. Without withPayload only the record header is read.
+    int ReadPacket(bool withPayload = true);
+    void Rewind();
+
+    // The packet read last, payload belongs to the reader
+    gint64 time;
+    int sessionId;
+    unsigned char header[4];
+    SmartCamPacketType type;
+    unsigned char* payload;
+    unsigned int length;
+
+private:
+    FILE* file;
+    unsigned int maxLength;
+};
+
+// Plays a recording back into the engine: every recorded session gets one
+// end of a socket pair that is served like an accepted phone connection,
+// a feeder thread writes the packets into the other end. speed 1 keeps the
+// recorded timing, N plays N times faster, 0 as fast as the engine reads.
+class CStreamReplayer
+{
+public:
+    CStreamReplayer();
+    virtual ~CStreamReplayer();
+    int Open(const char* fileName, double speed);
+    int GetStreamCount();
+    // Engine end of a replayed connection, non blocking, owned by the session
+    int GetStreamSocket(int index);
+    int Start();
+    void Stop();
+    bool IsDone();
+
+private:
+    // Methods:
+    int FindStream(int sessionId);
+    int SendAll(int stream, const unsigned char* data, unsigned int length);
+    void Replay();
+    static gpointer ReplayThreadProc(gpointer data);
+    // Data:
+    CStreamReader reader;
+    double speed;
+    int streamCount;
+    int streamIds[MAX_REPLAY_STREAMS];
+    int feedSockets[MAX_REPLAY_STREAMS];
+    int engineSockets[MAX_REPLAY_STREAMS];
+    GThread* replayThread;
+    volatile gint stopRequested;
+    volatile gint done;
+};
+
+#endif//__STREAM_RECORDER_H__
@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Tracer.cpp
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "Tracer.h"
+
+struct CTracer::ThreadBuffer
+{
+    int threadId;
+    char threadName[32];
+    TraceEvent* events;
+    unsigned int count;     // events recorded, the ring holds the last ones
+};
+
+bool CTracer::enabled = false;
+char* CTracer::traceFileName = NULL;
+GPrivate* CTracer::threadBuffer = NULL;
+GMutex* CTracer::buffersLock = NULL;
+GList* CTracer::buffers = NULL;
+int CTracer::nextThreadId = 1;
+
+int CTracer::Start(const char* fileName)
+{
+    if(enabled)
+    {
+        return 0;
+    }
+    traceFileName = g_strdup(fileName);
+    threadBuffer = g_private_new(NULL);
+    buffersLock = g_mutex_new();
+    enabled = true;
+    SetThreadName("main");
+    printf("smartcam: tracing frames to %s\n", traceFileName);
+    return 0;
+}
+
+void CTracer::Stop()
+{
+    if(!enabled)
+    {
+        return;
+    }
+    enabled = false;
+    FILE* file = fopen(traceFileName, "w");
+    if(file == NULL)
+    {
+        printf("smartcam: could not write the trace to %s: %s\n", traceFileName, strerror(errno));
+    }
+    else
+    {
+        WriteTrace(file);
+        fclose(file);
+        printf("smartcam: trace written to %s\n", traceFileName);
+    }
+    for(GList* it = buffers; it != NULL; it = it->next)
+    {
+        ThreadBuffer* pBuffer = (ThreadBuffer*) it->data;
+        delete[] pBuffer->events;
+        delete pBuffer;
+    }
+    g_list_free(buffers);
+    buffers = NULL;
+    g_free(traceFileName);
+    traceFileName = NULL;
+    // idle pool threads may still point to the freed buffers: the next
+    // Start() gets a new GPrivate, this one can not be freed with this API
+    threadBuffer = NULL;
+}
+
+CTracer::ThreadBuffer* CTracer::GetThreadBuffer()
+{
+    ThreadBuffer* pBuffer = (ThreadBuffer*) g_private_get(threadBuffer);
+    if(pBuffer == NULL)
+    {
+        pBuffer = new ThreadBuffer;
+        pBuffer->events = new TraceEvent[SMARTCAM_TRACE_EVENTS_PER_THREAD];
+        pBuffer->count = 0;
+        g_mutex_lock(buffersLock);
+        pBuffer->threadId = nextThreadId++;
+        buffers = g_list_append(buffers, pBuffer);
+        g_mutex_unlock(buffersLock);
+        snprintf(pBuffer->threadName, sizeof(pBuffer->threadName), "worker %d", pBuffer->threadId);
+        g_private_set(threadBuffer, pBuffer);
+    }
+    return pBuffer;
+}
+
+void CTracer::SetThreadName(const char* name)
+{
+    if(!enabled)
+    {
+        return;
+    }
+    ThreadBuffer* pBuffer = GetThreadBuffer();
+    snprintf(pBuffer->threadName, sizeof(pBuffer->threadName), "%s", name);
+}
+
+void CTracer::Record(const char* name, gint64 start, gint64 end, int sessionId, int frameId)
+{
+    ThreadBuffer* pBuffer = GetThreadBuffer();
+    TraceEvent* pEvent = &pBuffer->events[pBuffer->count % SMARTCAM_TRACE_EVENTS_PER_THREAD];
+    pEvent->name = name;
+    pEvent->start = start;
+    pEvent->duration = end - start;
+    pEvent->sessionId = sessionId;
+    pEvent->frameId = frameId;
+    pBuffer->count++;
+}
+
+// Chrome trace event format: complete ("X") events plus thread names
+void CTracer::WriteTrace(FILE* file)
+{
+    bool first = true;
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for(GList* it = buffers; it != NULL; it = it->next)
+    {
+        ThreadBuffer* pBuffer = (ThreadBuffer*) it->data;
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", pBuffer->threadId, pBuffer->threadName);
+        first = false;
+        unsigned int count = MIN(pBuffer->count, (unsigned int) SMARTCAM_TRACE_EVENTS_PER_THREAD);
+        for(unsigned int i = pBuffer->count - count; i < pBuffer->count; i++)
+        {
+            TraceEvent* pEvent = &pBuffer->events[i % SMARTCAM_TRACE_EVENTS_PER_THREAD];
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%lld,\"dur\":%lld,"
+                    "\"args\":{\"session\":%d,\"frame\":%d}}",
+                    pEvent->name, pBuffer->threadId, (long long) pEvent->start, (long long) pEvent->duration,
+                    pEvent->sessionId, pEvent->frameId);
+        }
+    }
+    fprintf(file, "\n]}\n");
+}
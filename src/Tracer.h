@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Tracer.h
+
+#ifndef __TRACER_H__
+#define __TRACER_H__
+
+#include <stdio.h>
+#include <glib.h>
+
+#include "SessionStats.h"
+
+// Events kept per thread, the oldest ones are overwritten
+#define SMARTCAM_TRACE_EVENTS_PER_THREAD 32768
+
+typedef struct TraceEvent
+{
+    const char* name;   // static string
+    gint64 start;       // monotonic, microseconds
+    gint64 duration;
+    int sessionId;
+    int frameId;
+} TraceEvent;
+
+// Opt-in frame timeline. Every thread records complete events into its own
+// ring buffer without locking; Stop() writes them all to a Chrome trace
+// (JSON) file that chrome://tracing and Perfetto load. Start() must be called
+// before the comm thread and the workers start, Stop() after they stopped.
+class CTracer
+{
+public:
+    static int Start(const char* fileName);
+    static void Stop();
+    static bool IsEnabled()
+    {
+        return enabled;
+    }
+    // Names the calling thread in the trace
+    static void SetThreadName(const char* name);
+    static void Record(const char* name, gint64 start, gint64 end, int sessionId, int frameId);
+
+private:
+    struct ThreadBuffer;
+    static ThreadBuffer* GetThreadBuffer();
+    static void WriteTrace(FILE* file);
+
+    static bool enabled;
+    static char* traceFileName;
+    static GPrivate* threadBuffer;
+    static GMutex* buffersLock;
+    static GList* buffers;
+    static int nextThreadId;
+};
+
+// Times the enclosing scope. With tracing off it costs one predictable branch.
+class CTraceScope
+{
+public:
+    CTraceScope(const char* eventName, int session = -1, int frame = -1):
+        name(eventName),
+        sessionId(session),
+        frameId(frame),
+        start(0)
+    {
+        if(G_UNLIKELY(CTracer::IsEnabled()))
+        {
+            start = CSessionStats::NowMicros();
+        }
+    }
+
+    ~CTraceScope()
+    {
+        if(G_UNLIKELY(start != 0))
+        {
+            CTracer::Record(name, start, CSessionStats::NowMicros(), sessionId, frameId);
+        }
+    }
+
+    // For scopes that only learn which frame they handled on the way
+    void SetFrame(int session, int frame)
+    {
+        sessionId = session;
+        frameId = frame;
+    }
+
+private:
+    const char* name;
+    int sessionId;
+    int frameId;
+    gint64 start;
+};
+
+#endif//__TRACER_H__
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// TurboJpegHandler.cpp
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_TURBOJPEG
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "TurboJpegHandler.h"
+#include "FramePool.h"
+
+CTurboJpegHandler::CTurboJpegHandler()
+{
+    handle = tjInitDecompress();
+    scalingFactorsCount = 0;
+    scalingFactors = tjGetScalingFactors(&scalingFactorsCount);
+    if (scalingFactors == NULL)
+        scalingFactorsCount = 0;
+
+    rgbBuffer = NULL;
+    rgbBufferSize = 0;
+    yuvBuffer = NULL;
+    yuvBufferSize = 0;
+}
+
+CTurboJpegHandler::~CTurboJpegHandler()
+{
+    if (handle != NULL)
+        tjDestroy(handle);
+    free(rgbBuffer);
+    free(yuvBuffer);
+}
+
+const char* CTurboJpegHandler::getName()
+{
+    return "turbojpeg";
+}
+
+// A tables-only stream leaves width and height at 0 and keeps the tables
+// in the handle for the abbreviated frames that follow (libjpeg-turbo 2.1+)
+bool CTurboJpegHandler::decodeHeader(const unsigned char* buffer, int size)
+{
+    int width = 0, height = 0, subsamp = 0, colorspace = 0;
+    if (handle == NULL)
+        return false;
+    if (tjDecompressHeader3(handle, buffer, size, &width, &height, &subsamp, &colorspace) != 0) {
+        printf("Error: %s\n", tjGetErrorStr2(handle));
+        return false;
+    }
+    return true;
+}
+
+// Same rule as the libjpeg backend: smallest scaled size not smaller than the
+// target, never above full size (TurboJPEG also offers factors up to 2/1)
+void CTurboJpegHandler::selectScale(int width, int height, int targetWidth, int targetHeight, int &outWidth, int &outHeight)
+{
+    outWidth = width;
+    outHeight = height;
+    if (targetWidth <= 0 || targetHeight <= 0)
+        return;
+    for (int i = 0; i < scalingFactorsCount; i++)
+    {
+        if (scalingFactors[i].num > scalingFactors[i].denom)
+            continue;
+        int w = TJSCALED(width, scalingFactors[i]);
+        int h = TJSCALED(height, scalingFactors[i]);
+        if (w >= targetWidth && h >= targetHeight && w * h < outWidth * outHeight)
+        {
+            outWidth = w;
+            outHeight = h;
+        }
+    }
+}
+
+unsigned char* CTurboJpegHandler::decodeRGB24(const unsigned char* buffer, int size, int targetWidth, int targetHeight,
+                                              int &width, int &height, int &outWidth, int &outHeight)
+{
+    int subsamp = 0, colorspace = 0;
+    if (handle == NULL)
+        return NULL;
+    if (tjDecompressHeader3(handle, buffer, size, &width, &height, &subsamp, &colorspace) != 0) {
+        printf("Error: %s\n", tjGetErrorStr2(handle));
+        return NULL;
+    }
+    selectScale(width, height, targetWidth, targetHeight, outWidth, outHeight);
+
+    if (rgbBuffer == NULL || rgbBufferSize < 3 * outWidth * outHeight) {
+        rgbBufferSize = 3 * outWidth * outHeight;
+        CFramePool::CountAllocation();
+        free(rgbBuffer);
+        rgbBuffer = (unsigned char*) malloc(rgbBufferSize);
+    }
+
+    // warnings (e.g. a truncated frame) still produce an image
+    if (tjDecompress2(handle, buffer, size, rgbBuffer, outWidth, 3 * outWidth, outHeight, TJPF_RGB, 0) != 0 &&
+        tjGetErrorCode(handle) != TJERR_WARNING) {
+        printf("Error: %s\n", tjGetErrorStr2(handle));
+        return NULL;
+    }
+    return rgbBuffer;
+}
+
+bool CTurboJpegHandler::decodeYUV(const unsigned char* buffer, int size, int targetWidth, int targetHeight,
+                                  int &width, int &height, YUVImage& image)
+{
+    int subsamp = 0, colorspace = 0, outWidth = 0, outHeight = 0;
+    if (handle == NULL)
+        return false;
+    if (tjDecompressHeader3(handle, buffer, size, &width, &height, &subsamp, &colorspace) != 0) {
+        printf("Error: %s\n", tjGetErrorStr2(handle));
+        return false;
+    }
+    if (colorspace != TJCS_YCbCr || subsamp == TJSAMP_GRAY)
+        return false;
+    selectScale(width, height, targetWidth, targetHeight, outWidth, outHeight);
+
+    int needed = 0;
+    for (int c = 0; c < 3; c++)
+    {
+        image.widths[c] = tjPlaneWidth(c, outWidth, subsamp);
+        image.heights[c] = tjPlaneHeight(c, outHeight, subsamp);
+        image.strides[c] = image.widths[c];
+        needed += image.widths[c] * image.heights[c];
+    }
+    if (yuvBuffer == NULL || yuvBufferSize < needed) {
+        yuvBufferSize = needed;
+        CFramePool::CountAllocation();
+        free(yuvBuffer);
+        yuvBuffer = (unsigned char*) malloc(yuvBufferSize);
+    }
+    image.planes[0] = yuvBuffer;
+    image.planes[1] = image.planes[0] + image.strides[0] * image.heights[0];
+    image.planes[2] = image.planes[1] + image.strides[1] * image.heights[1];
+
+    if (tjDecompressToYUVPlanes(handle, buffer, size, image.planes, outWidth, image.strides, outHeight, 0) != 0 &&
+        tjGetErrorCode(handle) != TJERR_WARNING) {
+        printf("Error: %s\n", tjGetErrorStr2(handle));
+        return false;
+    }
+    return true;
+}
+
+#endif//HAVE_TURBOJPEG
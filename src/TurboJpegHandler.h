@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// TurboJpegHandler.h
+
+#ifndef __TURBO_JPEG_HANDLER_H__
+#define __TURBO_JPEG_HANDLER_H__
+
+#include <turbojpeg.h>
+
+#include "JpegDecoder.h"
+
+// libjpeg-turbo backend: decodes whole frames with the SIMD code paths
+// instead of going through the scanline API
+class CTurboJpegHandler : public CJpegDecoder
+{
+public:
+    CTurboJpegHandler();
+    ~CTurboJpegHandler();
+
+    const char* getName();
+
+    bool decodeHeader(const unsigned char* buffer, int size);
+
+    unsigned char* decodeRGB24(const unsigned char* buffer, int size, int targetWidth, int targetHeight,
+                               int &width, int &height, int &outWidth, int &outHeight);
+
+    bool decodeYUV(const unsigned char* buffer, int size, int targetWidth, int targetHeight,
+                   int &width, int &height, YUVImage& image);
+
+private:
+    tjhandle handle;
+    tjscalingfactor* scalingFactors;
+    int scalingFactorsCount;
+
+    unsigned char* rgbBuffer;
+    int rgbBufferSize;
+    unsigned char* yuvBuffer;
+    int yuvBufferSize;
+
+    void selectScale(int width, int height, int targetWidth, int targetHeight, int &outWidth, int &outHeight);
+};
+
+#endif//__TURBO_JPEG_HANDLER_H__
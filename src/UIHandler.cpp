@@ -38,6 +38,7 @@ const char* CUIHandler::TRAY_TOOLTIP_NO_NETWORK = "SmartCam - No available netwo
 const char* CUIHandler::SMARTCAM_WND_TITLE = "SmartCam";
 const char* CUIHandler::STATUS_MSG_DISCONNECTED = "Disconnected";
 const char* CUIHandler::STATUS_MSG_CONNECTED = "Connected";
+const char* CUIHandler::STATUS_MSG_SERVER_STOPPED = "Server stopped";
 const char* CUIHandler::STATUS_LABEL_FPS = "FPS:";
 const char* CUIHandler::STATUS_LABEL_RESOLUTION = "Resolution:";
 
@@ -63,6 +64,11 @@ static void track_minimize(GtkWidget *widget, GdkEventWindowState *event, gpoint
     }
 }
 
+static void track_visibility(GtkWidget *widget, gpointer data)
+{
+    g_pEngine->OnMainWndVisibilityChanged();
+}
+
 static void status_activate(GtkStatusIcon* stat_icon, gpointer user_data)
 {
     gboolean main_wnd_visible = FALSE;
@@ -155,6 +161,7 @@ CUIHandler::CUIHandler(CSmartEngine* pEngine):
         connectedTrayIcon(NULL),
         disconnectedTrayIcon(NULL),
         logoIcon(NULL),
+        previewPixbuf(NULL),
         mainWindow(NULL),
         trayMenu(NULL),
         toolbar(NULL),
@@ -237,6 +244,9 @@ int CUIHandler::CreateMainWnd()
     g_signal_connect(G_OBJECT(mainWindow), "delete_event", G_CALLBACK(delete_event), NULL);
     g_signal_connect(G_OBJECT(mainWindow), "destroy", G_CALLBACK(destroy), NULL);
     g_signal_connect(G_OBJECT(mainWindow), "window_state_event", G_CALLBACK(track_minimize), NULL);
+    // the preview is not rendered while the window is hidden to the tray
+    g_signal_connect_after(G_OBJECT(mainWindow), "show", G_CALLBACK(track_visibility), NULL);
+    g_signal_connect_after(G_OBJECT(mainWindow), "hide", G_CALLBACK(track_visibility), NULL);
 
     gtk_window_set_title(GTK_WINDOW(mainWindow), SMARTCAM_WND_TITLE);
     gtk_container_set_border_width(GTK_CONTAINER(mainWindow), 1);
@@ -396,18 +406,28 @@ int CUIHandler::CreateMainWnd()
     return 0;
 }
 
-void CUIHandler::OnRadiobuttonBluetooth(GtkToggleButton* btn, GtkWidget* portWidget)
+void CUIHandler::OnRadiobuttonConnection(GtkToggleButton* btn, GtkWidget* optionWidget)
 {
     if(gtk_toggle_button_get_active(btn))
     {
-        g_object_set(G_OBJECT(portWidget), "sensitive", FALSE, NULL);
+        g_object_set(G_OBJECT(optionWidget), "sensitive", TRUE, NULL);
     }
     else
     {
-        g_object_set(G_OBJECT(portWidget), "sensitive", TRUE, NULL);
+        g_object_set(G_OBJECT(optionWidget), "sensitive", FALSE, NULL);
     }
 }
 
+// A local socket needs a path, OK stays disabled until there is one
+void CUIHandler::OnUnixPathChanged(GtkWidget* widget, GtkWidget* settingsDlg)
+{
+    GtkWidget* radiobuttonUnix = GTK_WIDGET(g_object_get_data(G_OBJECT(settingsDlg), "radiobuttonUnix"));
+    GtkWidget* unixPath = GTK_WIDGET(g_object_get_data(G_OBJECT(settingsDlg), "unixPath"));
+    gboolean pathMissing = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(radiobuttonUnix)) &&
+                           gtk_entry_get_text(GTK_ENTRY(unixPath))[0] == '\0';
+    gtk_dialog_set_response_sensitive(GTK_DIALOG(settingsDlg), GTK_RESPONSE_OK, !pathMissing);
+}
+
 void CUIHandler::ShowSettingsDlg(void)
 {
     GtkWidget* settingsDlg;
@@ -420,7 +440,12 @@ void CUIHandler::ShowSettingsDlg(void)
     GtkWidget* radiobuttonInet;
     GtkWidget* label5;
     GtkWidget* inetPort;
+    GtkWidget* hbox3;
+    GtkWidget* radiobuttonUnix;
+    GtkWidget* label6;
+    GtkWidget* unixPath;
     GtkWidget* label4;
+    GtkWidget* checkLowLatency;
     GtkWidget* dialog_action_area1;
 
     CUserSettings crtSettings = pSmartEngine->GetSettings();
@@ -464,28 +489,56 @@ void CUIHandler::ShowSettingsDlg(void)
     inetPort = gtk_spin_button_new_with_range(1025, 65536, 1);
     gtk_box_pack_start(GTK_BOX(hbox2), inetPort, TRUE, TRUE, 0);
 
+    hbox3 = gtk_hbox_new(FALSE, 0);
+    gtk_widget_show(hbox3);
+    gtk_box_pack_start(GTK_BOX (vbox2), hbox3, TRUE, TRUE, 0);
+
+    radiobuttonUnix = gtk_radio_button_new_with_mnemonic_from_widget(GTK_RADIO_BUTTON(radiobuttonBt), "Local socket (USB)");
+    gtk_box_pack_start(GTK_BOX (hbox3), radiobuttonUnix, FALSE, FALSE, 0);
+
+    label6 = gtk_label_new("    Path: ");
+    gtk_box_pack_start(GTK_BOX(hbox3), label6, FALSE, FALSE, 0);
+
+    unixPath = gtk_entry_new();
+    gtk_entry_set_max_length(GTK_ENTRY(unixPath), SMARTCAM_UNIX_PATH_MAX - 1);
+    g_object_set(G_OBJECT(unixPath), "tooltip-text", "Socket file, or @name for an abstract socket (adb reverse localabstract:name)", NULL);
+    gtk_box_pack_start(GTK_BOX(hbox3), unixPath, TRUE, TRUE, 0);
+
     label4 = gtk_label_new("Connection");
     gtk_frame_set_label_widget(GTK_FRAME(frame4), label4);
     gtk_label_set_use_markup(GTK_LABEL(label4), TRUE);
 
+    checkLowLatency = gtk_check_button_new_with_mnemonic("_Low latency (drop stale frames)");
+    gtk_box_pack_start(GTK_BOX(dialog_vbox1), checkLowLatency, FALSE, FALSE, 6);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(checkLowLatency), crtSettings.lowLatency);
+
     dialog_action_area1 = GTK_DIALOG(settingsDlg)->action_area;
     gtk_button_box_set_layout(GTK_BUTTON_BOX(dialog_action_area1), GTK_BUTTONBOX_END);
 
-    g_signal_connect(G_OBJECT(radiobuttonBt), "toggled", G_CALLBACK(OnRadiobuttonBluetooth), inetPort);
-    
+    g_signal_connect(G_OBJECT(radiobuttonInet), "toggled", G_CALLBACK(OnRadiobuttonConnection), inetPort);
+    g_signal_connect(G_OBJECT(radiobuttonUnix), "toggled", G_CALLBACK(OnRadiobuttonConnection), unixPath);
+    g_object_set_data(G_OBJECT(settingsDlg), "radiobuttonUnix", radiobuttonUnix);
+    g_object_set_data(G_OBJECT(settingsDlg), "unixPath", unixPath);
+    g_signal_connect(G_OBJECT(radiobuttonUnix), "toggled", G_CALLBACK(OnUnixPathChanged), settingsDlg);
+    g_signal_connect(G_OBJECT(unixPath), "changed", G_CALLBACK(OnUnixPathChanged), settingsDlg);
+
     if(crtSettings.connectionType == CONN_BLUETOOTH)
     {
         gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(radiobuttonBt), TRUE);
-        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(radiobuttonInet), FALSE);
-        g_object_set(G_OBJECT(inetPort), "sensitive", FALSE, NULL);
+    }
+    else if(crtSettings.connectionType == CONN_UNIX)
+    {
+        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(radiobuttonUnix), TRUE);
     }
     else
     {
-        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(radiobuttonBt), FALSE);
         gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(radiobuttonInet), TRUE);
-        g_object_set(G_OBJECT(inetPort), "sensitive", TRUE, NULL);
     }
+    g_object_set(G_OBJECT(inetPort), "sensitive", crtSettings.connectionType == CONN_INET, NULL);
+    g_object_set(G_OBJECT(unixPath), "sensitive", crtSettings.connectionType == CONN_UNIX, NULL);
     gtk_spin_button_set_value(GTK_SPIN_BUTTON(inetPort), crtSettings.inetPort);
+    gtk_entry_set_text(GTK_ENTRY(unixPath), crtSettings.unixSocketPath);
+    OnUnixPathChanged(unixPath, settingsDlg);
     gtk_widget_show_all(settingsDlg);
 
     if(gtk_dialog_run(GTK_DIALOG(settingsDlg)) == GTK_RESPONSE_OK)
@@ -495,24 +548,51 @@ void CUIHandler::ShowSettingsDlg(void)
         {
             newSettings.connectionType = CONN_BLUETOOTH;
         }
-        else
+        else if(gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(radiobuttonUnix)))
+        {
+            newSettings.connectionType = CONN_UNIX;
+            newSettings.SetUnixSocketPath(gtk_entry_get_text(GTK_ENTRY(unixPath)));
+        }
+        else if(gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(radiobuttonInet)))
         {
             newSettings.connectionType = CONN_INET;
             newSettings.inetPort = gtk_spin_button_get_value(GTK_SPIN_BUTTON(inetPort));
         }
+        newSettings.lowLatency = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(checkLowLatency));
         pSmartEngine->SaveSettings(newSettings);
     }
     gtk_widget_destroy(settingsDlg);
 }
 
+// The frame goes back to its pool after this, the image keeps its own copy
 void CUIHandler::DrawFrame(GdkPixbuf* frame)
 {
-    gtk_image_set_from_pixbuf(GTK_IMAGE(image), frame);
+    int width = gdk_pixbuf_get_width(frame);
+    int height = gdk_pixbuf_get_height(frame);
+    if(previewPixbuf == NULL ||
+       gdk_pixbuf_get_width(previewPixbuf) != width || gdk_pixbuf_get_height(previewPixbuf) != height)
+    {
+        if(previewPixbuf != NULL)
+        {
+            g_object_unref(previewPixbuf);
+        }
+        previewPixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+    }
+    gdk_pixbuf_copy_area(frame, 0, 0, width, height, previewPixbuf, 0, 0);
+    if(gtk_image_get_pixbuf(GTK_IMAGE(image)) != previewPixbuf)
+    {
+        gtk_image_set_from_pixbuf(GTK_IMAGE(image), previewPixbuf);
+    }
     gtk_widget_queue_draw(image);
 }
 
 void CUIHandler::Cleanup()
 {
+    if(previewPixbuf != NULL)
+    {
+        g_object_unref(previewPixbuf);
+        previewPixbuf = NULL;
+    }
     DestroyIcons();
 }
 
@@ -526,7 +606,6 @@ void CUIHandler::Msg(const char *fmt, ...)
 
 void CUIHandler::UpdateOnDisconnected()
 {
-    gdk_threads_enter();
     printf("smartcam: disconnected\n");
     gtk_image_set_from_pixbuf(GTK_IMAGE(image), logoIcon);
     gtk_widget_queue_draw(image);
@@ -538,19 +617,24 @@ void CUIHandler::UpdateOnDisconnected()
     gtk_label_set_text(GTK_LABEL(statusbarLabelConnection), STATUS_MSG_DISCONNECTED);
     gtk_label_set_text(GTK_LABEL(statusbarLabelFps), STATUS_LABEL_FPS);
     gtk_label_set_text(GTK_LABEL(statusbarLabelResolution), STATUS_LABEL_RESOLUTION);
-    gdk_threads_leave();
 }
 
 void CUIHandler::UpdateOnConnected()
 {
-    gdk_threads_enter();
     gtk_status_icon_set_from_pixbuf(trayIcon, connectedTrayIcon);
     gtk_status_icon_set_tooltip(trayIcon, TRAY_TOOLTIP_CONNECTED);
     g_object_set(G_OBJECT(tbSettings), "sensitive", FALSE, NULL);    // disable settings
     g_object_set(G_OBJECT(miSettings), "sensitive", FALSE, NULL);
     g_object_set(G_OBJECT(tbDisconnect), "sensitive", TRUE, NULL);   // enable disconnect
     gtk_label_set_text(GTK_LABEL(statusbarLabelConnection), STATUS_MSG_CONNECTED);
-    gdk_threads_leave();
+}
+
+// Connected phones stay, the settings can restart the server
+void CUIHandler::UpdateOnServerStopped()
+{
+    g_object_set(G_OBJECT(tbSettings), "sensitive", TRUE, NULL);    // enable settings
+    g_object_set(G_OBJECT(miSettings), "sensitive", TRUE, NULL);
+    gtk_label_set_text(GTK_LABEL(statusbarLabelConnection), STATUS_MSG_SERVER_STOPPED);
 }
 
 void CUIHandler::UpdateOnNoNetwork()
@@ -38,6 +38,7 @@ public:
     void DrawFrame(GdkPixbuf* frame);
     void UpdateOnDisconnected();
     void UpdateOnConnected();
+    void UpdateOnServerStopped();
     void UpdateOnNoNetwork();
     GtkWidget* GetMainWindow();
     void ShowMainWindow();
@@ -69,7 +70,9 @@ private:
 	// signal handlers:
 	static void OnSettingsClicked(GtkToolButton *toolbutton, gint index);
 	static void OnDisconnectClicked(GtkToolButton *toolbutton, gint index);
-    static void OnRadiobuttonBluetooth(GtkToggleButton* btn, GtkWidget* portWidget);
+    // Enables the option widget of a connection type while its radio button is active
+    static void OnRadiobuttonConnection(GtkToggleButton* btn, GtkWidget* optionWidget);
+    static void OnUnixPathChanged(GtkWidget* widget, GtkWidget* settingsDlg);
     // Data:
     CSmartEngine* pSmartEngine;
     gboolean isMainWndMinimized;
@@ -82,6 +85,8 @@ private:
     GdkPixbuf* connectedTrayIcon;
     GdkPixbuf* disconnectedTrayIcon;
     GdkPixbuf* logoIcon;
+    // Shown image while streaming, frames are copied in it
+    GdkPixbuf* previewPixbuf;
 
     // widgets:
     GtkWidget* mainWindow;
@@ -110,6 +115,7 @@ private:
     static const char* SMARTCAM_WND_TITLE;
     static const char* STATUS_MSG_DISCONNECTED;
     static const char* STATUS_MSG_CONNECTED;
+    static const char* STATUS_MSG_SERVER_STOPPED;
     static const char* STATUS_LABEL_FPS;
     static const char* STATUS_LABEL_RESOLUTION;
 };
@@ -20,21 +20,44 @@
 // UserSettings.cpp
 
 #include <stdio.h>
+#include <string.h>
+#ifdef SMARTCAM_HEADLESS
+#include <glib.h>
+#else
 #include <gconf/gconf-client.h>
+#endif
 
 #include "UserSettings.h"
 
 // Constructor, loads with default user settings
 CUserSettings::CUserSettings():
     connectionType(SMARTCAM_DEFAULT_CONNECTION_TYPE),
-    inetPort(SMARTCAM_DEFAULT_INET_PORT)
+    inetPort(SMARTCAM_DEFAULT_INET_PORT),
+    decodeDropPolicy(SMARTCAM_DEFAULT_DECODE_DROP_POLICY),
+    outputDropPolicy(SMARTCAM_DEFAULT_OUTPUT_DROP_POLICY),
+    lowLatency(SMARTCAM_DEFAULT_LOW_LATENCY),
+    jpegBackend(SMARTCAM_DEFAULT_JPEG_BACKEND),
+    yuvPipeline(SMARTCAM_DEFAULT_YUV_PIPELINE),
+    colorMatrix(SMARTCAM_DEFAULT_COLOR_MATRIX),
+    previewFps(SMARTCAM_DEFAULT_PREVIEW_FPS),
+    targetFps(SMARTCAM_DEFAULT_TARGET_FPS)
 {
+    SetUnixSocketPath(SMARTCAM_DEFAULT_UNIX_SOCKET_PATH);
 }
 
 CUserSettings::CUserSettings(const CUserSettings& settings):
     connectionType(settings.connectionType),
-    inetPort(settings.inetPort)
+    inetPort(settings.inetPort),
+    decodeDropPolicy(settings.decodeDropPolicy),
+    outputDropPolicy(settings.outputDropPolicy),
+    lowLatency(settings.lowLatency),
+    jpegBackend(settings.jpegBackend),
+    yuvPipeline(settings.yuvPipeline),
+    colorMatrix(settings.colorMatrix),
+    previewFps(settings.previewFps),
+    targetFps(settings.targetFps)
 {
+    SetUnixSocketPath(settings.unixSocketPath);
 }
 
 CUserSettings& CUserSettings::operator=(const CUserSettings& settings)
@@ -43,6 +66,15 @@ CUserSettings& CUserSettings::operator=(const CUserSettings& settings)
     {
         connectionType = settings.connectionType;
         inetPort = settings.inetPort;
+        SetUnixSocketPath(settings.unixSocketPath);
+        decodeDropPolicy = settings.decodeDropPolicy;
+        outputDropPolicy = settings.outputDropPolicy;
+        lowLatency = settings.lowLatency;
+        jpegBackend = settings.jpegBackend;
+        yuvPipeline = settings.yuvPipeline;
+        colorMatrix = settings.colorMatrix;
+        previewFps = settings.previewFps;
+        targetFps = settings.targetFps;
     }
     return *this;
 }
@@ -51,6 +83,96 @@ CUserSettings::~CUserSettings()
 {
 }
 
+void CUserSettings::SetUnixSocketPath(const char* path)
+{
+    snprintf(unixSocketPath, sizeof(unixSocketPath), "%s", path);
+}
+
+#ifdef SMARTCAM_HEADLESS
+// Keys missing from the file are left alone
+static gboolean get_int_key(GKeyFile* keyFile, const char* key, int& value)
+{
+    GError* error = NULL;
+    int result = g_key_file_get_integer(keyFile, SMARTCAM_KEY_FILE_GROUP, key, &error);
+    if(error != NULL)
+    {
+        if(error->code != G_KEY_FILE_ERROR_KEY_NOT_FOUND && error->code != G_KEY_FILE_ERROR_GROUP_NOT_FOUND)
+        {
+            printf("smartcam: ignoring %s: %s\n", key, error->message);
+        }
+        g_error_free(error);
+        return FALSE;
+    }
+    value = result;
+    return TRUE;
+}
+
+static gboolean get_bool_key(GKeyFile* keyFile, const char* key, bool& value)
+{
+    GError* error = NULL;
+    gboolean result = g_key_file_get_boolean(keyFile, SMARTCAM_KEY_FILE_GROUP, key, &error);
+    if(error != NULL)
+    {
+        if(error->code != G_KEY_FILE_ERROR_KEY_NOT_FOUND && error->code != G_KEY_FILE_ERROR_GROUP_NOT_FOUND)
+        {
+            printf("smartcam: ignoring %s: %s\n", key, error->message);
+        }
+        g_error_free(error);
+        return FALSE;
+    }
+    value = result;
+    return TRUE;
+}
+
+static gboolean get_string_key(GKeyFile* keyFile, const char* key, char* value, int valueLen)
+{
+    GError* error = NULL;
+    gchar* result = g_key_file_get_string(keyFile, SMARTCAM_KEY_FILE_GROUP, key, &error);
+    if(error != NULL)
+    {
+        if(error->code != G_KEY_FILE_ERROR_KEY_NOT_FOUND && error->code != G_KEY_FILE_ERROR_GROUP_NOT_FOUND)
+        {
+            printf("smartcam: ignoring %s: %s\n", key, error->message);
+        }
+        g_error_free(error);
+        return FALSE;
+    }
+    snprintf(value, valueLen, "%s", result);
+    g_free(result);
+    return TRUE;
+}
+
+int CUserSettings::LoadKeyFile(const char* fileName, CUserSettings& settings)
+{
+    GError* error = NULL;
+    GKeyFile* keyFile = g_key_file_new();
+    if(!g_key_file_load_from_file(keyFile, fileName, G_KEY_FILE_NONE, &error))
+    {
+        printf("smartcam: could not read %s: %s\n", fileName, error->message);
+        g_error_free(error);
+        g_key_file_free(keyFile);
+        return -1;
+    }
+    int val = 0;
+    if(get_int_key(keyFile, "connection_type", val))
+        settings.connectionType = (ConnectionType)val;
+    get_int_key(keyFile, "inet_port", settings.inetPort);
+    get_string_key(keyFile, "unix_socket_path", settings.unixSocketPath, sizeof(settings.unixSocketPath));
+    if(get_int_key(keyFile, "decode_drop_policy", val))
+        settings.decodeDropPolicy = (FrameDropPolicy)val;
+    if(get_int_key(keyFile, "output_drop_policy", val))
+        settings.outputDropPolicy = (FrameDropPolicy)val;
+    get_bool_key(keyFile, "low_latency", settings.lowLatency);
+    if(get_int_key(keyFile, "jpeg_backend", val))
+        settings.jpegBackend = (JpegBackend)val;
+    get_bool_key(keyFile, "yuv_pipeline", settings.yuvPipeline);
+    if(get_int_key(keyFile, "color_matrix", val))
+        settings.colorMatrix = (ColorMatrix)val;
+    get_int_key(keyFile, "target_fps", settings.targetFps);
+    g_key_file_free(keyFile);
+    return 0;
+}
+#else
 CUserSettings CUserSettings::LoadSettings()
 {
     CUserSettings regSettings; // default settings constructor
@@ -75,6 +197,96 @@ CUserSettings CUserSettings::LoadSettings()
         }
         gconf_value_free(val);
     }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "unix_socket_path", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is a string
+        if(val->type == GCONF_VALUE_STRING)
+        {
+            regSettings.SetUnixSocketPath(gconf_value_get_string(val));
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "decode_drop_policy", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is an integer
+        if(val->type == GCONF_VALUE_INT)
+        {
+            regSettings.decodeDropPolicy = (FrameDropPolicy)gconf_value_get_int(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "output_drop_policy", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is an integer
+        if(val->type == GCONF_VALUE_INT)
+        {
+            regSettings.outputDropPolicy = (FrameDropPolicy)gconf_value_get_int(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "low_latency", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is a boolean
+        if(val->type == GCONF_VALUE_BOOL)
+        {
+            regSettings.lowLatency = gconf_value_get_bool(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "jpeg_backend", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is an integer
+        if(val->type == GCONF_VALUE_INT)
+        {
+            regSettings.jpegBackend = (JpegBackend)gconf_value_get_int(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "yuv_pipeline", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is a boolean
+        if(val->type == GCONF_VALUE_BOOL)
+        {
+            regSettings.yuvPipeline = gconf_value_get_bool(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "color_matrix", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is an integer
+        if(val->type == GCONF_VALUE_INT)
+        {
+            regSettings.colorMatrix = (ColorMatrix)gconf_value_get_int(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "preview_fps", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is an integer
+        if(val->type == GCONF_VALUE_INT)
+        {
+            regSettings.previewFps = gconf_value_get_int(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
+    val = gconf_client_get_without_default(gcClient , SMARTCAM_GCONF_ROOT "target_fps", NULL);
+    if(val != NULL)
+    {
+        // Check whether the value stored behind the key is an integer
+        if(val->type == GCONF_VALUE_INT)
+        {
+            regSettings.targetFps = gconf_value_get_int(val);
+        }
+        gconf_value_free(val);
+    }//if NULL val was not present in GConf db
 
     g_object_unref(gcClient);
     return regSettings;
@@ -91,5 +303,42 @@ void CUserSettings::SaveSettings(CUserSettings settings)
     {
         printf("smartcam: failed to set %s/inet_port to %d\n", SMARTCAM_GCONF_ROOT, settings.inetPort);
     }
+    if(!gconf_client_set_string(gcClient , SMARTCAM_GCONF_ROOT "unix_socket_path", settings.unixSocketPath, NULL))
+    {
+        printf("smartcam: failed to set %s/unix_socket_path to %s\n", SMARTCAM_GCONF_ROOT, settings.unixSocketPath);
+    }
+    if(!gconf_client_set_int(gcClient , SMARTCAM_GCONF_ROOT "decode_drop_policy", settings.decodeDropPolicy, NULL))
+    {
+        printf("smartcam: failed to set %s/decode_drop_policy to %d\n", SMARTCAM_GCONF_ROOT, settings.decodeDropPolicy);
+    }
+    if(!gconf_client_set_int(gcClient , SMARTCAM_GCONF_ROOT "output_drop_policy", settings.outputDropPolicy, NULL))
+    {
+        printf("smartcam: failed to set %s/output_drop_policy to %d\n", SMARTCAM_GCONF_ROOT, settings.outputDropPolicy);
+    }
+    if(!gconf_client_set_bool(gcClient , SMARTCAM_GCONF_ROOT "low_latency", settings.lowLatency, NULL))
+    {
+        printf("smartcam: failed to set %s/low_latency to %d\n", SMARTCAM_GCONF_ROOT, settings.lowLatency);
+    }
+    if(!gconf_client_set_int(gcClient , SMARTCAM_GCONF_ROOT "jpeg_backend", settings.jpegBackend, NULL))
+    {
+        printf("smartcam: failed to set %s/jpeg_backend to %d\n", SMARTCAM_GCONF_ROOT, settings.jpegBackend);
+    }
+    if(!gconf_client_set_bool(gcClient , SMARTCAM_GCONF_ROOT "yuv_pipeline", settings.yuvPipeline, NULL))
+    {
+        printf("smartcam: failed to set %s/yuv_pipeline to %d\n", SMARTCAM_GCONF_ROOT, settings.yuvPipeline);
+    }
+    if(!gconf_client_set_int(gcClient , SMARTCAM_GCONF_ROOT "color_matrix", settings.colorMatrix, NULL))
+    {
+        printf("smartcam: failed to set %s/color_matrix to %d\n", SMARTCAM_GCONF_ROOT, settings.colorMatrix);
+    }
+    if(!gconf_client_set_int(gcClient , SMARTCAM_GCONF_ROOT "preview_fps", settings.previewFps, NULL))
+    {
+        printf("smartcam: failed to set %s/preview_fps to %d\n", SMARTCAM_GCONF_ROOT, settings.previewFps);
+    }
+    if(!gconf_client_set_int(gcClient , SMARTCAM_GCONF_ROOT "target_fps", settings.targetFps, NULL))
+    {
+        printf("smartcam: failed to set %s/target_fps to %d\n", SMARTCAM_GCONF_ROOT, settings.targetFps);
+    }
     g_object_unref(gcClient);
 }
+#endif//SMARTCAM_HEADLESS
@@ -23,12 +23,39 @@
 #define __USER_SETTINGS_H__
 
 #define SMARTCAM_GCONF_ROOT "/apps/smartcam/"
+// Group of the smartcamd key file, the keys are named as in GConf
+#define SMARTCAM_KEY_FILE_GROUP "smartcam"
+// Room for sun_path; a leading '@' names a socket in the abstract namespace
+#define SMARTCAM_UNIX_PATH_MAX 108
+#define SMARTCAM_DEFAULT_UNIX_SOCKET_PATH "@smartcam"
 
 typedef enum ConnectionType {
     CONN_BLUETOOTH = 0,
-    CONN_INET = 1
+    CONN_INET = 1,
+    CONN_UNIX = 2       // local socket, e.g. forwarded over USB with adb
 } ConnectionType;
 
+// What a pipeline stage does with frames it can not keep up with
+typedef enum FrameDropPolicy {
+    DROP_NEWEST = 0,    // process every queued frame, drop incoming ones while the queue is full
+    DROP_OLDEST = 1     // skip queued frames that already have a newer one behind them
+} FrameDropPolicy;
+
+// Jpeg decoder implementation
+typedef enum JpegBackend {
+    JPEG_BACKEND_AUTO = 0,      // pick the fastest one at startup
+    JPEG_BACKEND_LIBJPEG = 1,   // libjpeg scanline API
+    JPEG_BACKEND_TURBOJPEG = 2  // libjpeg-turbo TurboJPEG API
+} JpegBackend;
+
+// RGB to YCbCr matrix of the frames written in the driver: full range BT.601
+// (V4L2 JPEG colorspace) or limited range BT.709 (V4L2 REC709); drivers since
+// 0.5.1 report it to the consumer, older ones get BT.601
+typedef enum ColorMatrix {
+    COLOR_MATRIX_BT601 = 0,
+    COLOR_MATRIX_BT709 = 1
+} ColorMatrix;
+
 class CUserSettings
 {
     friend class CSmartEngine;
@@ -37,14 +64,44 @@ public:
     CUserSettings(const CUserSettings& settings);
     CUserSettings& operator=(const CUserSettings& settings);
     virtual ~CUserSettings();
+    // Truncated to SMARTCAM_UNIX_PATH_MAX - 1 characters
+    void SetUnixSocketPath(const char* path);
     ConnectionType connectionType;
     int inetPort;
+    char unixSocketPath[SMARTCAM_UNIX_PATH_MAX];
+    FrameDropPolicy decodeDropPolicy;
+    FrameDropPolicy outputDropPolicy;
+    // Latest frame wins: skip stale frames instead of letting latency grow
+    bool lowLatency;
+    JpegBackend jpegBackend;
+    // Decode to YCbCr and write YUYV when the consumer captures YUYV
+    bool yuvPipeline;
+    ColorMatrix colorMatrix;
+    // Preview redraws per second while the main window is shown, 0 for every frame
+    int previewFps;
+    // Frames per second written to the device, 0 for as many as arrive
+    int targetFps;
+
+#ifdef SMARTCAM_HEADLESS
+    // Overwrites the settings found in the key file, returns -1 if it can not be read
+    static int LoadKeyFile(const char* fileName, CUserSettings& settings);
+#endif
 
 private:
+#ifndef SMARTCAM_HEADLESS
     static CUserSettings LoadSettings();
     static void SaveSettings(CUserSettings settings);
+#endif
     // Default settings:
     static const ConnectionType SMARTCAM_DEFAULT_CONNECTION_TYPE = CONN_BLUETOOTH;
     static const int SMARTCAM_DEFAULT_INET_PORT = 9361;
+    static const FrameDropPolicy SMARTCAM_DEFAULT_DECODE_DROP_POLICY = DROP_NEWEST;
+    static const FrameDropPolicy SMARTCAM_DEFAULT_OUTPUT_DROP_POLICY = DROP_OLDEST;
+    static const bool SMARTCAM_DEFAULT_LOW_LATENCY = false;
+    static const JpegBackend SMARTCAM_DEFAULT_JPEG_BACKEND = JPEG_BACKEND_AUTO;
+    static const bool SMARTCAM_DEFAULT_YUV_PIPELINE = true;
+    static const ColorMatrix SMARTCAM_DEFAULT_COLOR_MATRIX = COLOR_MATRIX_BT601;
+    static const int SMARTCAM_DEFAULT_PREVIEW_FPS = 10;
+    static const int SMARTCAM_DEFAULT_TARGET_FPS = 0;
 };
 #endif//__USER_SETTINGS_H__
@@ -0,0 +1,471 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// smartcam-bench.cpp
+// Microbenchmarks of the frame path: jpeg decode, scaling, color conversion
+// and the device write, each alone and chained like in CSession. Results go
+// to stdout as one JSON object per line so runs of different builds or CPUs
+// can be compared with a script; progress goes to stderr. mb_per_s counts
+// the input of the step: jpeg bytes for decodes and pipelines, pixel bytes
+// for the others. allocs_per_frame counts CFramePool::CountAllocation().
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "SmartEngine.h"
+#include "JpegDecoder.h"
+#include "JpegEncoder.h"
+#include "ColorConvert.h"
+#include "FramePool.h"
+#include "SessionStats.h"
+#include "StreamRecorder.h"
+#include "smartcam.h"
+
+// frames of each synthetic corpus entry, a recording gives at most MAX
+#define BENCH_CORPUS_FRAMES 4
+#define BENCH_MAX_CORPUS_FRAMES 64
+#define BENCH_DEFAULT_MIN_MILLIS 500
+
+#define FRAME_WIDTH CSmartEngine::SMARTCAM_FRAME_WIDTH
+#define FRAME_HEIGHT CSmartEngine::SMARTCAM_FRAME_HEIGHT
+
+// the engine code linked in for WriteDeviceFrame() expects one
+CSmartEngine* g_pEngine = NULL;
+
+// Phone-like streams: tables once, then abbreviated frames
+typedef struct CorpusEntry
+{
+    char name[32];
+    unsigned char* header;
+    int headerSize;
+    unsigned char* frames[BENCH_MAX_CORPUS_FRAMES];
+    int frameSizes[BENCH_MAX_CORPUS_FRAMES];
+    int frameCount;
+} CorpusEntry;
+
+static const int corpusSizes[][2] = { {320, 240}, {640, 480}, {1280, 720}, {1920, 1080} };
+static const int corpusQualities[] = { 50, 75, 90 };
+
+static const char* simdNames[] = { "none", "sse2", "avx2" };
+static const char* backendNames[] = { "auto", "libjpeg", "turbojpeg" };
+
+// Buffers and state shared by the benchmark functions
+typedef struct BenchContext
+{
+    CorpusEntry* pEntry;
+    CJpegDecoder* pDecoder;
+    CColorConvert colorConvert;
+    // output of the last decode, input of the scale and pack benchmarks
+    unsigned char* decoded;
+    int decodedWidth;
+    int decodedHeight;
+    YUVImage image;
+    unsigned char* rgb;
+    unsigned char* yuyv;
+    int sinkFd;
+} BenchContext;
+
+// Runs the step on frame i of the corpus entry, returns the bytes it consumed
+typedef int (*BenchFunc)(BenchContext* ctx, int i);
+
+static gchar* recordingFile = NULL;
+static gchar* sinkPath = NULL;
+static gchar* backendName = NULL;
+static gchar* simdName = NULL;
+static gchar* filter = NULL;
+static gint minMillis = BENCH_DEFAULT_MIN_MILLIS;
+
+static GOptionEntry entries[] =
+{
+    { "recording", 'r', 0, G_OPTION_ARG_FILENAME, &recordingFile, "Also benchmark the frames of a smartcamd --record FILE", "FILE" },
+    { "device", 'd', 0, G_OPTION_ARG_FILENAME, &sinkPath, "Write the frames to PATH (default /dev/null)", "PATH" },
+    { "backend", 'b', 0, G_OPTION_ARG_STRING, &backendName, "libjpeg, turbojpeg or all (default)", "NAME" },
+    { "simd", 's', 0, G_OPTION_ARG_STRING, &simdName, "none, sse2 or avx2 (default: the best supported)", "LEVEL" },
+    { "filter", 'f', 0, G_OPTION_ARG_STRING, &filter, "Only run the benchmarks whose name contains TEXT", "TEXT" },
+    { "min-time", 't', 0, G_OPTION_ARG_INT, &minMillis, "Run each benchmark for at least MS milliseconds (default 500)", "MS" },
+    { NULL }
+};
+
+static void scale_to_frame(BenchContext* ctx)
+{
+    if(ctx->decodedWidth != FRAME_WIDTH || ctx->decodedHeight != FRAME_HEIGHT)
+    {
+        CColorConvert::scaleRGB24(ctx->decoded, ctx->decodedWidth * 3, ctx->decodedWidth, ctx->decodedHeight,
+                                  ctx->rgb, FRAME_WIDTH * 3, FRAME_WIDTH, FRAME_HEIGHT);
+    }
+    else
+    {
+        memcpy(ctx->rgb, ctx->decoded, FRAME_WIDTH * FRAME_HEIGHT * 3);
+    }
+}
+
+static int bench_decode_rgb24(BenchContext* ctx, int i)
+{
+    int w = 0, h = 0;
+    ctx->decoded = ctx->pDecoder->decodeRGB24(ctx->pEntry->frames[i], ctx->pEntry->frameSizes[i],
+                                              FRAME_WIDTH, FRAME_HEIGHT, w, h, ctx->decodedWidth, ctx->decodedHeight);
+    return ctx->pEntry->frameSizes[i];
+}
+
+static int bench_decode_yuv(BenchContext* ctx, int i)
+{
+    int w = 0, h = 0;
+    ctx->pDecoder->decodeYUV(ctx->pEntry->frames[i], ctx->pEntry->frameSizes[i],
+                             FRAME_WIDTH, FRAME_HEIGHT, w, h, ctx->image);
+    return ctx->pEntry->frameSizes[i];
+}
+
+static int bench_scale_rgb24(BenchContext* ctx, int i)
+{
+    scale_to_frame(ctx);
+    return ctx->decodedWidth * ctx->decodedHeight * 3;
+}
+
+static int bench_pack_yuyv(BenchContext* ctx, int i)
+{
+    ctx->colorConvert.packYUYV(ctx->image, ctx->yuyv, FRAME_WIDTH, FRAME_HEIGHT);
+    return ctx->image.widths[0] * ctx->image.heights[0] * 2;
+}
+
+static int bench_pack_nv12(BenchContext* ctx, int i)
+{
+    // NV12 is smaller than YUYV, the yuyv buffer holds it
+    ctx->colorConvert.packYUV420(ctx->image, ctx->yuyv, FRAME_WIDTH, FRAME_HEIGHT, true);
+    return ctx->image.widths[0] * ctx->image.heights[0] * 3 / 2;
+}
+
+static int bench_rgb24_to_yuyv(BenchContext* ctx, int i)
+{
+    CColorConvert::rgb24ToYUYV(ctx->rgb, FRAME_WIDTH * 3, ctx->yuyv, FRAME_WIDTH, FRAME_HEIGHT, COLOR_MATRIX_BT601);
+    return FRAME_WIDTH * FRAME_HEIGHT * 3;
+}
+
+static int bench_write_rgb24(BenchContext* ctx, int i)
+{
+    CSmartEngine::WriteDeviceFrame(ctx->sinkFd, (const char*) ctx->rgb, CSmartEngine::SMARTCAM_FRAME_SIZE);
+    return CSmartEngine::SMARTCAM_FRAME_SIZE;
+}
+
+static int bench_write_yuyv(BenchContext* ctx, int i)
+{
+    CSmartEngine::WriteDeviceFrame(ctx->sinkFd, (const char*) ctx->yuyv, CSmartEngine::SMARTCAM_YUYV_FRAME_SIZE);
+    return CSmartEngine::SMARTCAM_YUYV_FRAME_SIZE;
+}
+
+// Same steps as CSession::DecodeFrame() and OutputStage() for a YUYV device
+static int bench_pipeline_rgb(BenchContext* ctx, int i)
+{
+    int bytes = bench_decode_rgb24(ctx, i);
+    if(ctx->decoded != NULL)
+    {
+        scale_to_frame(ctx);
+        bench_rgb24_to_yuyv(ctx, i);
+        bench_write_yuyv(ctx, i);
+    }
+    return bytes;
+}
+
+// Same steps as CSession::DecodeFrameYUV() and OutputStage()
+static int bench_pipeline_yuv(BenchContext* ctx, int i)
+{
+    int bytes = bench_decode_yuv(ctx, i);
+    bench_pack_yuyv(ctx, i);
+    bench_write_yuyv(ctx, i);
+    return bytes;
+}
+
+static void json_escape(const char* text, char* out, int outSize)
+{
+    int length = 0;
+    for(; *text != '\0' && length < outSize - 2; text++)
+    {
+        if(*text == '"' || *text == '\\')
+        {
+            out[length++] = '\\';
+        }
+        out[length++] = (*text >= ' ') ? *text : ' ';
+    }
+    out[length] = '\0';
+}
+
+static void print_meta(const char* backends)
+{
+    char cpu[128] = "unknown";
+    char line[256];
+    char escaped[256];
+    FILE* cpuinfo = fopen("/proc/cpuinfo", "r");
+    if(cpuinfo != NULL)
+    {
+        while(fgets(line, sizeof(line), cpuinfo) != NULL)
+        {
+            char* value = strchr(line, ':');
+            if(strncmp(line, "model name", 10) == 0 && value != NULL)
+            {
+                snprintf(cpu, sizeof(cpu), "%s", value + 2);
+                cpu[strcspn(cpu, "\n")] = '\0';
+                break;
+            }
+        }
+        fclose(cpuinfo);
+    }
+    json_escape(cpu, escaped, sizeof(escaped));
+    printf("{\"meta\":{\"version\":\"%s\",\"cpu\":\"%s\",\"cpus\":%ld,\"simd\":\"%s\",\"backends\":\"%s\","
+           "\"frame_width\":%d,\"frame_height\":%d}}\n",
+           SMARTCAM_VERSION, escaped, sysconf(_SC_NPROCESSORS_ONLN), simdNames[CColorConvert::getSimdLevel()],
+           backends, FRAME_WIDTH, FRAME_HEIGHT);
+}
+
+static void run_benchmark(const char* name, const char* backend, BenchContext* ctx, BenchFunc func)
+{
+    char escaped[64];
+    if(filter != NULL && strstr(name, filter) == NULL)
+    {
+        return;
+    }
+    // warm up: the decoder and converter buffers grow on the first frames
+    for(int i = 0; i < ctx->pEntry->frameCount; i++)
+    {
+        func(ctx, i);
+    }
+    int allocations = CFramePool::GetAllocationCount();
+    gint64 bytes = 0;
+    int frames = 0;
+    gint64 elapsed = 0;
+    gint64 start = CSessionStats::NowMicros();
+    do
+    {
+        bytes += func(ctx, frames % ctx->pEntry->frameCount);
+        frames++;
+        elapsed = CSessionStats::NowMicros() - start;
+    } while(elapsed < (gint64) minMillis * 1000);
+    allocations = CFramePool::GetAllocationCount() - allocations;
+
+    json_escape(ctx->pEntry->name, escaped, sizeof(escaped));
+    printf("{\"bench\":\"%s\",\"corpus\":\"%s\",\"backend\":\"%s\",\"simd\":\"%s\",\"frames\":%d,"
+           "\"ns_per_frame\":%.0f,\"mb_per_s\":%.2f,\"allocs_per_frame\":%.3f}\n",
+           name, escaped, backend, simdNames[CColorConvert::getSimdLevel()], frames,
+           elapsed * 1000.0 / frames, bytes / (elapsed / 1e6) / (1024 * 1024), allocations / (double) frames);
+    fflush(stdout);
+}
+
+static int encode_corpus_entry(CorpusEntry* pEntry, int width, int height, int quality)
+{
+    CJpegEncoder encoder(width, height, quality);
+    unsigned char* rgb = new unsigned char[width * height * 3];
+    snprintf(pEntry->name, sizeof(pEntry->name), "%dx%dq%d", width, height, quality);
+    pEntry->header = encoder.encodeHeader(pEntry->headerSize);
+    for(pEntry->frameCount = 0; pEntry->frameCount < BENCH_CORPUS_FRAMES; pEntry->frameCount++)
+    {
+        CJpegEncoder::drawTestPattern(rgb, width, height, pEntry->frameCount);
+        pEntry->frames[pEntry->frameCount] = encoder.encodeFrame(rgb, pEntry->frameSizes[pEntry->frameCount]);
+    }
+    delete[] rgb;
+    return 0;
+}
+
+// The tables and the first frames of the first recorded session
+static int load_recording(CorpusEntry* pEntry, const char* fileName)
+{
+    CStreamReader reader;
+    int sessionId = -1;
+    if(reader.Open(fileName) != 0)
+    {
+        return -1;
+    }
+    snprintf(pEntry->name, sizeof(pEntry->name), "recording");
+    while(pEntry->frameCount < BENCH_MAX_CORPUS_FRAMES && reader.ReadPacket() > 0)
+    {
+        if(sessionId == -1)
+        {
+            sessionId = reader.sessionId;
+        }
+        if(reader.sessionId != sessionId)
+        {
+            continue;
+        }
+        unsigned char* data = (unsigned char*) malloc(reader.length);
+        memcpy(data, reader.payload, reader.length);
+        if(reader.type == PACKET_JPEG_HEDAER)
+        {
+            free(pEntry->header);
+            pEntry->header = data;
+            pEntry->headerSize = reader.length;
+        }
+        else
+        {
+            pEntry->frames[pEntry->frameCount] = data;
+            pEntry->frameSizes[pEntry->frameCount] = reader.length;
+            pEntry->frameCount++;
+        }
+    }
+    if(pEntry->frameCount == 0)
+    {
+        fprintf(stderr, "smartcam-bench: no frames in %s\n", fileName);
+        return -1;
+    }
+    return 0;
+}
+
+static void free_corpus_entry(CorpusEntry* pEntry)
+{
+    for(int i = 0; i < pEntry->frameCount; i++)
+    {
+        free(pEntry->frames[i]);
+    }
+    free(pEntry->header);
+}
+
+static void run_corpus_entry(CorpusEntry* pEntry, JpegBackend backend, BenchContext* ctx)
+{
+    const char* name = backendNames[backend];
+    fprintf(stderr, "smartcam-bench: %s, %s\n", pEntry->name, name);
+    ctx->pEntry = pEntry;
+    ctx->pDecoder = CJpegDecoder::create(backend);
+    if(pEntry->header != NULL)
+    {
+        ctx->pDecoder->decodeHeader(pEntry->header, pEntry->headerSize);
+    }
+    run_benchmark("decodeRGB24", name, ctx, bench_decode_rgb24);
+    if(ctx->decoded != NULL)
+    {
+        run_benchmark("scaleRGB24", name, ctx, bench_scale_rgb24);
+        run_benchmark("pipeline_rgb", name, ctx, bench_pipeline_rgb);
+    }
+    ctx->decoded = NULL;
+    int w = 0, h = 0;
+    if(ctx->pDecoder->decodeYUV(pEntry->frames[0], pEntry->frameSizes[0], FRAME_WIDTH, FRAME_HEIGHT, w, h, ctx->image))
+    {
+        run_benchmark("decodeYUV", name, ctx, bench_decode_yuv);
+        run_benchmark("packYUYV", name, ctx, bench_pack_yuyv);
+        run_benchmark("packNV12", name, ctx, bench_pack_nv12);
+        run_benchmark("pipeline_yuv", name, ctx, bench_pipeline_yuv);
+    }
+    delete ctx->pDecoder;
+    ctx->pDecoder = NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    GError* error = NULL;
+    GOptionContext* context = g_option_context_new("- SmartCam frame path benchmarks");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if(!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        fprintf(stderr, "smartcam-bench: %s\n", error->message);
+        g_error_free(error);
+        g_option_context_free(context);
+        return -1;
+    }
+    g_option_context_free(context);
+    g_thread_init(NULL);
+
+    if(simdName != NULL)
+    {
+        for(int level = SIMD_NONE; level <= SIMD_AVX2; level++)
+        {
+            if(strcmp(simdName, simdNames[level]) == 0)
+            {
+                CColorConvert::setSimdLevel((SimdLevel) level);
+            }
+        }
+    }
+    JpegBackend backends[2];
+    int backendCount = 0;
+    char backendList[64] = "";
+    for(int backend = JPEG_BACKEND_LIBJPEG; backend <= JPEG_BACKEND_TURBOJPEG; backend++)
+    {
+        if(CJpegDecoder::isAvailable((JpegBackend) backend) &&
+           (backendName == NULL || strcmp(backendName, "all") == 0 || strcmp(backendName, backendNames[backend]) == 0))
+        {
+            backends[backendCount++] = (JpegBackend) backend;
+            snprintf(backendList + strlen(backendList), sizeof(backendList) - strlen(backendList),
+                     "%s%s", backendCount > 1 ? "," : "", backendNames[backend]);
+        }
+    }
+    if(backendCount == 0)
+    {
+        fprintf(stderr, "smartcam-bench: jpeg decoder %s not available\n", backendName);
+        return -1;
+    }
+
+    BenchContext ctx;
+    ctx.decoded = NULL;
+    ctx.rgb = new unsigned char[CSmartEngine::SMARTCAM_FRAME_SIZE];
+    ctx.yuyv = new unsigned char[CSmartEngine::SMARTCAM_YUYV_FRAME_SIZE];
+    memset(ctx.rgb, 128, CSmartEngine::SMARTCAM_FRAME_SIZE);
+    ctx.sinkFd = open(sinkPath != NULL ? sinkPath : "/dev/null", O_WRONLY);
+    if(ctx.sinkFd == -1)
+    {
+        fprintf(stderr, "smartcam-bench: could not open %s: %s\n", sinkPath, strerror(errno));
+        return -1;
+    }
+    print_meta(backendList);
+
+    // steps that only depend on the output size
+    CorpusEntry frameEntry;
+    memset(&frameEntry, 0, sizeof(frameEntry));
+    snprintf(frameEntry.name, sizeof(frameEntry.name), "%dx%d", FRAME_WIDTH, FRAME_HEIGHT);
+    frameEntry.frameCount = 1;
+    ctx.pEntry = &frameEntry;
+    run_benchmark("rgb24ToYUYV", "none", &ctx, bench_rgb24_to_yuyv);
+    run_benchmark("WriteDeviceFrame_rgb24", "none", &ctx, bench_write_rgb24);
+    run_benchmark("WriteDeviceFrame_yuyv", "none", &ctx, bench_write_yuyv);
+
+    for(unsigned int s = 0; s < G_N_ELEMENTS(corpusSizes); s++)
+    {
+        for(unsigned int q = 0; q < G_N_ELEMENTS(corpusQualities); q++)
+        {
+            CorpusEntry entry;
+            memset(&entry, 0, sizeof(entry));
+            encode_corpus_entry(&entry, corpusSizes[s][0], corpusSizes[s][1], corpusQualities[q]);
+            for(int b = 0; b < backendCount; b++)
+            {
+                run_corpus_entry(&entry, backends[b], &ctx);
+            }
+            free_corpus_entry(&entry);
+        }
+    }
+    if(recordingFile != NULL)
+    {
+        CorpusEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        if(load_recording(&entry, recordingFile) == 0)
+        {
+            for(int b = 0; b < backendCount; b++)
+            {
+                run_corpus_entry(&entry, backends[b], &ctx);
+            }
+        }
+        free_corpus_entry(&entry);
+    }
+
+    close(ctx.sinkFd);
+    delete[] ctx.rgb;
+    delete[] ctx.yuyv;
+    g_free(recordingFile);
+    g_free(sinkPath);
+    g_free(backendName);
+    g_free(simdName);
+    g_free(filter);
+    return 0;
+}
@@ -0,0 +1,314 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// smartcam-perfgate.cpp
+// Performance regression gate: replays a stream through the headless engine
+// (receive, decode, convert and output stages, worker pool included) into a
+// file or /dev/null, then compares per-frame CPU time, heap allocations and
+// p99 stage latencies with the budgets in perf-budgets.conf. Exits with 1
+// when a budget is exceeded.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "SmartEngine.h"
+#include "JpegEncoder.h"
+#include "StreamRecorder.h"
+#include "SessionStats.h"
+
+#define PERFGATE_BUDGETS_GROUP "budgets"
+#define PERFGATE_STREAM_GROUP "stream"
+#define PERFGATE_SESSION_ID 1
+
+CSmartEngine* g_pEngine = NULL;
+
+// Heap allocations of the whole process, counted by interposing the glibc
+// allocator: an allocation per frame shows up wherever it is made, in our
+// code or in a library.
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+extern "C" void* __libc_memalign(size_t alignment, size_t size);
+
+static volatile gint heapAllocations = 0;
+
+extern "C" void* malloc(size_t size)
+{
+    g_atomic_int_inc(&heapAllocations);
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+    g_atomic_int_inc(&heapAllocations);
+    return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size)
+{
+    g_atomic_int_inc(&heapAllocations);
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" void* memalign(size_t alignment, size_t size)
+{
+    g_atomic_int_inc(&heapAllocations);
+    return __libc_memalign(alignment, size);
+}
+
+extern "C" int posix_memalign(void** ptr, size_t alignment, size_t size)
+{
+    g_atomic_int_inc(&heapAllocations);
+    *ptr = __libc_memalign(alignment, size);
+    return (*ptr != NULL) ? 0 : ENOMEM;
+}
+
+typedef struct StreamParams
+{
+    int width;
+    int height;
+    int quality;
+    int fps;
+    int frames;
+} StreamParams;
+
+static gchar* budgetsFile = NULL;
+static gchar* recordingFile = NULL;
+static gchar* outputFile = NULL;
+static gboolean outputRGB = FALSE;
+static gdouble replaySpeed = 1.0;
+
+static GOptionEntry entries[] =
+{
+    { "budgets", 'b', 0, G_OPTION_ARG_FILENAME, &budgetsFile, "Budgets and stream parameters (default perf-budgets.conf)", "FILE" },
+    { "recording", 'r', 0, G_OPTION_ARG_FILENAME, &recordingFile, "Replay FILE instead of the synthetic stream", "FILE" },
+    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &outputFile, "Write the frames to FILE (default /dev/null)", "FILE" },
+    { "rgb", 0, 0, G_OPTION_ARG_NONE, &outputRGB, "Write RGB24 frames instead of YUYV", NULL },
+    { "replay-speed", 's', 0, G_OPTION_ARG_DOUBLE, &replaySpeed, "Replay N times faster, 0 for as fast as possible (default 1)", "N" },
+    { NULL }
+};
+
+static gint64 cpu_micros()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (gint64) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * G_USEC_PER_SEC +
+           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static gboolean get_key(GKeyFile* keyFile, const char* group, const char* key, double& value)
+{
+    GError* error = NULL;
+    double result = g_key_file_get_double(keyFile, group, key, &error);
+    if(error != NULL)
+    {
+        if(error->code != G_KEY_FILE_ERROR_KEY_NOT_FOUND && error->code != G_KEY_FILE_ERROR_GROUP_NOT_FOUND)
+        {
+            printf("smartcam-perfgate: ignoring %s: %s\n", key, error->message);
+        }
+        g_error_free(error);
+        return FALSE;
+    }
+    value = result;
+    return TRUE;
+}
+
+static void get_int_key(GKeyFile* keyFile, const char* key, int& value)
+{
+    double result = 0;
+    if(get_key(keyFile, PERFGATE_STREAM_GROUP, key, result))
+    {
+        value = (int) result;
+    }
+}
+
+// The tables and frames of one phone, timed at the stream fps
+static int write_synthetic_recording(const char* fileName, const StreamParams& params)
+{
+    CStreamRecorder recorder;
+    CJpegEncoder encoder(params.width, params.height, params.quality);
+    unsigned char header[4];
+    unsigned char* rgb = new unsigned char[params.width * params.height * 3];
+    int size = 0;
+
+    if(recorder.Open(fileName) != 0)
+    {
+        delete[] rgb;
+        return -1;
+    }
+    gint64 start = CSessionStats::NowMicros();
+    unsigned char* data = encoder.encodeHeader(size);
+    header[0] = PACKET_JPEG_HEDAER;
+    header[1] = (unsigned char) (size >> 16);
+    header[2] = (unsigned char) (size >> 8);
+    header[3] = (unsigned char) size;
+    recorder.RecordPacket(PERFGATE_SESSION_ID, header, data, size, start);
+    free(data);
+    for(int i = 0; i < params.frames; i++)
+    {
+        CJpegEncoder::drawTestPattern(rgb, params.width, params.height, i);
+        data = encoder.encodeFrame(rgb, size);
+        header[0] = PACKET_JPEG_DATA;
+        header[1] = (unsigned char) (size >> 16);
+        header[2] = (unsigned char) (size >> 8);
+        header[3] = (unsigned char) size;
+        recorder.RecordPacket(PERFGATE_SESSION_ID, header, data, size,
+                              start + (gint64) (i + 1) * G_USEC_PER_SEC / params.fps);
+        free(data);
+    }
+    delete[] rgb;
+    return 0;
+}
+
+// Prints the measure against its budget, returns false when it is over
+static bool check_budget(GKeyFile* budgets, const char* key, double measured, bool isMinimum)
+{
+    double budget = 0;
+    if(!get_key(budgets, PERFGATE_BUDGETS_GROUP, key, budget))
+    {
+        printf("smartcam-perfgate: %-20s %12.3f\n", key, measured);
+        return true;
+    }
+    bool ok = isMinimum ? (measured >= budget) : (measured <= budget);
+    printf("smartcam-perfgate: %-20s %12.3f  budget %12.3f  %s\n", key, measured, budget, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    GError* error = NULL;
+    GOptionContext* context = g_option_context_new("- SmartCam performance regression gate");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if(!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        printf("smartcam-perfgate: %s\n", error->message);
+        g_error_free(error);
+        g_option_context_free(context);
+        return 2;
+    }
+    g_option_context_free(context);
+
+    GKeyFile* budgets = g_key_file_new();
+    const char* budgetsPath = budgetsFile != NULL ? budgetsFile : "perf-budgets.conf";
+    if(!g_key_file_load_from_file(budgets, budgetsPath, G_KEY_FILE_NONE, &error))
+    {
+        printf("smartcam-perfgate: could not read %s: %s\n", budgetsPath, error->message);
+        g_error_free(error);
+        return 2;
+    }
+    StreamParams params = { 640, 480, 75, 30, 300 };
+    get_int_key(budgets, "width", params.width);
+    get_int_key(budgets, "height", params.height);
+    get_int_key(budgets, "quality", params.quality);
+    get_int_key(budgets, "fps", params.fps);
+    get_int_key(budgets, "frames", params.frames);
+
+    g_thread_init(NULL);
+
+    char tmpName[] = "/tmp/smartcam-perfgate-XXXXXX";
+    const char* replayPath = recordingFile;
+    if(replayPath == NULL)
+    {
+        int fd = mkstemp(tmpName);
+        if(fd == -1)
+        {
+            printf("smartcam-perfgate: could not create the stream file\n");
+            return 2;
+        }
+        close(fd);
+        printf("smartcam-perfgate: %d frames %dx%d q%d at %d fps\n",
+               params.frames, params.width, params.height, params.quality, params.fps);
+        if(write_synthetic_recording(tmpName, params) != 0)
+        {
+            unlink(tmpName);
+            return 2;
+        }
+        replayPath = tmpName;
+    }
+
+    // default settings: the configuration of the host must not change the result
+    CUserSettings settings;
+    g_pEngine = new CSmartEngine();
+    g_pEngine->SetSettings(settings);
+    int result = g_pEngine->Initialize();
+    if(result == 0)
+        result = g_pEngine->OpenOutputFile(outputFile != NULL ? outputFile : "/dev/null", !outputRGB);
+    if(result == 0)
+        result = g_pEngine->OpenReplay(replayPath, replaySpeed);
+
+    // measured from here: startup (decoder selection, pools) is left out
+    gint64 cpuStart = cpu_micros();
+    int allocationsStart = g_atomic_int_get(&heapAllocations);
+    if(result == 0)
+        result = g_pEngine->StartCommThread();
+    if(result != 0)
+    {
+        g_pEngine->Cleanup(FALSE);
+        delete g_pEngine;
+        if(replayPath == tmpName)
+            unlink(tmpName);
+        return 2;
+    }
+    // returns when the replayed session is done
+    g_pEngine->Run();
+    gint64 cpuTime = cpu_micros() - cpuStart;
+    int allocations = g_atomic_int_get(&heapAllocations) - allocationsStart;
+
+    CSessionStats* pStats = g_pEngine->GetClosedSessionStats();
+    int framesWritten = pStats->GetFramesWritten();
+    int framesReceived = pStats->GetFramesReceived();
+    bool ok = true;
+    printf("smartcam-perfgate: %d frames received, %d written\n", framesReceived, framesWritten);
+    if(framesWritten == 0)
+    {
+        printf("smartcam-perfgate: no frame was written\n");
+        ok = false;
+    }
+    else
+    {
+        ok &= check_budget(budgets, "cpu_us_per_frame", cpuTime / (double) framesWritten, false);
+        ok &= check_budget(budgets, "allocs_per_frame", allocations / (double) framesWritten, false);
+        for(int i = 0; i < LATENCY_STAGE_COUNT; i++)
+        {
+            char key[32];
+            LatencySummary summary;
+            pStats->GetLatency((LatencyStage) i, summary);
+            snprintf(key, sizeof(key), "p99_%s_us", CSessionStats::STAGE_NAMES[i]);
+            ok &= check_budget(budgets, key, summary.p99, false);
+        }
+        ok &= check_budget(budgets, "min_written_ratio",
+                           framesReceived > 0 ? framesWritten / (double) framesReceived : 0.0, true);
+    }
+    printf("smartcam-perfgate: %s\n", ok ? "passed" : "FAILED");
+
+    delete g_pEngine;
+    g_key_file_free(budgets);
+    if(replayPath == tmpName)
+        unlink(tmpName);
+    g_free(budgetsFile);
+    g_free(recordingFile);
+    g_free(outputFile);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// smartcam-sim.cpp
+// Simulated phones for load and soak tests: connects any number of fake
+// phone clients to smartcam / smartcamd and reports the rate each one
+// achieved and how far behind schedule its frames were sent.
+
+#include <stdio.h>
+#include <signal.h>
+
+#include "PhoneSimulator.h"
+
+#define SIM_DEFAULT_PORT 9361
+
+static gchar* host = NULL;
+static gint port = SIM_DEFAULT_PORT;
+static gchar* unixPath = NULL;
+static gint phoneCount = 1;
+static gint width = 640;
+static gint height = 480;
+static gint quality = 75;
+static gint fps = 15;
+static gint jitterMillis = 0;
+static gint burstFrames = 1;
+static gint durationSeconds = 0;
+static gint clipFrames = 30;
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static GOptionEntry entries[] =
+{
+    { "host", 'H', 0, G_OPTION_ARG_STRING, &host, "Connect to HOST (default 127.0.0.1)", "HOST" },
+    { "port", 'p', 0, G_OPTION_ARG_INT, &port, "TCP port of the server (default 9361)", "PORT" },
+    { "unix", 'u', 0, G_OPTION_ARG_FILENAME, &unixPath, "Connect to the Unix socket PATH instead, @NAME for an abstract one", "PATH" },
+    { "phones", 'n', 0, G_OPTION_ARG_INT, &phoneCount, "Number of simulated phones (default 1)", "N" },
+    { "width", 'W', 0, G_OPTION_ARG_INT, &width, "Frame width (default 640)", "PIXELS" },
+    { "height", 'h', 0, G_OPTION_ARG_INT, &height, "Frame height (default 480)", "PIXELS" },
+    { "quality", 'q', 0, G_OPTION_ARG_INT, &quality, "Jpeg quality (default 75)", "1-100" },
+    { "fps", 'f', 0, G_OPTION_ARG_INT, &fps, "Frames per second per phone (default 15)", "FPS" },
+    { "jitter", 'j', 0, G_OPTION_ARG_INT, &jitterMillis, "Delay each frame by up to MS extra milliseconds", "MS" },
+    { "burst", 'b', 0, G_OPTION_ARG_INT, &burstFrames, "Send the frames in bursts of N, like a buffering link", "N" },
+    { "duration", 'd', 0, G_OPTION_ARG_INT, &durationSeconds, "Stop after SECONDS (default: run until interrupted)", "SECONDS" },
+    { "clip-frames", 0, 0, G_OPTION_ARG_INT, &clipFrames, "Distinct frames encoded up front (default 30)", "N" },
+    { NULL }
+};
+
+static void stop_handler(int signo)
+{
+    stopRequested = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    GError* error = NULL;
+    GOptionContext* context = g_option_context_new("- simulated SmartCam phones");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if(!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        printf("smartcam-sim: %s\n", error->message);
+        g_error_free(error);
+        g_option_context_free(context);
+        return -1;
+    }
+    g_option_context_free(context);
+    if(phoneCount < 1 || width < 16 || height < 16 || quality < 1 || quality > 100 || fps < 1 || clipFrames < 1)
+    {
+        printf("smartcam-sim: invalid option value\n");
+        return -1;
+    }
+
+    g_thread_init(NULL);
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+
+    CSimulatedClip clip;
+    if(clip.Encode(width, height, quality, clipFrames) != 0)
+    {
+        return -1;
+    }
+    printf("smartcam-sim: %d phones, %dx%d q%d at %d fps, %d bytes per frame\n",
+           phoneCount, width, height, quality, fps, clip.GetAverageFrameSize());
+
+    SimulatorOptions options;
+    options.host = host != NULL ? host : "127.0.0.1";
+    options.port = port;
+    options.unixPath = unixPath;
+    options.fps = fps;
+    options.jitterMillis = jitterMillis;
+    options.burstFrames = burstFrames;
+    options.durationSeconds = durationSeconds;
+
+    CPhoneSimulator** phones = new CPhoneSimulator*[phoneCount];
+    int started = 0;
+    for(int i = 0; i < phoneCount; i++)
+    {
+        phones[i] = new CPhoneSimulator(i, &options, &clip);
+        if(phones[i]->Start() == 0)
+        {
+            started++;
+        }
+    }
+
+    // one line per second with the totals, until every phone is done
+    gint64 startMicros = CSessionStats::NowMicros();
+    int lastFrames = 0;
+    int running = started;
+    while(running > 0 && !stopRequested)
+    {
+        g_usleep(G_USEC_PER_SEC);
+        int frames = 0;
+        gint64 bytes = 0;
+        running = 0;
+        for(int i = 0; i < phoneCount; i++)
+        {
+            frames += phones[i]->GetFramesSent();
+            bytes += phones[i]->GetBytesSent();
+            running += phones[i]->IsRunning() ? 1 : 0;
+        }
+        double seconds = (CSessionStats::NowMicros() - startMicros) / (double) G_USEC_PER_SEC;
+        printf("smartcam-sim: %.0f s, %d phones sending, %d fps, %.2f MB/s average\n",
+               seconds, running, frames - lastFrames, bytes / seconds / (1024 * 1024));
+        lastFrames = frames;
+    }
+
+    double seconds = (CSessionStats::NowMicros() - startMicros) / (double) G_USEC_PER_SEC;
+    int totalFrames = 0;
+    int totalLate = 0;
+    for(int i = 0; i < phoneCount; i++)
+    {
+        phones[i]->Stop();
+        phones[i]->Print(seconds);
+        totalFrames += phones[i]->GetFramesSent();
+        totalLate += phones[i]->GetFramesLate();
+        delete phones[i];
+    }
+    delete[] phones;
+    printf("smartcam-sim: %d of %d phones connected, %d frames in %.1f s, %.1f fps total, %d late\n",
+           started, phoneCount, totalFrames, seconds, seconds > 0 ? totalFrames / seconds : 0.0, totalLate);
+    g_free(host);
+    g_free(unixPath);
+
+    return started == phoneCount ? 0 : -1;
+}
@@ -17,7 +17,10 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdlib.h>
+
 #include "SmartEngine.h"
+#include "Tracer.h"
 
 CSmartEngine* g_pEngine = NULL;
 
@@ -29,6 +32,11 @@ int main(int argc, char *argv[])
 
     // init threads
     g_thread_init(NULL);
+    // frame timeline for chrome://tracing, see Tracer.h
+    if(getenv("SMARTCAM_TRACE") != NULL)
+    {
+        CTracer::Start(getenv("SMARTCAM_TRACE"));
+    }
     gdk_threads_init();
     gdk_threads_enter();
 
@@ -44,6 +52,11 @@ int main(int argc, char *argv[])
         delete g_pEngine;
         return -1;
     }
+    // raw phone stream for smartcamd --replay, see StreamRecorder.h
+    if(getenv("SMARTCAM_RECORD") != NULL)
+    {
+        g_pEngine->GetCommHandler()->StartRecording(getenv("SMARTCAM_RECORD"));
+    }
 
     result = g_pEngine->StartUI();
     if(result != 0)
@@ -65,6 +78,7 @@ int main(int argc, char *argv[])
     gdk_threads_leave();
 
     delete g_pEngine;
+    CTracer::Stop();
 
     return 0;
 }
@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// smartcamd.cpp
+// Headless SmartCam: same engine and comm code as smartcam, without GTK,
+// D-Bus, GConf or an X display. Settings come from a key file and the
+// command line.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "SmartEngine.h"
+#include "Tracer.h"
+#include "smartcam.h"
+
+#define SMARTCAMD_DEFAULT_CONFIG_FILE SYSCONFDIR "/smartcamd.conf"
+
+CSmartEngine* g_pEngine = NULL;
+
+static gchar* configFile = NULL;
+static gint inetPort = 0;
+static gboolean useBluetooth = FALSE;
+static gchar* unixPath = NULL;
+static gboolean lowLatency = FALSE;
+static gchar* traceFile = NULL;
+static gchar* recordFile = NULL;
+static gchar* replayFile = NULL;
+static gdouble replaySpeed = 1.0;
+static gchar* outputFile = NULL;
+static gboolean outputYUYV = FALSE;
+static gchar* outputSize = NULL;
+
+static GOptionEntry entries[] =
+{
+    { "config", 'c', 0, G_OPTION_ARG_FILENAME, &configFile, "Read the settings from FILE (default " SMARTCAMD_DEFAULT_CONFIG_FILE ")", "FILE" },
+    { "port", 'p', 0, G_OPTION_ARG_INT, &inetPort, "Wait for the phone on TCP port PORT", "PORT" },
+    { "bluetooth", 'b', 0, G_OPTION_ARG_NONE, &useBluetooth, "Wait for the phone on Bluetooth", NULL },
+    { "unix", 'u', 0, G_OPTION_ARG_FILENAME, &unixPath, "Wait for the phone on unix socket PATH, @NAME for an abstract one", "PATH" },
+    { "low-latency", 'l', 0, G_OPTION_ARG_NONE, &lowLatency, "Drop stale frames instead of letting latency grow", NULL },
+    { "record", 'r', 0, G_OPTION_ARG_FILENAME, &recordFile, "Record the phone stream to FILE", "FILE" },
+    { "replay", 0, 0, G_OPTION_ARG_FILENAME, &replayFile, "Serve the stream recorded in FILE instead of a phone, exit at its end", "FILE" },
+    { "replay-speed", 0, 0, G_OPTION_ARG_DOUBLE, &replaySpeed, "Replay N times faster than recorded, 0 for as fast as possible (default 1)", "N" },
+    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &outputFile, "Write the frames to FILE instead of the smartcam devices", "FILE" },
+    { "output-yuyv", 0, 0, G_OPTION_ARG_NONE, &outputYUYV, "Write YUYV frames to the --output file instead of RGB24", NULL },
+    { "output-size", 0, 0, G_OPTION_ARG_STRING, &outputSize, "Size of the frames written to the --output file (default 320x240)", "WxH" },
+    { "trace", 't', 0, G_OPTION_ARG_FILENAME, &traceFile, "Write a frame timeline for chrome://tracing to FILE on exit", "FILE" },
+    { NULL }
+};
+
+int main(int argc, char *argv[])
+{
+    int result = 0;
+
+    GError* error = NULL;
+    GOptionContext* context = g_option_context_new("- SmartCam headless server");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if(!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        printf("smartcamd: %s\n", error->message);
+        g_error_free(error);
+        g_option_context_free(context);
+        return -1;
+    }
+    g_option_context_free(context);
+
+    // key file first, the command line wins
+    CUserSettings settings;
+    if(configFile != NULL)
+    {
+        if(CUserSettings::LoadKeyFile(configFile, settings) != 0)
+        {
+            return -1;
+        }
+    }
+    else if(g_file_test(SMARTCAMD_DEFAULT_CONFIG_FILE, G_FILE_TEST_EXISTS))
+    {
+        CUserSettings::LoadKeyFile(SMARTCAMD_DEFAULT_CONFIG_FILE, settings);
+    }
+    if(inetPort > 0)
+    {
+        settings.connectionType = CONN_INET;
+        settings.inetPort = inetPort;
+    }
+    else if(useBluetooth)
+    {
+        settings.connectionType = CONN_BLUETOOTH;
+    }
+    else if(unixPath != NULL)
+    {
+        settings.connectionType = CONN_UNIX;
+        settings.SetUnixSocketPath(unixPath);
+    }
+    if(lowLatency)
+    {
+        settings.lowLatency = true;
+    }
+
+    // init threads
+    g_thread_init(NULL);
+    if(traceFile == NULL && getenv("SMARTCAM_TRACE") != NULL)
+    {
+        traceFile = g_strdup(getenv("SMARTCAM_TRACE"));
+    }
+    if(traceFile != NULL)
+    {
+        CTracer::Start(traceFile);
+    }
+
+    // Create the engine object
+    g_pEngine = new CSmartEngine();
+    g_pEngine->SetSettings(settings);
+
+    result = g_pEngine->Initialize();
+    if(result != 0)
+    {
+        g_pEngine->Cleanup(FALSE);
+        delete g_pEngine;
+        return -1;
+    }
+    if(recordFile != NULL && g_pEngine->GetCommHandler()->StartRecording(recordFile) != 0)
+    {
+        g_pEngine->Cleanup(FALSE);
+        delete g_pEngine;
+        return -1;
+    }
+    int outputWidth = CSmartEngine::SMARTCAM_FRAME_WIDTH;
+    int outputHeight = CSmartEngine::SMARTCAM_FRAME_HEIGHT;
+    if(outputSize != NULL && sscanf(outputSize, "%dx%d", &outputWidth, &outputHeight) != 2)
+    {
+        printf("smartcamd: --output-size takes WxH, e.g. 1280x720\n");
+        g_pEngine->Cleanup(FALSE);
+        delete g_pEngine;
+        return -1;
+    }
+    if(outputFile != NULL && g_pEngine->OpenOutputFile(outputFile, outputYUYV, outputWidth, outputHeight) != 0)
+    {
+        g_pEngine->Cleanup(FALSE);
+        delete g_pEngine;
+        return -1;
+    }
+    if(replayFile != NULL && g_pEngine->OpenReplay(replayFile, replaySpeed) != 0)
+    {
+        g_pEngine->Cleanup(FALSE);
+        delete g_pEngine;
+        return -1;
+    }
+
+    result = g_pEngine->StartCommThread();
+    if(result != 0)
+    {
+        g_pEngine->Cleanup(FALSE);
+        delete g_pEngine;
+        return -1;
+    }
+
+    if(replayFile != NULL)
+    {
+        printf("smartcamd: version %s, replaying %s\n", SMARTCAM_VERSION, replayFile);
+    }
+    else if(settings.connectionType == CONN_UNIX)
+    {
+        printf("smartcamd: version %s, waiting for the phone on unix socket %s\n", SMARTCAM_VERSION,
+               settings.unixSocketPath);
+    }
+    else
+    {
+        printf("smartcamd: version %s, waiting for the phone on %s\n", SMARTCAM_VERSION,
+               settings.connectionType == CONN_INET ? "TCP" : "Bluetooth");
+    }
+    // returns once SIGTERM or SIGINT went through ExitApp()
+    g_pEngine->Run();
+
+    delete g_pEngine;
+    CTracer::Stop();
+    g_free(configFile);
+    g_free(unixPath);
+    g_free(traceFile);
+    g_free(recordFile);
+    g_free(replayFile);
+    g_free(outputFile);
+    g_free(outputSize);
+
+    return 0;
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2009 Ionut Dediu <deionut@yahoo.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// test-colorconvert.cpp
+// Unit test run by "make check": every SIMD level of CColorConvert must give
+// the same bytes as the scalar code, for all output layouts and matrices.
+// Exits 77 (skipped) when the CPU has no SIMD level to compare.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/videodev2.h>
+
+#include "ColorConvert.h"
+
+#define TEST_SKIPPED 77
+// guard bytes around the output, a converter must not write past its frame
+#define GUARD_SIZE 64
+#define GUARD_BYTE 0xA5
+
+static const char* levelNames[] = { "scalar", "sse2", "avx2" };
+static const char* matrixNames[] = { "bt601", "bt709" };
+
+// Widths around the SIMD block sizes (8 and 16 pixels), odd ones included:
+// the last column of an odd width has no pair and is left out
+static const int testWidths[] = { 1, 2, 3, 4, 6, 7, 8, 10, 14, 15, 16, 17, 18, 22, 30, 31, 32, 33, 34,
+                                  46, 48, 50, 62, 64, 66, 94, 98, 130, 318, 320, 322, 641 };
+static const int testHeights[] = { 1, 2, 3, 4, 7 };
+// bytes of padding after each RGB row
+static const int testPaddings[] = { 0, 1, 5, 64 };
+
+typedef enum ImageKind
+{
+    IMAGE_RANDOM = 0,
+    IMAGE_BLACK = 1,
+    IMAGE_WHITE = 2,
+    IMAGE_PRIMARIES = 3,    // saturated colors, the chroma clamps
+    IMAGE_KIND_COUNT = 4
+} ImageKind;
+
+static const guint32 testFormats[] = { V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUV420 };
+static const char* formatNames[] = { "YUYV", "NV12", "I420" };
+
+static void fill_image(unsigned char* rgb, int size, ImageKind kind)
+{
+    static const unsigned char primaries[] = { 255, 0, 0, 0, 255, 0, 0, 0, 255, 255, 255, 0, 0, 255, 255, 255, 0, 255 };
+    for(int i = 0; i < size; i++)
+    {
+        switch(kind)
+        {
+        case IMAGE_BLACK:
+            rgb[i] = 0;
+            break;
+        case IMAGE_WHITE:
+            rgb[i] = 255;
+            break;
+        case IMAGE_PRIMARIES:
+            rgb[i] = primaries[i % sizeof(primaries)];
+            break;
+        default:
+            rgb[i] = (unsigned char) rand();
+            break;
+        }
+    }
+}
+
+// Output of one conversion, with guard bytes on both sides
+static unsigned char* convert(const unsigned char* rgb, int rgbStride, guint32 format, int width, int height,
+                              ColorMatrix matrix, SimdLevel level, int frameSize)
+{
+    unsigned char* out = (unsigned char*) malloc(frameSize + 2 * GUARD_SIZE);
+    memset(out, GUARD_BYTE, frameSize + 2 * GUARD_SIZE);
+    CColorConvert::setSimdLevel(level);
+    if(format == V4L2_PIX_FMT_YUYV)
+    {
+        CColorConvert::rgb24ToYUYV(rgb, rgbStride, out + GUARD_SIZE, width, height, matrix);
+    }
+    else
+    {
+        CColorConvert::rgb24ToYUV(rgb, rgbStride, format, out + GUARD_SIZE, width, height, matrix);
+    }
+    return out;
+}
+
+static bool guards_intact(const unsigned char* out, int frameSize)
+{
+    for(int i = 0; i < GUARD_SIZE; i++)
+    {
+        if(out[i] != GUARD_BYTE || out[GUARD_SIZE + frameSize + i] != GUARD_BYTE)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    SimdLevel supported = CColorConvert::getSupportedSimdLevel();
+    if(supported == SIMD_NONE)
+    {
+        printf("test-colorconvert: no SIMD level on this CPU, nothing to compare\n");
+        return TEST_SKIPPED;
+    }
+    srand(1);
+    int checks = 0;
+    int failures = 0;
+    for(unsigned int w = 0; w < sizeof(testWidths) / sizeof(testWidths[0]); w++)
+    for(unsigned int h = 0; h < sizeof(testHeights) / sizeof(testHeights[0]); h++)
+    for(unsigned int p = 0; p < sizeof(testPaddings) / sizeof(testPaddings[0]); p++)
+    for(int kind = 0; kind < IMAGE_KIND_COUNT; kind++)
+    {
+        int width = testWidths[w];
+        int height = testHeights[h];
+        int rgbStride = width * 3 + testPaddings[p];
+        // exactly the image, so reads past the last pixel show up under valgrind
+        int rgbSize = rgbStride * (height - 1) + width * 3;
+        unsigned char* rgb = (unsigned char*) malloc(rgbSize);
+        fill_image(rgb, rgbSize, (ImageKind) kind);
+        for(int matrix = COLOR_MATRIX_BT601; matrix <= COLOR_MATRIX_BT709; matrix++)
+        for(unsigned int f = 0; f < sizeof(testFormats) / sizeof(testFormats[0]); f++)
+        {
+            guint32 format = testFormats[f];
+            // the 4:2:0 layouts have no odd width, the chroma rows would be short
+            if(format != V4L2_PIX_FMT_YUYV && (width & 1) != 0)
+            {
+                continue;
+            }
+            int frameSize = CColorConvert::yuvFrameSize(format, width, height);
+            unsigned char* expected = convert(rgb, rgbStride, format, width, height, (ColorMatrix) matrix,
+                                              SIMD_NONE, frameSize);
+            if(!guards_intact(expected, frameSize))
+            {
+                printf("test-colorconvert: FAIL scalar %s %s %dx%d stride %d writes past the frame\n",
+                       matrixNames[matrix], formatNames[f], width, height, rgbStride);
+                failures++;
+            }
+            for(int level = SIMD_SSE2; level <= supported; level++)
+            {
+                unsigned char* actual = convert(rgb, rgbStride, format, width, height, (ColorMatrix) matrix,
+                                                (SimdLevel) level, frameSize);
+                checks++;
+                if(memcmp(expected, actual, frameSize + 2 * GUARD_SIZE) != 0 || !guards_intact(actual, frameSize))
+                {
+                    int offset = 0;
+                    while(offset < frameSize + 2 * GUARD_SIZE && expected[offset] == actual[offset])
+                    {
+                        offset++;
+                    }
+                    printf("test-colorconvert: FAIL %s %s %s %dx%d stride %d image %d: byte %d is %d, scalar gives %d\n",
+                           levelNames[level], matrixNames[matrix], formatNames[f], width, height, rgbStride, kind,
+                           offset - GUARD_SIZE, actual[offset], expected[offset]);
+                    failures++;
+                }
+                free(actual);
+            }
+            free(expected);
+        }
+        free(rgb);
+    }
+    printf("test-colorconvert: %d comparisons up to %s, %d failed\n", checks, levelNames[supported], failures);
+    return (failures == 0) ? 0 : 1;
+}